@@ -0,0 +1,282 @@
+#include <string.h>
+
+#include <3ds.h>
+#include "spi_client.h"
+
+static Result _Request(SPIClient* client) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	++client->requests;
+	Result res = svcSendSyncRequest(client->session);
+	return R_FAILED(res) ? res : (Result)cmdbuf[1];
+}
+
+Result SPIClient_Open(SPIClient* client, const char* service) {
+	Handle session;
+	Result res = srvGetServiceHandle(&session, service);
+	if (R_FAILED(res))
+		return res;
+
+	SPIClient_Attach(client, session);
+	client->owns_session = true;
+	return 0;
+}
+
+void SPIClient_Attach(SPIClient* client, Handle session) {
+	memset(client, 0, sizeof(*client));
+	client->session = session;
+}
+
+void SPIClient_Close(SPIClient* client) {
+	if (client->ring) {
+		SPIClient_BatchEnd(client);
+
+		u32* cmdbuf = getThreadCommandBuffer();
+		cmdbuf[0] = IPC_MakeHeader(0xB, 0, 0);
+		_Request(client);
+
+		svcCloseHandle(client->ring_block);
+		svcCloseHandle(client->doorbell);
+		svcCloseHandle(client->done);
+		client->ring = NULL;
+	}
+
+	if (client->owns_session)
+		svcCloseHandle(client->session);
+	client->session = 0;
+}
+
+Result SPIClient_InitDevice(SPIClient* client, u8 deviceid, u8 rate) {
+	if (deviceid > 6)
+		return SPI_INVALID_SELECTION;
+	if (client->init_rate[deviceid] == rate + 1)
+		return 0;
+
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x1, 2, 0);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = rate;
+
+	Result res = _Request(client);
+	if (R_SUCCEEDED(res))
+		client->init_rate[deviceid] = rate + 1;
+	return res;
+}
+
+// one at a time
+
+static Result _Read(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length, void* data, u32 length) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	bool inline_data = length <= SPICLIENT_INLINE_MAX;
+
+	cmdbuf[0] = inline_data ? IPC_MakeHeader(0x3, 4, 0) : IPC_MakeHeader(0x6, 4, 2);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = cmd;
+	cmdbuf[3] = cmd_length;
+	cmdbuf[4] = length;
+	if (!inline_data) {
+		cmdbuf[5] = IPC_Desc_Buffer(length, IPC_BUFFER_W);
+		cmdbuf[6] = (u32)data;
+	}
+
+	Result res = _Request(client);
+	if (R_SUCCEEDED(res) && inline_data)
+		memcpy(data, &cmdbuf[2], length);
+	return res;
+}
+
+static Result _Write(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length, const void* data, u32 length) {
+	u32* cmdbuf = getThreadCommandBuffer();
+
+	if (length <= SPICLIENT_INLINE_MAX) {
+		cmdbuf[0] = IPC_MakeHeader(0x4, 20, 0);
+		memcpy(&cmdbuf[4], data, length);
+		cmdbuf[20] = length;
+	} else {
+		cmdbuf[0] = IPC_MakeHeader(0x7, 4, 2);
+		cmdbuf[4] = length;
+		cmdbuf[5] = IPC_Desc_Buffer(length, IPC_BUFFER_R);
+		cmdbuf[6] = (u32)data;
+	}
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = cmd;
+	cmdbuf[3] = cmd_length;
+
+	return _Request(client);
+}
+
+static Result _Cmd(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x5, 3, 0);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = cmd;
+	cmdbuf[3] = cmd_length;
+	return _Request(client);
+}
+
+// batched
+
+static void _Flush(SPIClient* client) {
+	SPI_Ring* ring = client->ring;
+	u32 queued = client->queued;
+
+	if (!queued)
+		return;
+
+	__sync_synchronize(); // entries before the head that publishes them
+	ring->sub_head += queued;
+	svcSignalEvent(client->doorbell);
+	++client->requests;
+
+	u32 tail = ring->comp_tail;
+	for (u32 end = tail + queued; tail != end;) {
+		while (ring->comp_head == tail)
+			svcWaitSynchronization(client->done, U64_MAX);
+		__sync_synchronize();
+
+		const SPI_RingCompletion* comp = &ring->comp[tail & (SPI_RING_ENTRIES - 1)];
+		u32 index = comp->user;
+		if (R_FAILED(comp->result) && R_SUCCEEDED(client->batch_result))
+			client->batch_result = comp->result;
+		else if (index < SPI_RING_ENTRIES && client->pending[index].dest)
+			memcpy(client->pending[index].dest, &ring->data[client->pending[index].offset], client->pending[index].length);
+
+		ring->comp_tail = ++tail;
+	}
+
+	client->queued = 0;
+	client->data_used = 0;
+}
+
+static bool _CanQueue(SPIClient* client, u32 length) {
+	return client->batching && client->ring && length <= client->ring_data_size;
+}
+
+static void _Queue(SPIClient* client, u8 op, u8 deviceid, u32 cmd, u8 cmd_length, void* read_dest, const void* write_src, u32 length) {
+	u32 space = (length + 3) & ~3; // keeps every transfer word aligned for the NSPI FIFO
+
+	if (client->queued == SPI_RING_ENTRIES || space > client->ring_data_size - client->data_used)
+		_Flush(client);
+
+	SPI_Ring* ring = client->ring;
+	u32 index = client->queued++;
+	SPI_RingSubmission* sub = &ring->sub[(ring->sub_head + index) & (SPI_RING_ENTRIES - 1)];
+
+	sub->op = op;
+	sub->deviceid = deviceid;
+	sub->cmd_length = cmd_length;
+	sub->cmd = cmd;
+	sub->data_offset = client->data_used;
+	sub->data_length = length;
+	sub->user = index;
+
+	if (write_src)
+		memcpy(&ring->data[client->data_used], write_src, length);
+	client->pending[index] = (SPIClient_Queued){ read_dest, client->data_used, length };
+
+	client->data_used += space;
+	++client->batched;
+}
+
+// anything that doesn't go on the ring mid batch still has to come after what did
+static Result _Direct(SPIClient* client, Result res) {
+	if (client->batching && R_FAILED(res) && R_SUCCEEDED(client->batch_result))
+		client->batch_result = res;
+	return res;
+}
+
+Result SPIClient_Read(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length, void* data, u32 length) {
+	if (length && _CanQueue(client, length)) {
+		_Queue(client, SPI_RING_OP_READ, deviceid, cmd, cmd_length, data, NULL, length);
+		return 0;
+	}
+	_Flush(client);
+	return _Direct(client, _Read(client, deviceid, cmd, cmd_length, data, length));
+}
+
+Result SPIClient_Write(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length, const void* data, u32 length) {
+	if (length && _CanQueue(client, length)) {
+		_Queue(client, SPI_RING_OP_WRITE, deviceid, cmd, cmd_length, NULL, data, length);
+		return 0;
+	}
+	_Flush(client);
+	return _Direct(client, _Write(client, deviceid, cmd, cmd_length, data, length));
+}
+
+Result SPIClient_Cmd(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length) {
+	if (_CanQueue(client, 0)) {
+		_Queue(client, SPI_RING_OP_CMD_ONLY, deviceid, cmd, cmd_length, NULL, NULL, 0);
+		return 0;
+	}
+	_Flush(client);
+	return _Direct(client, _Cmd(client, deviceid, cmd, cmd_length));
+}
+
+Result SPIClient_Transfer(SPIClient* client, u8 deviceid, const SPIClient_Buffer* buffers, u32 count) {
+	if (!count || count > SPI_VECTOR_MAX)
+		return SPI_OUT_OF_RANGE;
+
+	_Flush(client);
+
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x1A, 1, count * 2);
+	cmdbuf[1] = deviceid;
+	for (u32 i = 0; i < count; ++i) {
+		cmdbuf[2 + i * 2] = IPC_Desc_Buffer(buffers[i].length, buffers[i].read ? IPC_BUFFER_W : IPC_BUFFER_R);
+		cmdbuf[3 + i * 2] = (u32)buffers[i].data;
+	}
+
+	return _Direct(client, _Request(client));
+}
+
+Result SPIClient_EnableBatching(SPIClient* client, void* block, u32 size) {
+	if (client->ring)
+		return SPI_RING_ALREADY_SETUP;
+	if (size <= sizeof(SPI_Ring) || size > SPI_RING_MAX_SIZE || (size & 0xFFF) || ((u32)block & 0xFFF))
+		return SPI_RING_INVALID_SIZE;
+
+	Handle handles[3] = { 0, 0, 0 };
+	Result res = svcCreateMemoryBlock(&handles[0], (u32)block, size, MEMPERM_READWRITE, MEMPERM_READWRITE);
+	if (R_SUCCEEDED(res))
+		res = svcCreateEvent(&handles[1], RESET_ONESHOT);
+	if (R_SUCCEEDED(res))
+		res = svcCreateEvent(&handles[2], RESET_ONESHOT);
+
+	if (R_SUCCEEDED(res)) {
+		memset(block, 0, sizeof(SPI_Ring));
+
+		u32* cmdbuf = getThreadCommandBuffer();
+		cmdbuf[0] = IPC_MakeHeader(0xA, 1, 4);
+		cmdbuf[1] = size;
+		cmdbuf[2] = IPC_Desc_SharedHandles(3);
+		cmdbuf[3] = handles[0];
+		cmdbuf[4] = handles[1];
+		cmdbuf[5] = handles[2];
+		res = _Request(client);
+	}
+
+	if (R_FAILED(res)) {
+		for (int i = 0; i < 3; ++i)
+			if (handles[i])
+				svcCloseHandle(handles[i]);
+		return res;
+	}
+
+	client->ring = (SPI_Ring*)block;
+	client->ring_data_size = size - sizeof(SPI_Ring);
+	client->ring_block = handles[0];
+	client->doorbell = handles[1];
+	client->done = handles[2];
+	return 0;
+}
+
+void SPIClient_BatchBegin(SPIClient* client) {
+	client->batching = true;
+	client->batch_result = 0;
+}
+
+Result SPIClient_BatchEnd(SPIClient* client) {
+	if (client->ring)
+		_Flush(client);
+	client->batching = false;
+	return client->batch_result;
+}
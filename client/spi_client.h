@@ -0,0 +1,90 @@
+/**
+ * @file spi_client.h
+ * @brief Client side of the spi module, for code talking to SPI::NOR, CD2, CS2, CS3 and DEF.
+ * Not built into the module, add client/spi_client.c to your own build, it needs libctru and include/spi.h only.
+ * The module's include/3ds headers are trimmed down, keep them behind libctru's, -idirafter for include/.
+ *
+ * Transfers of up to 64 bytes go inline (cmds 0x3/0x4), longer ones as buffers (cmds 0x6/0x7).
+ * Device init (cmd 0x1) is only sent when the rate changes. Between SPIClient_BatchBegin and SPIClient_BatchEnd
+ * transfers are queued on the shared memory ring (cmd 0xA) and sent together, if batching got enabled,
+ * otherwise they just go one by one. SPIClient_Transfer puts several buffers in one transaction (cmd 0x1A), never batched.
+ *
+ * An SPIClient is not thread safe, give each thread its own. The module takes one session per service,
+ * so threads each with their own session have to be on different services, or share one client under a lock.
+ */
+#pragma once
+#include <3ds.h>
+#include <spi.h>
+
+#define SPICLIENT_INLINE_MAX 64
+
+// a transfer on the ring, what it needs back when it completes
+typedef struct {
+	void* dest; // reads, where the data gets copied out to, NULL for anything else
+	u32 offset; // in the ring data area
+	u32 length;
+} SPIClient_Queued;
+
+// a buffer of SPIClient_Transfer
+typedef struct {
+	void* data;
+	u32 length;
+	bool read; // filled from the device, these come after all the ones sent to it
+} SPIClient_Buffer;
+
+typedef struct {
+	Handle session;
+	bool owns_session;
+	u8 init_rate[7]; // rate cmd 0x1 was last sent with, plus one, 0 if never
+
+	// ring, when batching is enabled
+	SPI_Ring* ring;
+	u32 ring_data_size;
+	Handle ring_block;
+	Handle doorbell;
+	Handle done;
+	bool batching;
+	u32 queued;
+	u32 data_used;
+	SPIClient_Queued pending[SPI_RING_ENTRIES];
+	Result batch_result;
+
+	u32 requests; // IPC requests sent
+	u32 batched;  // transfers that went over the ring instead
+} SPIClient;
+
+/// Opens a session to a service, SPI::NOR and so on.
+Result SPIClient_Open(SPIClient* client, const char* service);
+
+/// Uses an already opened session, left open by SPIClient_Close.
+void SPIClient_Attach(SPIClient* client, Handle session);
+
+/// Tears down batching, closes the session if SPIClient_Open opened it.
+void SPIClient_Close(SPIClient* client);
+
+/// Sets the device rate, cmd 0x1, only sent if this client didn't already send the same.
+Result SPIClient_InitDevice(SPIClient* client, u8 deviceid, u8 rate);
+
+/// Sends cmd then reads length bytes back. Batched reads only land in data at SPIClient_BatchEnd.
+Result SPIClient_Read(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length, void* data, u32 length);
+
+/// Sends cmd then length bytes of data. Batched writes copy data right away.
+Result SPIClient_Write(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length, const void* data, u32 length);
+
+/// Sends cmd alone.
+Result SPIClient_Cmd(SPIClient* client, u8 deviceid, u32 cmd, u8 cmd_length);
+
+/// Sends the buffers in order then fills the read ones, in one chip select window, up to SPI_VECTOR_MAX of them, cmd 0x1A.
+Result SPIClient_Transfer(SPIClient* client, u8 deviceid, const SPIClient_Buffer* buffers, u32 count);
+
+/**
+ * @brief Sets up the ring for batching, block is 0x1000 aligned and size a multiple of 0x1000, up to SPI_RING_MAX_SIZE.
+ * Fails on modules without cmd 0xA, batches then still work, just without saving anything.
+ */
+Result SPIClient_EnableBatching(SPIClient* client, void* block, u32 size);
+
+/// Starts queueing transfers.
+void SPIClient_BatchBegin(SPIClient* client);
+
+/// Sends whatever is queued and waits for it, returns the first failure of the batch.
+Result SPIClient_BatchEnd(SPIClient* client);
@@ -15,6 +15,35 @@ typedef enum {
 	ARBITRATION_DECREMENT_AND_WAIT_IF_LESS_THAN_TIMEOUT = 4, ///< If the memory at the address is strictly lower than #value, then decrement it and wait for signal or timeout.
 } ArbitrationType;
 
+/// Memory permission flags
+typedef enum {
+	MEMPERM_READ      = BIT(0),                        ///< Readable
+	MEMPERM_WRITE     = BIT(1),                        ///< Writable
+	MEMPERM_EXECUTE   = BIT(2),                        ///< Executable
+	MEMPERM_READWRITE = MEMPERM_READ | MEMPERM_WRITE,  ///< Readable and writable
+	MEMPERM_DONTCARE  = 0x10000000,                    ///< Don't care
+} MemPerm;
+
+/// Reset types (for use with events and timers)
+typedef enum {
+	RESET_ONESHOT = 0, ///< When the primitive is signaled, it will wake up exactly one thread and will clear itself automatically.
+	RESET_STICKY  = 1, ///< When the primitive is signaled, it will wake up all threads and it won't clear itself automatically.
+	RESET_PULSE   = 2, ///< Only meaningful for timers: same as ONESHOT but it will periodically signal the timer instead of just once.
+} ResetType;
+
+/// Memory information.
+typedef struct {
+	u32 base_addr; ///< Base address.
+	u32 size;      ///< Size.
+	u32 perm;      ///< Memory permissions. See @ref MemPerm
+	u32 state;     ///< Memory state.
+} MemInfo;
+
+/// Memory page information.
+typedef struct {
+	u32 flags; ///< Page flags.
+} PageInfo;
+
 /// Reasons for a user break.
 typedef enum {
 	USERBREAK_PANIC         = 0, ///< Panic.
@@ -179,6 +208,102 @@ static inline Result svcWaitSynchronizationN(s32* out, const Handle* handles, s3
 	return res;
 }
 
+/**
+ * @brief Creates an event handle.
+ * @param[out] event Pointer to output the created event handle to.
+ * @param reset_type Type of reset the event uses (RESET_ONESHOT/RESET_STICKY).
+ */
+static inline Result svcCreateEvent(Handle* event, ResetType reset_type) {
+	register ResetType _reset_type __asm__("r1") = reset_type;
+
+	register Result res __asm__("r0");
+	register Handle out_handle __asm__("r1");
+
+	__asm__ volatile ("svc\t0x17" : "=r"(res), "=r"(out_handle) : "r"(_reset_type) : "r2", "r3", "r12");
+
+	*event = out_handle;
+
+	return res;
+}
+
+/**
+ * @brief Signals an event.
+ * @param handle Handle of the event to signal.
+ */
+static inline Result svcSignalEvent(Handle handle) {
+	register const Handle _handle __asm__("r0") = handle;
+
+	register Result res __asm__("r0");
+
+	__asm__ volatile ("svc\t0x18" : "=r"(res) : "r"(_handle) : "r1", "r2", "r3", "r12", "memory");
+
+	return res;
+}
+
+/**
+ * @brief Maps a block of shared memory
+ * @param memblock Handle of the block
+ * @param addr Address of the memory to map, page-aligned. So its alignment must be 0x1000.
+ * @param my_perm Memory permissions for the current process
+ * @param other_perm Memory permissions for the other processes
+ *
+ * @note The shared memory block, and its rights, are created when using @ref svcCreateMemoryBlock.
+ */
+static inline Result svcMapMemoryBlock(Handle memblock, u32 addr, MemPerm my_perm, MemPerm other_perm) {
+	register const Handle _memblock __asm__("r0") = memblock;
+	register u32 _addr __asm__("r1") = addr;
+	register MemPerm _my_perm __asm__("r2") = my_perm;
+	register MemPerm _other_perm __asm__("r3") = other_perm;
+
+	register Result res __asm__("r0");
+
+	__asm__ volatile ("svc\t0x1F" : "=r"(res), "+r"(_addr), "+r"(_my_perm), "+r"(_other_perm) : "r"(_memblock) : "r12", "memory");
+
+	return res;
+}
+
+/**
+ * @brief Unmaps a block of shared memory
+ * @param memblock Handle of the block
+ * @param addr Address of the memory to unmap, page-aligned. So its alignment must be 0x1000.
+ */
+static inline Result svcUnmapMemoryBlock(Handle memblock, u32 addr) {
+	register const Handle _memblock __asm__("r0") = memblock;
+	register u32 _addr __asm__("r1") = addr;
+
+	register Result res __asm__("r0");
+
+	__asm__ volatile ("svc\t0x20" : "=r"(res), "+r"(_addr) : "r"(_memblock) : "r2", "r3", "r12", "memory");
+
+	return res;
+}
+
+/**
+ * @brief Queries memory information.
+ * @param[out] info Pointer to output memory info to.
+ * @param out Pointer to output page info to.
+ * @param addr Virtual memory address to query.
+ */
+static inline Result svcQueryMemory(MemInfo* info, PageInfo* out, u32 addr) {
+	register u32 _addr __asm__("r2") = addr;
+
+	register Result res __asm__("r0");
+	register u32 base_addr __asm__("r1");
+	register u32 perm __asm__("r3");
+	register u32 state __asm__("r4");
+	register u32 flags __asm__("r5");
+
+	__asm__ volatile ("svc\t0x02" : "=r"(res), "=r"(base_addr), "+r"(_addr), "=r"(perm), "=r"(state), "=r"(flags) : : "r12");
+
+	info->base_addr = base_addr;
+	info->size = _addr;
+	info->perm = perm;
+	info->state = state;
+	out->flags = flags;
+
+	return res;
+}
+
 /**
  * @brief Creates an address arbiter
  * @param[out] mutex Pointer to output the handle of the created address arbiter to.
@@ -220,6 +345,19 @@ static inline Result svcArbitrateAddress(Handle arbiter, u32 addr, ArbitrationTy
 	return res;
 }
 
+/**
+ * @brief Gets the current system tick.
+ * @return The current system tick, counting at 268111856Hz.
+ */
+static inline u64 svcGetSystemTick(void) {
+	register u32 lo __asm__("r0");
+	register u32 hi __asm__("r1");
+
+	__asm__ volatile ("svc\t0x28" : "=r"(lo), "=r"(hi) : : "r2", "r3", "r12");
+
+	return ((u64)hi << 32) | lo;
+}
+
 /**
  * @brief Sends a synchronized request to a session handle.
  * @param session Handle of the session.
@@ -10,3 +10,320 @@
 #define SPI_CANCELED_RANGE    MAKERESULT(RL_FATAL,     RS_CANCELED,     RM_SPI, RD_OUT_OF_RANGE)
 
 #define SPI_INVALID_SELECTION MAKERESULT(RL_PERMANENT, RS_NOTSUPPORTED, RM_SPI, RD_INVALID_SELECTION)
+
+#define SPI_RING_ALREADY_SETUP MAKERESULT(RL_PERMANENT, RS_INVALIDSTATE, RM_SPI, RD_ALREADY_INITIALIZED)
+#define SPI_RING_INVALID_SIZE  MAKERESULT(RL_USAGE,     RS_INVALIDARG,   RM_SPI, RD_INVALID_SIZE)
+
+#define SPI_TRACE_ALREADY_SETUP MAKERESULT(RL_PERMANENT, RS_INVALIDSTATE, RM_SPI, RD_ALREADY_INITIALIZED)
+#define SPI_TRACE_INVALID_SIZE  MAKERESULT(RL_USAGE,     RS_INVALIDARG,   RM_SPI, RD_INVALID_SIZE)
+#define SPI_TRACE_NOT_OWNER     MAKERESULT(RL_PERMANENT, RS_INVALIDSTATE, RM_SPI, RD_NOT_AUTHORIZED)
+
+#define SPI_NOR_NOT_FOUND       MAKERESULT(RL_PERMANENT, RS_NOTFOUND,     RM_SPI, RD_NOT_FOUND)
+#define SPI_NOR_MISALIGNED      MAKERESULT(RL_USAGE,     RS_INVALIDARG,   RM_SPI, RD_MISALIGNED_ADDRESS)
+#define SPI_NOR_VERIFY_FAILED   MAKERESULT(RL_PERMANENT, RS_INVALIDRESVAL, RM_SPI, RD_INVALID_RESULT_VALUE) // read back isn't what was programmed
+
+// controller didn't finish a transfer in time, it got reset and the bus is usable again, retrying is fine
+#define SPI_TIMEOUT             MAKERESULT(RL_TEMPORARY, RS_CANCELED,     RM_SPI, RD_TIMEOUT)
+
+// microprograms, cmds 0x1B to 0x1D
+#define SPI_PROG_INVALID        MAKERESULT(RL_USAGE,     RS_INVALIDARG,   RM_SPI, RD_INVALID_COMBINATION)
+#define SPI_PROG_NO_SLOT        MAKERESULT(RL_STATUS,    RS_OUTOFRESOURCE, RM_SPI, RD_OUT_OF_MEMORY)
+#define SPI_PROG_NOT_FOUND      MAKERESULT(RL_PERMANENT, RS_NOTFOUND,     RM_SPI, RD_INVALID_HANDLE)
+#define SPI_PROG_LIMIT          MAKERESULT(RL_TEMPORARY, RS_CANCELED,     RM_SPI, RD_TOO_LARGE) // ran out of steps or time
+
+// asynchronous transfers, cmds 0x1F and 0x20
+#define SPI_ASYNC_FULL          MAKERESULT(RL_STATUS,    RS_OUTOFRESOURCE, RM_SPI, RD_OUT_OF_MEMORY)
+#define SPI_ASYNC_NOT_FOUND     MAKERESULT(RL_PERMANENT, RS_NOTFOUND,     RM_SPI, RD_INVALID_HANDLE)
+#define SPI_ASYNC_PENDING       MAKERESULT(RL_STATUS,    RS_WOULDBLOCK,   RM_SPI, RD_BUSY) // not run yet, collect again later
+
+// stack debug builds only, a service thread ran past the bottom of its stack
+#define SPI_STACK_OVERFLOW      MAKERESULT(RL_FATAL,     RS_INTERNAL,     RM_SPI, RD_TOO_LARGE)
+
+// Shared memory ring transport, IPC cmds 0xA (setup) and 0xB (teardown)
+// Client owns a memory block laid out as SPI_Ring followed by the data area.
+// sub_head and comp_tail are only written by the client, sub_tail and comp_head only by spi.
+// Indexes are free running, slot is index & (SPI_RING_ENTRIES - 1).
+// After publishing submissions, client signals the doorbell event,
+// spi drains what it finds and signals the completion event once per batch.
+// If the completion ring is full spi stops draining, ring the doorbell again after reaping.
+// A submission for a device that doesn't exist completes with SPI_INVALID_SELECTION rather than panicking like IPC.
+// Setup takes the block's size, a multiple of 0x1000, and fails with SPI_RING_INVALID_SIZE if the block doesn't cover it.
+
+#define SPI_RING_ENTRIES       32
+#define SPI_RING_MAX_SIZE      0x10000
+
+#define SPI_RING_OP_READ       0x3 // same numbering as the IPC cmds they mirror
+#define SPI_RING_OP_WRITE      0x4
+#define SPI_RING_OP_CMD_ONLY   0x5
+
+typedef struct {
+	u8 op;
+	u8 deviceid;
+	u8 cmd_length;
+	u8 reserved;
+	u32 cmd;
+	u32 data_offset; // relative to the data area
+	u32 data_length;
+	u32 user;        // handed back untouched in the completion
+} SPI_RingSubmission;
+
+typedef struct {
+	u32 user;
+	Result result;
+} SPI_RingCompletion;
+
+typedef struct {
+	// client written
+	vu32 sub_head;
+	vu32 comp_tail;
+	u32 _pad0[6]; // keep each side's indexes in its own cache line
+	// spi written
+	vu32 sub_tail;
+	vu32 comp_head;
+	u32 _pad1[6];
+	SPI_RingSubmission sub[SPI_RING_ENTRIES];
+	SPI_RingCompletion comp[SPI_RING_ENTRIES];
+	u8 data[]; // rest of the memory block
+} SPI_Ring;
+
+// Per device flags, IPC cmd 0xC
+#define SPI_DEVICE_FLAG_COALESCE_READS BIT(0) // identical reads pending together share one transaction, only for side effect free reads
+#define SPI_DEVICE_FLAG_NSPI_CAPABLE   BIT(1) // device works on the NSPI controller, see below
+#define SPI_DEVICE_FLAG_READ_AHEAD     BIT(2) // cmd 0x6 plain reads (0x03) of consecutive ranges get the next one prefetched, NOR flash only
+
+// Transfer mode is per device, cmd 0x8 (0x9 for dev 6), and the bus is only switched when a transfer needs the other mode.
+// Devices left in legacy mode but flagged NSPI capable have transfers of SPI_AUTO_NSPI_MIN_LENGTH bytes or more
+// (cmd plus data) go through the NSPI controller at the same clock, everything shorter stays legacy.
+#define SPI_AUTO_NSPI_MIN_LENGTH       64
+
+// Per bus counters, IPC cmd 0xD
+typedef struct {
+	u32 transactions;    // transactions actually put on the bus
+	u32 coalesced_reads; // reads answered from another request's transaction, each one a transaction saved
+	u32 deadline_misses; // transactions that finished past the deadline their request carried
+	u32 timeouts;        // transactions the controller never finished, reset and failed with SPI_TIMEOUT
+	u32 mode_switches;   // times CFG11 had to flip the bus between legacy and NSPI for a transfer
+	u32 reordered;       // transactions let ahead of earlier waiters because they fit the bus mode as it was
+	u32 readahead_hits;   // streaming reads answered from the prefetch buffer
+	u32 readahead_misses; // streaming reads that still went to the bus, prefetch skipped, cut short or invalidated
+	u32 readahead_wasted; // prefetched bytes never handed to a client
+	u32 regcache_hits;     // register reads answered from the register cache
+	u32 regcache_misses;   // register reads on a cached device that still went to the bus
+	u32 regcache_saved_us; // bus time those hits would have taken, at the device's clock
+} SPI_BusStats;
+
+// Session scheduling class, IPC cmd 0xE, takes the class and a weight
+// Transactions waiting on a bus go real time first, earliest deadline first, then interactive in arrival order,
+// then bulk, where sessions share the bus by bytes moved, in proportion to 1 << weight.
+// A waiter that fits the bus's current mode can go ahead of up to two interactive or bulk ones that don't,
+// each of those only being passed over twice, real time waiters are never passed.
+// Until changed, SPI::CD2 is real time, SPI::NOR is bulk and everything else interactive.
+#define SPI_CLASS_REALTIME     0
+#define SPI_CLASS_INTERACTIVE  1
+#define SPI_CLASS_BULK         2
+
+#define SPI_WEIGHT_MAX         7
+
+// IPC cmds 0x3 to 0x7 take an optional deadline, one more normal parameter after the usual ones,
+// in microseconds from when the request arrives. It orders real time requests and gets misses counted,
+// late requests still run.
+
+// IPC capture, IPC cmds 0xF (start) and 0x10 (stop)
+// Client owns a memory block laid out as SPI_Trace, spi appends a record for every request any service gets,
+// capture control itself excepted, until the block is full, then only counts what it dropped.
+// One capture for the whole module, stopped by its owner or when the owner's session closes.
+// Records are published by bumping count, the block can be dumped as is for tools/hostsim replay.
+
+#define SPI_TRACE_MAX_SIZE     0x100000
+
+typedef struct {
+	u32 delta;       // ticks since the previous record, or since capture start, saturates
+	u32 header;      // as received
+	u32 args[3];     // normal parameters 1 to 3
+	u32 length;      // data length for cmds 0x3, 0x4, 0x6, 0x7, 0x12 to 0x14 and 0x1F, all buffers for 0x1A
+	u32 deadline;    // microseconds, 0 if the request carried none
+	u8 service;      // 0 to 4, SPI::NOR, CD2, CS2, CS3, DEF
+	u8 reserved[3];
+} SPI_TraceRecord;
+
+typedef struct {
+	vu32 count;
+	vu32 dropped;
+	u64 start_tick;
+	SPI_TraceRecord records[]; // rest of the memory block
+} SPI_Trace;
+
+// NOR flash commands, IPC cmds 0x11 (geometry), 0x12 (read), 0x13 (program) and 0x14 (erase)
+// All take the device id, 0x12 to 0x14 then a flash address and a length, with the client buffer for 0x12 and 0x13.
+// First use on a device reads its JEDEC ID, to know the size, erase opcodes and the read opcode to use.
+// Program splits on pages and erase picks the largest erase that fits, both sending write enable and
+// waiting out the write in progress bit themselves, holding the bus from write enable until it clears,
+// so another session's command can't land in between, other devices on the bus wait out an erase.
+// Erase address and length have to be multiples of erase_size.
+// 0x12 and 0x13 take one more normal parameter, a SPI_CHECK_* for a checksum of the data worked out as it goes
+// through the controller, returned after the result, with SPI_CHECK_VERIFY on 0x13 every page gets read back
+// once programmed and compared, failing with SPI_NOR_VERIFY_FAILED. Without it the reply is as before.
+
+typedef struct {
+	u32 jedec_id;    // manufacturer << 16 | memory type << 8 | capacity
+	u32 size;        // bytes
+	u32 page_size;   // largest single program
+	u32 erase_size;  // smallest erase
+	u8 read_opcode;  // 0x03, or 0x0B when the clock is past what plain read is good for
+	u8 read_dummy;   // dummy bytes after the address
+	u8 reserved[2];
+} SPI_NORGeometry;
+
+#define SPI_CHECK_NONE   0
+#define SPI_CHECK_CRC32  1 // the zlib one, reflected 0x04C11DB7
+#define SPI_CHECK_SUM32  2 // of little endian words, the last one padded with zeroes
+#define SPI_CHECK_VERIFY BIT(8)
+
+// Register updates, IPC cmds 0x15 (one) and 0x16 (list)
+// Read, mask in the new bits and write back, without letting anyone else on the bus in between.
+// 0x15 takes the device id and one SPI_RegUpdate inline, and returns the register as it was before.
+// 0x16 takes the device id, a count and a client buffer of that many SPI_RegUpdate, applied in order
+// in a single bus hold, and returns how many went through, stopping at the first one that fails.
+// When mask covers the whole register there's nothing to keep, so it's written without the read,
+// and 0x15 returns 0 as the register before, whatever the device had.
+
+#define SPI_REG_UPDATE_MAX     32 // per list
+
+typedef struct {
+	u32 read_cmd;        // opcode bytes that read the register, register bytes follow on the wire
+	u32 write_cmd;       // opcode bytes that write it, the new register bytes follow
+	u8 read_cmd_length;  // 0 to 4, 0 only when mask covers the whole register
+	u8 write_cmd_length; // 1 to 4
+	u8 width;            // register bytes, 1 to 4
+	u8 reserved;
+	u32 mask;            // bits to change, register bytes as on the wire with the first byte lowest
+	u32 value;
+} SPI_RegUpdate;
+
+// Register cache, IPC cmd 0x17, takes the device id, 1 to enable or 0 to disable, and SPI_RegCacheConfig
+// For codec style devices, a 1 byte command of (reg << addr_shift) | flag, then register bytes auto incrementing.
+// spi keeps the last value it read or wrote of every register that isn't volatile, reads wholly covered by that
+// are answered without the bus, writes always go through. Anything else sent to the device forgets what it had.
+// Paged devices have the page select register tracked too, registers are kept per page.
+
+#define SPI_REGCACHE_MAX_VOLATILE 8
+#define SPI_REGCACHE_ANY_PAGE     0xFF
+#define SPI_REGCACHE_NO_PAGE_REG  0xFF
+
+typedef struct {
+	u8 page;     // SPI_REGCACHE_ANY_PAGE for every page
+	u8 first;
+	u8 last;     // inclusive
+	u8 reserved;
+} SPI_RegRange;
+
+typedef struct {
+	u8 addr_shift;  // 1 to 7
+	u8 read_flag;   // low bits of the command for a read, below 1 << addr_shift
+	u8 write_flag;  // and for a write, the same
+	u8 page_reg;    // register selecting the page, SPI_REGCACHE_NO_PAGE_REG if not paged
+	u8 nvolatile;
+	u8 reserved[3];
+	SPI_RegRange volatile_regs[SPI_REGCACHE_MAX_VOLATILE]; // never cached, status and the like
+} SPI_RegCacheConfig;
+
+// Stack high water marks, IPC cmd 0x18, only in builds made with STACK_DEBUG=1, others answer it as an invalid header
+// Stacks are painted with SPI_STACK_CANARY before use, whatever isn't canary anymore from the bottom up was used.
+// Returns the main stack size, the service thread stack size, then SPI_STACK_COUNT peaks in bytes,
+// main first then the services in the order NOR, CD2, CS2, CS3, DEF, a service peak covering every session it had.
+// 0 for main means its stack couldn't be painted.
+
+#define SPI_STACK_CANARY 0xC5C5C5C5
+#define SPI_STACK_COUNT  6
+
+// Boot timeline, IPC cmd 0x19, returns SPI_BOOT_COUNT system ticks as low then high word each, 0 for what didn't happen yet
+// Services register SPI::CD2 first, on N3DS with its worker thread already up, so the codec gets served early in boot.
+
+#define SPI_BOOT_START           0 // _start
+#define SPI_BOOT_SYNC_INIT       1 // .bss cleared and the address arbiter up
+#define SPI_BOOT_SRV_INIT        2
+#define SPI_BOOT_CD2_REGISTERED  3 // SPI::CD2 takes sessions from here
+#define SPI_BOOT_ALL_REGISTERED  4
+#define SPI_BOOT_NOTIFICATION    5 // srv notifications enabled, startup done
+#define SPI_BOOT_FIRST_ACCEPT    6 // first session, any service
+#define SPI_BOOT_FIRST_REQUEST   7 // first request handled, any service
+#define SPI_BOOT_COUNT           8
+
+// Vectored transfer, IPC cmd 0x1A, takes the device id and then 1 to SPI_VECTOR_MAX buffer descriptors, all in one chip select window
+// Read only buffers (IPC_BUFFER_R) go to the device in order, then write only ones (IPC_BUFFER_W) get filled from it in order,
+// so a header and a payload kept apart, or a reply that belongs in several places, don't need a copy or a request each.
+// All the buffers the device reads from come first, none can be empty. On NSPI each buffer is a phase of its own,
+// moved a word at a time like cmds 0x6 and 0x7 do, so keep them word aligned with lengths a multiple of 4 there.
+// Replies with the result and the descriptors as they came. The register cache forgets the device, like any other unknown command.
+
+#define SPI_VECTOR_MAX 4
+
+// Microprograms, IPC cmds 0x1B (load), 0x1C (run) and 0x1D (free)
+// For device sequences that branch on what the device answers, send a command, poll until ready, read, retry on error,
+// run in one bus hold at bus speed instead of a request per step.
+// 0x1B takes the op count and a client buffer of that many SPI_ProgOp, keeps a checked copy and returns a handle.
+// 0x1C takes the handle, device id, SPI_PROG_REGS starting register values and a client buffer for output,
+// returns the result, the exit value, output bytes written, ops run and the registers as they ended.
+// 0x1D takes the handle. Only the session that loaded a program can run or free it, it goes away with the session too.
+// Running past SPI_PROG_MAX_STEPS ops or SPI_PROG_MAX_US fails with SPI_PROG_LIMIT. Running off the end exits with 0.
+// A transfer op whose bytes wouldn't be through by then fails the same way without starting, whatever it read so far stays.
+// A transfer op opens a chip select window when none is open, SPI_PROG_FLAG_END closes it after the op,
+// a window still open when the program stops gets closed. On NSPI every transfer op is a phase of its own.
+// The controller is the one the device is set to, transfers don't switch a device to NSPI by length here.
+
+#define SPI_PROG_MAX_OPS    32
+#define SPI_PROG_SLOTS      4     // loaded at once, all sessions together
+#define SPI_PROG_REGS       4
+#define SPI_PROG_MAX_STEPS  1024
+#define SPI_PROG_MAX_US     20000 // the bus is held all along
+
+// reg is 0 to SPI_PROG_REGS - 1, length 1 to 4 bytes unless said otherwise, bytes go first byte lowest like cmd words
+#define SPI_PROG_WRITE_IMM  0x1 // send length bytes of arg
+#define SPI_PROG_WRITE_REG  0x2 // send length bytes of reg
+#define SPI_PROG_READ_REG   0x3 // read length bytes into reg
+#define SPI_PROG_READ_OUT   0x4 // read arg bytes, or reg's value with SPI_PROG_FLAG_REG, into the output where it left off
+#define SPI_PROG_POLL       0x5 // read length bytes into reg over and over in the same window, until they match
+#define SPI_PROG_OUT_REG    0x6 // append length bytes of reg to the output
+#define SPI_PROG_SET        0x7 // reg = arg
+#define SPI_PROG_ADD        0x8 // reg += arg
+#define SPI_PROG_JUMP       0x9 // go to op length if reg matches, if it doesn't with SPI_PROG_FLAG_NOT, a 0 mask always matches
+#define SPI_PROG_DELAY      0xA // sleep arg microseconds
+#define SPI_PROG_EXIT       0xB // stop, with arg as the exit value
+
+#define SPI_PROG_FLAG_END   BIT(0) // transfer ops, close the window after
+#define SPI_PROG_FLAG_NOT   BIT(1) // jump
+#define SPI_PROG_FLAG_REG   BIT(2) // read out
+
+// arg of SPI_PROG_POLL and SPI_PROG_JUMP, matches when (reg & mask) == value
+#define SPI_PROG_MATCH(mask, value) (((u32)(mask) & 0xFFFF) | ((u32)(value) << 16))
+
+typedef struct {
+	u8 op;     // SPI_PROG_*
+	u8 flags;  // SPI_PROG_FLAG_*
+	u8 reg;
+	u8 length; // op index for jumps
+	u32 arg;
+} SPI_ProgOp;
+
+// Read conversion, IPC cmd 0x1E, takes the device id and SPI_CONVERT_* flags, 0 turns it off
+// Reads on the device, cmds 0x3 and 0x6 and ring reads, get converted in place right after the transfer,
+// so a codec or sensor's samples arrive ready to use. Lengths asked for are the converted ones, a multiple of 4,
+// buffers word aligned, anything else fails with SPI_OUT_OF_RANGE. At most one of SWAP16, SWAP32 and UNPACK12,
+// DEINTERLEAVE goes last and can't go with SWAP32. Read ahead is skipped for converted devices,
+// the register cache keeps what came off the wire.
+#define SPI_CONVERT_SWAP16       BIT(0) // big endian 16 bit samples
+#define SPI_CONVERT_SWAP32       BIT(1) // big endian 32 bit samples
+#define SPI_CONVERT_UNPACK12     BIT(2) // 12 bit samples packed two in 3 bytes, high bits first, device sends 3/4 of the length
+#define SPI_CONVERT_DEINTERLEAVE BIT(3) // two channels of 16 bit samples, left right pairs to all left then all right
+
+// Asynchronous transfers, IPC cmds 0x1F (submit) and 0x20 (collect)
+// 0x1F takes a SPI_RING_OP_*, the device id, cmd, cmd length, data offset and data length, like a ring submission,
+// with reads and writes using the ring's data area (cmd 0xA), and optionally an event, IPC_Desc_SharedHandles(1).
+// A bad op, device, cmd length or data range fails the submit itself, like it would the ring entry.
+// It replies with a ticket straight away, the transfer runs afterwards in between the session's requests,
+// in submission order, and the event gets signaled once it's done. The data area stays spi's until then.
+// 0x20 takes a ticket and 1 to wait or 0 not to, waiting runs it and whatever was submitted before it right there,
+// not waiting fails with SPI_ASYNC_PENDING while it's still queued. Returns the result, then the transfer's,
+// and frees the ticket, closing its event. Up to SPI_ASYNC_TICKETS from the oldest one not collected to the newest,
+// submitting past that fails with SPI_ASYNC_FULL. Whatever is left goes away with the session, run or not.
+#define SPI_ASYNC_TICKETS 8
@@ -30,15 +30,41 @@ Generally gathered history of spi module
 #define OS_INVALID_IPC_PARAMATER MAKERESULT(RL_PERMANENT, RS_WRONGARG,   RM_OS, 48)
 #define OS_MISALIGNED_ADDRESS    MAKERESULT(RL_USAGE,     RS_INVALIDARG, RM_OS, RD_MISALIGNED_ADDRESS)
 
+// every register access goes through these, lets tools/hostsim stand in for the hardware
+// on the console they are just the plain volatile access
+#ifndef MMIO_READ
+#define MMIO_READ(reg)           (reg)
+#define MMIO_WRITE(reg, val)     ((reg) = (val))
+#endif
+
 #define CFG11_SPI_CNT            (*(vu16*)0x1EC401C0)
 // since we got CFG11, SOCINFO to get if we got a core3, for n3ds specifically
 #define CFG11_SOCINFO            (*(vu16*)0x1EC40FFC)
 #define CFG11_SOCINFO_LGR2       BIT(2)
-#define IS_SOCINFO_LGR2_SET      ((CFG11_SOCINFO & CFG11_SOCINFO_LGR2) != 0)
+#define IS_SOCINFO_LGR2_SET      ((MMIO_READ(CFG11_SOCINFO) & CFG11_SOCINFO_LGR2) != 0)
 
 static __attribute__((section(".data.TerminationFlag"))) bool TerminationFlag = false;
 
 extern uptr _thread_stack_sp_top_offset;
+extern u64 _start_tick; // start.s, before anything else ran
+
+// boot timeline, IPC cmd 0x19
+static u64 SPI_BootTicks[SPI_BOOT_COUNT];
+
+static void SPIBoot_Mark(u32 milestone) {
+	SPI_BootTicks[milestone] = svcGetSystemTick();
+}
+
+// N3DS, CD2's worker is up before its first session and stays for the next ones, see SPIResidentThread
+static bool SPI_HasResident;
+static Handle SPI_ResidentWake; // main handed it a session, or none to have it exit
+static Handle SPI_ResidentIdle; // done with the last one
+
+// start.s leaves main 0x280, the service threads get theirs carved right below it
+#define SPI_MAIN_STACK_SIZE 0x280
+#ifndef SPI_THREAD_STACK_SIZE
+#define SPI_THREAD_STACK_SIZE 0x280
+#endif
 
 void _thread_start(void*);
 
@@ -81,45 +107,161 @@ typedef struct {
 	vu32 INT_STAT; // not used
 } NSPI_Bus_Regs;
 
+// ARM11 MPCore, n3ds CD2 runs on core 3 while the rest run on core 1
+#ifndef SPI_CACHE_LINE
+#define SPI_CACHE_LINE 32
+#endif
+
+// identical reads waiting on a busy bus get folded into a single transaction
+// only one fold can be going per bus, anything else just goes through as usual
+typedef enum {
+	SPI_SHARE_FREE    = 0,
+	SPI_SHARE_OPEN    = 1, // leader waiting on the bus, others may join
+	SPI_SHARE_RUNNING = 2, // leader got the bus, no more joins
+	SPI_SHARE_DONE    = 3, // data ready, waiting on joiners to copy it
+} SPI_ShareState;
+
 typedef struct {
-	SPI_Bus_Regs* const spi_bus;
-	NSPI_Bus_Regs* const nspi_bus;
-	LightLock lock;
-	bool is_nspi_mode;
-} SPI_Bus;
+	s32 state;   // SPI_ShareState, arbitrated on
+	s32 pending; // minus joiners still to copy, arbitrated on
+	u8 deviceid;
+	u8 cmd_length;
+	u32 cmd;
+	void* data;
+	u32 data_length;
+	Result result;
+} SPI_ReadShare;
+
+// running checksum of the data a transfer moves, worked out as it passes through the controller
+typedef struct {
+	u32 kind;  // SPI_CHECK_*
+	u32 value;
+	u32 count; // bytes so far, where the next one lands in its word
+} SPI_Checksum;
+
+// a transfer submitted with cmd 0x1F, run in between the session's requests
+#define SPI_ASYNC_FREE   0
+#define SPI_ASYNC_QUEUED 1
+#define SPI_ASYNC_DONE   2
+
+typedef struct {
+	SPI_RingSubmission sub; // user is the ticket
+	u8 state;               // SPI_ASYNC_*
+	Handle event;           // 0 if none
+	Result result;
+} SPI_AsyncTicket;
+
+typedef struct {
+	Handle handles[2]; // session, and ring doorbell when a ring is setup
+	Handle ring_block;
+	Handle ring_done;
+	SPI_Ring* ring;
+	u32 ring_data_size;
+	u8 sched_class;    // SPI_CLASS_*
+	u8 weight;         // bulk share is 1 << weight
+	u32 vtime;         // bulk only, bytes moved scaled by weight
+	u64 deadline;      // tick, of the request being served, 0 if none
+	u8 ra_deviceid;    // read ahead, device of the last plain read
+	u8 ra_streak;      // plain reads in a row that started where the previous one ended
+	bool ra_want;      // prefetch after replying
+	u32 ra_next;       // flash address right after the last plain read
+	u32 ra_length;
+	SPI_Checksum sum;  // of the NOR read or program being served, kept off the service stack
+	u32 async_next;    // ticket the next submit gets
+	u32 async_run;     // oldest ticket not run yet, async_next if none
+	SPI_AsyncTicket async[SPI_ASYNC_TICKETS]; // by ticket mod SPI_ASYNC_TICKETS
+} __attribute__((aligned(SPI_CACHE_LINE))) SPI_Session;
+
+// one per service, each service only allows a single session at a time, a line apart so threads don't share one
+static SPI_Session SPI_Sessions[5];
+
+// a transaction waiting for the bus, lives on the waiting thread's stack
+// what a waiting transaction needs the bus in, settings changes go in any
+#define SPI_MODE_LEGACY 0
+#define SPI_MODE_NSPI   1
+#define SPI_MODE_ANY    2
+
+typedef struct SPI_Waiter {
+	struct SPI_Waiter* next;
+	u8 sched_class;
+	u8 mode;  // SPI_MODE_*
+	u8 skips; // times a later waiter went first to save a mode switch
+	u32 vtime;
+	u64 deadline;
+	s32 granted; // arbitrated on
+} SPI_Waiter;
 
 typedef struct {
 	bool init;
 	u8 rate; // I'd imagine
+	u8 flags; // SPI_DEVICE_FLAG_*, not part of original spi
+	bool nspi; // mode set for the device, bus gets switched to it when a transfer needs it, also not part of original spi
+	u8 convert; // SPI_CONVERT_* done on reads, not part of original spi either
 } SPI_DeviceBaudrate;
 
+// controller registers as we last wrote them, so writes that wouldn't change anything are left out
+// MMIO is uncached and a lot slower than anything else a small transfer does, only the bus holder touches these
+typedef struct {
+	u16 cnt;    // legacy CNT, 0 when not known, never written through here as 0
+	bool idle;  // NSPI finished the last transfer clean, nothing to wait on before starting the next
+	u32 blklen; // NSPI BLKLEN plus one, 0 when not known
+} SPI_RegShadow;
+
+// a line each for what's read by every transfer, the scheduling lock, the read share and the counters,
+// so lock traffic on one bus doesn't keep pulling another bus's lines, or its own config, between cores
+typedef struct {
+	// read mostly, changed by device setup and mode switches
+	SPI_Bus_Regs* const spi_bus;
+	NSPI_Bus_Regs* const nspi_bus;
+	SPI_DeviceBaudrate devices[3]; // by device id mod 3, dev 6 is BUS2's only one
+	bool is_nspi_mode; // what CFG11 has the bus on right now, only changed while holding the bus
+
+	LightLock lock __attribute__((aligned(SPI_CACHE_LINE))); // guards the scheduling state below, never held across a transfer
+	bool busy;
+	u64 deadline;   // of the transaction on the bus
+	u32 bulk_vtime; // of the last bulk transaction granted
+	SPI_Waiter* waiters; // in the order they'll get the bus
+
+	LightLock share_lock __attribute__((aligned(SPI_CACHE_LINE)));
+	SPI_ReadShare share;
+
+	// bumped by whoever holds the bus, but for the register cache ones, cache hits never take it, those go through _StatAdd
+	SPI_BusStats stats __attribute__((aligned(SPI_CACHE_LINE)));
+	u32 regcache_saved_ns; // under a microsecond still to go into stats.regcache_saved_us, _StatAdd too
+	u32 device_writes[3]; // transactions that could change what a device reads back, read ahead checks it didn't move
+	SPI_RegShadow regs;
+	SPI_Checksum* sum; // the holder's, when it wants the data summed, NULL otherwise
+} __attribute__((aligned(SPI_CACHE_LINE))) SPI_Bus;
+
 // For consistency, I shall refer to as BUSes by the indexes of the list below
 // So refer to this list when if you see BUS0, BUS1 and BUS2 being referenced
 
 static SPI_Bus SPI_Bus_list[3] = {
 	{ /* for device ids 0, 1, 2 */
-		(SPI_Bus_Regs*)0x1EC60000,
-		(NSPI_Bus_Regs*)0x1EC60800,
-		LIGHTLOCK_STATICINIT,
-		false
+		.spi_bus = (SPI_Bus_Regs*)0x1EC60000,
+		.nspi_bus = (NSPI_Bus_Regs*)0x1EC60800,
+		.lock = LIGHTLOCK_STATICINIT,
+		.share_lock = LIGHTLOCK_STATICINIT
 	},
 	{ /* for device ids 3, 4, 5 */
-		(SPI_Bus_Regs*)0x1EC42000,
-		(NSPI_Bus_Regs*)0x1EC42800,
-		LIGHTLOCK_STATICINIT,
-		false
+		.spi_bus = (SPI_Bus_Regs*)0x1EC42000,
+		.nspi_bus = (NSPI_Bus_Regs*)0x1EC42800,
+		.lock = LIGHTLOCK_STATICINIT,
+		.share_lock = LIGHTLOCK_STATICINIT
 	},
 	{ /* for device id 6 */
-		(SPI_Bus_Regs*)0x1EC43000, // does it use this address? it appears whenever dev 6 was used in old SPI mode, wrong bus was used instead
-		//(SPI_Bus_Regs*)0x1EC42000, // the wrong bus originally used
-		(NSPI_Bus_Regs*)0x1EC43800,
-		LIGHTLOCK_STATICINIT,
-		false
+		.spi_bus = (SPI_Bus_Regs*)0x1EC43000, // does it use this address? it appears whenever dev 6 was used in old SPI mode, wrong bus was used instead
+		//.spi_bus = (SPI_Bus_Regs*)0x1EC42000, // the wrong bus originally used
+		.nspi_bus = (NSPI_Bus_Regs*)0x1EC43800,
+		.lock = LIGHTLOCK_STATICINIT,
+		.share_lock = LIGHTLOCK_STATICINIT
 	}
 };
 
-// adding extra slot for dev 6, whatever that is
-static SPI_DeviceBaudrate SPI_DeviceRates[7] = {0};
+
+// CFG11_SPI_CNT has the bits of all 3 buses, holding one bus isn't enough to modify it
+static LightLock SPI_CFGLock = LIGHTLOCK_STATICINIT;
+static u16 SPI_CFGShadow; // what it's set to, nobody else writes it while we run, so it never gets read back
 
 static SPI_Bus* GetBusFromDeviceId(u8 deviceid) {
 	if (deviceid <= 2)
@@ -131,6 +273,19 @@ static SPI_Bus* GetBusFromDeviceId(u8 deviceid) {
 	return NULL;
 }
 
+// lives with its bus now, device id already checked
+static SPI_DeviceBaudrate* SPIDevice_Config(u8 deviceid) {
+	return &GetBusFromDeviceId(deviceid)->devices[_mod3_u8(deviceid)];
+}
+
+// legacy 4MHz down to 512KHz is NSPI 4MHz down to 512KHz backwards, same clock but a word per FIFO access
+static u8 SPIDevice_Mode(u8 deviceid, u32 length) {
+	SPI_DeviceBaudrate* dev = SPIDevice_Config(deviceid);
+	if (dev->nspi || ((dev->flags & SPI_DEVICE_FLAG_NSPI_CAPABLE) && length >= SPI_AUTO_NSPI_MIN_LENGTH))
+		return SPI_MODE_NSPI;
+	return SPI_MODE_LEGACY;
+}
+
 static int GetBusIndexFromDeviceId(u8 deviceid) {
 	if (deviceid <= 2)
 		return 0;
@@ -152,22 +307,140 @@ static int GetBusIndexFromDeviceId(u8 deviceid) {
 #define NSPI_FIFO_WIDTH             (32)
 #define NSPI_STATUS_FIFO_FULL_BIT   BIT(0)
 
+// legacy SPI has no FIFO, every byte needs us there, but at the slow rates a byte is long enough
+// to sleep through most of it and let the core do something else, then spin out the rest
+// how late wakeups run is measured as we go, once sleeping can't pay off for a rate it's just spinning
+#define SPI_SLEEP_MIN_NS            6000 // shorter sleeps aren't worth the trip through the scheduler
+#define SPI_WAKE_LATENCY_INIT_NS    3000
+
+// on top of the transfer's own time, covers oversleeping and getting preempted
+#define SPI_TIMEOUT_SLACK_NS        2000000
+#define SPI_TIMEOUT_POLL_MASK       63
+
+// waiters looked at for one that fits the bus mode as it is, and how often one can be passed over for that
+#define SPI_REORDER_WINDOW          3
+#define SPI_REORDER_MAX_SKIPS       2
+
 // silences any alignment warnings
 #define SILENT_PTR_CAST(type, ptr, i)   ((type*)(void*)(((u8*)ptr) + (i)))
 
-static void __SPIWriteLoop(SPI_Bus_Regs* bus, const void* data, u32 length) {
+// the transfer kernels and request dispatch, built for speed in the HOT_PATHS=1 profile, for size like the rest otherwise
+// still no loops turned into memcpy/memset calls, there's no libc to call into
+#ifdef SPI_HOT_PATHS
+#define SPI_HOT __attribute__((hot, optimize("O2", "no-tree-loop-distribute-patterns")))
+#else
+#define SPI_HOT
+#endif
+
+static u32 __SPIGetRateByteTime(u8 rate) {
+	return 2000u << (rate & 3); // 4MHz, 2MHz, 1MHz, 512KHz, 8 bits each
+}
+
+// every hardware wait gives up when it alone went on for the transfer's budget of ticks
+// the clock only starts and gets looked at every so many polls, waits that end quickly never read the tick
+// per wait rather than per transfer, so being preempted halfway through doesn't eat into it
+// busy still gets one last look after expiry
+static bool __SPITimedOut(u32* polls, u64* expiry, u64 budget) {
+	if ((++*polls & SPI_TIMEOUT_POLL_MASK) != 0)
+		return false;
+	u64 now = svcGetSystemTick();
+	if (!*expiry) {
+		*expiry = now + budget;
+		return false;
+	}
+	return now > *expiry;
+}
+
+// a nibble at a time, 64 bytes of table instead of 1KiB, next to an uncached FIFO access it's free
+static const u32 SPI_CRC32Nibble[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+// bytes is 1 to 4, first byte lowest like everything else here
+static SPI_HOT void __SPIChecksum(SPI_Checksum* sum, u32 word, u32 bytes) {
+	if (bytes < 4)
+		word &= ~(~0u << (bytes * 8));
+
+	if (sum->kind == SPI_CHECK_CRC32) {
+		u32 crc = sum->value ^ word;
+		for (u32 i = bytes * 2; i; --i)
+			crc = (crc >> 4) ^ SPI_CRC32Nibble[crc & 0xF];
+		sum->value = crc;
+	} else {
+		// a word can straddle two when an earlier phase left off mid word, both halves just add up
+		u32 shift = (sum->count & 3) * 8;
+		sum->value += word << shift;
+		if (shift)
+			sum->value += word >> (32 - shift);
+	}
+
+	sum->count += bytes;
+}
+
+// shared by all threads, two of them racing on it only costs a less accurate guess
+static u32 SPI_WakeLatencyNs = SPI_WAKE_LATENCY_INIT_NS;
+
+static SPI_HOT bool __SPIWaitBusy(SPI_Bus_Regs* bus, u32 byte_ns, u64 budget) {
+	u32 latency = SPI_WakeLatencyNs;
+	u32 polls = 0;
+	u64 expiry = 0;
+
+	// look before going to sleep, whatever the caller did since kicking the byte off may have covered it already
+	if (!(MMIO_READ(bus->CNT) & SPI_BUS_BUSY_BIT))
+		return true;
+
+	// and only sleep when the byte outlasts the measured wake latency, so at 4MHz and 2MHz this never sleeps,
+	// the legacy controller moves a byte at a time, there's no longer stretch to sleep across
+	if (byte_ns >= latency + SPI_SLEEP_MIN_NS) {
+		u32 sleep_ns = byte_ns - latency;
+		u64 start = svcGetSystemTick();
+		svcSleepThread(sleep_ns);
+		u64 slept_ns = ((svcGetSystemTick() - start) * 3819u) >> 10; // ~1000 / 268.11, no division
+		u32 late_ns = slept_ns <= sleep_ns ? 0 : slept_ns - sleep_ns > byte_ns ? byte_ns : (u32)(slept_ns - sleep_ns);
+		SPI_WakeLatencyNs = latency - (latency >> 3) + (late_ns >> 3);
+	} else if (byte_ns >= SPI_SLEEP_MIN_NS) {
+		// let the guess drift down, so one bad stretch of wakeups doesn't mean spinning for good
+		SPI_WakeLatencyNs = latency - (latency >> 8);
+	}
+
+	while (MMIO_READ(bus->CNT) & SPI_BUS_BUSY_BIT) {
+		if (__SPITimedOut(&polls, &expiry, budget))
+			return !(MMIO_READ(bus->CNT) & SPI_BUS_BUSY_BIT);
+	}
+	return true;
+}
+
+static SPI_HOT bool __SPIWriteLoop(SPI_Bus_Regs* bus, const void* data, u32 length, u32 byte_ns, u64 budget, SPI_Checksum* sum) {
 	for (u32 i = 0; i < length; ++i) {
-		bus->DATA = *SILENT_PTR_CAST(const u8, data, i);
-		while (bus->CNT & SPI_BUS_BUSY_BIT);
+		u8 byte = *SILENT_PTR_CAST(const u8, data, i);
+		MMIO_WRITE(bus->DATA, byte);
+		if (sum)
+			__SPIChecksum(sum, byte, 1); // while the controller shifts it out
+		if (!__SPIWaitBusy(bus, byte_ns, budget))
+			return false;
 	}
+	return true;
 }
 
-static void __SPIReadLoop(SPI_Bus_Regs* bus, void* data, u32 length) {
+static void __SPIWriteCNT(SPI_Bus_Regs* bus, SPI_RegShadow* shadow, u16 cnt) {
+	if (shadow->cnt == cnt)
+		return;
+	MMIO_WRITE(bus->CNT, cnt);
+	shadow->cnt = cnt;
+}
+
+static SPI_HOT bool __SPIReadLoop(SPI_Bus_Regs* bus, void* data, u32 length, u32 byte_ns, u64 budget, SPI_Checksum* sum) {
 	for (u32 i = 0; i < length; ++i) {
-		bus->DATA = 0; // full duplex go brrrr
-		while (bus->CNT & SPI_BUS_BUSY_BIT);
-		*SILENT_PTR_CAST(u8, data, i) = bus->DATA;
+		MMIO_WRITE(bus->DATA, 0); // full duplex go brrrr
+		if (!__SPIWaitBusy(bus, byte_ns, budget))
+			return false;
+		u8 byte = MMIO_READ(bus->DATA);
+		*SILENT_PTR_CAST(u8, data, i) = byte;
+		if (sum)
+			__SPIChecksum(sum, byte, 1);
 	}
+	return true;
 }
 
 // Old SPI register mode would use device 6 with BUS1 device select 3 in the spi binary
@@ -176,48 +449,72 @@ static void __SPIReadLoop(SPI_Bus_Regs* bus, void* data, u32 length) {
 // device 6 should not be a thing that happens in normal retail environment situations however
 // but still like to see things clear, also documentation reasons
 
-static void _SPISendCmdOnly(SPI_Bus_Regs* bus, u8 deviceid, u8 rate, const void* cmd, u32 length) {
+// transfer kernels give false when the controller got stuck on a wait past the budget, bus is left for recovery
+
+static bool _SPISendCmdOnly(SPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const void* cmd, u32 length, u64 budget) {
+	u32 byte_ns = __SPIGetRateByteTime(rate);
+
 	deviceid = _mod3_u8(deviceid);
 
-	bus->CNT = SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate;
+	// a single byte command has nothing to hold chip select over
+	if (length > 1) {
+		__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate);
 
-	__SPIWriteLoop(bus, cmd, length - 1);
+		if (!__SPIWriteLoop(bus, cmd, length - 1, byte_ns, budget, NULL))
+			return false;
+	}
 
-	bus->CNT = SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate;
+	__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate);
 
-	bus->DATA = *SILENT_PTR_CAST(const u8, cmd, length - 1);
-	while (bus->CNT & SPI_BUS_BUSY_BIT);
+	MMIO_WRITE(bus->DATA, *SILENT_PTR_CAST(const u8, cmd, length - 1));
+	return __SPIWaitBusy(bus, byte_ns, budget);
 }
 
-static void _SPICmdAndReadBuf(SPI_Bus_Regs* bus, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
+static bool _SPICmdAndReadBuf(SPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, void* data, u32 data_length, SPI_Checksum* sum, u64 budget) {
+	u32 byte_ns = __SPIGetRateByteTime(rate);
+
 	deviceid = _mod3_u8(deviceid);
 
-	bus->CNT = SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate;
+	__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate);
 
-	__SPIWriteLoop(bus, cmd, cmd_length);
+	if (!__SPIWriteLoop(bus, cmd, cmd_length, byte_ns, budget, NULL))
+		return false;
 
-	__SPIReadLoop(bus, data, data_length - 1);
+	if (!__SPIReadLoop(bus, data, data_length - 1, byte_ns, budget, sum))
+		return false;
 
-	bus->CNT = SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate;
+	__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate);
 
-	bus->DATA = 0;
-	while (bus->CNT & SPI_BUS_BUSY_BIT);
-	*SILENT_PTR_CAST(u8, data, data_length - 1) = bus->DATA;
+	MMIO_WRITE(bus->DATA, 0);
+	if (!__SPIWaitBusy(bus, byte_ns, budget))
+		return false;
+	u8 last = MMIO_READ(bus->DATA);
+	*SILENT_PTR_CAST(u8, data, data_length - 1) = last;
+	if (sum)
+		__SPIChecksum(sum, last, 1);
+	return true;
 }
 
-static void _SPICmdAndWriteBuf(SPI_Bus_Regs* bus, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, const void* data, u32 data_length) {
+static bool _SPICmdAndWriteBuf(SPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, const void* data, u32 data_length, SPI_Checksum* sum, u64 budget) {
+	u32 byte_ns = __SPIGetRateByteTime(rate);
+
 	deviceid = _mod3_u8(deviceid);
 
-	bus->CNT = SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate;
+	__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate);
 
-	__SPIWriteLoop(bus, cmd, cmd_length);
+	if (!__SPIWriteLoop(bus, cmd, cmd_length, byte_ns, budget, NULL))
+		return false;
 
-	__SPIWriteLoop(bus, data, data_length - 1);
+	if (!__SPIWriteLoop(bus, data, data_length - 1, byte_ns, budget, sum))
+		return false;
 
-	bus->CNT = SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate;
+	__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate);
 
-	bus->DATA = *SILENT_PTR_CAST(const u8, data, data_length - 1);
-	while (bus->CNT & SPI_BUS_BUSY_BIT);
+	u8 last = *SILENT_PTR_CAST(const u8, data, data_length - 1);
+	MMIO_WRITE(bus->DATA, last);
+	if (sum)
+		__SPIChecksum(sum, last, 1);
+	return __SPIWaitBusy(bus, byte_ns, budget);
 }
 
 static u64 __NSPIGetRateReadSleepTime(u8 rate) {
@@ -234,357 +531,2825 @@ static u64 __NSPIGetRateReadSleepTime(u8 rate) {
 	return 537600LLU; // rate == 0 || rate >= 6
 }
 
-static void __NSPIWriteLoop(NSPI_Bus_Regs* bus, const void* data, u32 length) {
+static SPI_HOT bool __NSPIWaitIdle(NSPI_Bus_Regs* bus, u64 budget) {
+	u32 polls = 0;
+	u64 expiry = 0;
+	while (MMIO_READ(bus->CNT) & NSPI_BUS_BUSY_BIT) {
+		if (__SPITimedOut(&polls, &expiry, budget))
+			return !(MMIO_READ(bus->CNT) & NSPI_BUS_BUSY_BIT);
+	}
+	return true;
+}
+
+static SPI_HOT bool __NSPIWaitFIFO(NSPI_Bus_Regs* bus, u64 budget) {
+	u32 polls = 0;
+	u64 expiry = 0;
+	while (MMIO_READ(bus->STATUS) & NSPI_STATUS_FIFO_FULL_BIT) {
+		if (__SPITimedOut(&polls, &expiry, budget))
+			return !(MMIO_READ(bus->STATUS) & NSPI_STATUS_FIFO_FULL_BIT);
+	}
+	return true;
+}
+
+// the FIFO is empty when a write phase starts, the first block goes in without asking
+static SPI_HOT bool __NSPIWriteLoop(NSPI_Bus_Regs* bus, const void* data, u32 length, u64 budget, SPI_Checksum* sum) {
 	for (u32 i = 0; i < length; i += 4) {
-		if ((i & (NSPI_FIFO_WIDTH - 1)) == 0) {
-			while (bus->STATUS & NSPI_STATUS_FIFO_FULL_BIT);
+		if (i && (i & (NSPI_FIFO_WIDTH - 1)) == 0) {
+			if (!__NSPIWaitFIFO(bus, budget))
+				return false;
 		}
-		bus->FIFO = *SILENT_PTR_CAST(const u32, data, i);
+		u32 word = 0;
+		if (length - i >= 4)
+			word = *SILENT_PTR_CAST(const u32, data, i);
+		else // last bytes, a whole word would read past the buffer
+			for (u32 j = length; j-- > i;)
+				word = word << 8 | *SILENT_PTR_CAST(const u8, data, j);
+		MMIO_WRITE(bus->FIFO, word);
+		if (sum)
+			__SPIChecksum(sum, word, length - i < 4 ? length - i : 4);
 	}
 
-	while (bus->CNT & NSPI_BUS_BUSY_BIT);
+	return __NSPIWaitIdle(bus, budget);
 }
 
-static void __NSPIReadLoop(NSPI_Bus_Regs* bus, void* data, u32 length, u64 sleep_wait) {
+static SPI_HOT bool __NSPIReadLoop(NSPI_Bus_Regs* bus, void* data, u32 length, u64 sleep_wait, u64 budget, SPI_Checksum* sum) {
 	for (u32 i = 0; i < length; i += 4) {
 		if ((i & (NSPI_FIFO_WIDTH - 1)) == 0) {
-			while (bus->STATUS & NSPI_STATUS_FIFO_FULL_BIT);
+			if (!__NSPIWaitFIFO(bus, budget))
+				return false;
 			if (length >= NSPI_FIFO_WIDTH * 2)
 				svcSleepThread(sleep_wait);
 		}
-		*SILENT_PTR_CAST(u32, data, i) = bus->FIFO;
+		u32 word = MMIO_READ(bus->FIFO);
+		if (sum)
+			__SPIChecksum(sum, word, length - i < 4 ? length - i : 4);
+		if (length - i >= 4)
+			*SILENT_PTR_CAST(u32, data, i) = word;
+		else // last bytes, a whole word would land past the buffer, the end of a ring's data area for one
+			for (u32 j = i; j < length; ++j, word >>= 8)
+				*SILENT_PTR_CAST(u8, data, j) = (u8)word;
+	}
+
+	return __NSPIWaitIdle(bus, budget);
+}
+
+// the busy bit only needs a look when the last transfer didn't finish through here
+static bool __NSPIStart(NSPI_Bus_Regs* bus, SPI_RegShadow* shadow, u64 budget) {
+	if (shadow->idle) {
+		shadow->idle = false;
+		return true;
 	}
+	return __NSPIWaitIdle(bus, budget);
+}
+
+static void __NSPIWriteBLKLEN(NSPI_Bus_Regs* bus, SPI_RegShadow* shadow, u32 length) {
+	if (shadow->blklen == length + 1)
+		return;
+	MMIO_WRITE(bus->BLKLEN, length);
+	shadow->blklen = length + 1;
+}
 
-	while (bus->CNT & NSPI_BUS_BUSY_BIT);
+static void __NSPIDone(NSPI_Bus_Regs* bus, SPI_RegShadow* shadow) {
+	MMIO_WRITE(bus->DONE, 0);
+	shadow->idle = true;
 }
 
-static void _NSPISendCmdOnly(NSPI_Bus_Regs* bus, u8 deviceid, u8 rate, const void* cmd, u32 length) {
+static bool _NSPISendCmdOnly(NSPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const void* cmd, u32 length, u64 budget) {
 	deviceid = _mod3_u8(deviceid);
 
-	while (bus->CNT & NSPI_BUS_BUSY_BIT);
+	if (!__NSPIStart(bus, shadow, budget))
+		return false;
 
-	bus->BLKLEN = length;
-	bus->CNT = NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate;
+	__NSPIWriteBLKLEN(bus, shadow, length);
+	MMIO_WRITE(bus->CNT, NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate);
 
-	__NSPIWriteLoop(bus, cmd, length);
+	if (!__NSPIWriteLoop(bus, cmd, length, budget, NULL))
+		return false;
 
-	bus->DONE = 0;
+	__NSPIDone(bus, shadow);
+	return true;
 }
 
-static void _NSPICmdAndReadBuf(NSPI_Bus_Regs* bus, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
+static bool _NSPICmdAndReadBuf(NSPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, void* data, u32 data_length, SPI_Checksum* sum, u64 budget) {
 	u64 sleep_wait = __NSPIGetRateReadSleepTime(rate);
 
 	deviceid = _mod3_u8(deviceid);
 
-	while (bus->CNT & NSPI_BUS_BUSY_BIT);
+	if (!__NSPIStart(bus, shadow, budget))
+		return false;
 
-	bus->BLKLEN = cmd_length;
-	bus->CNT = NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate;
+	__NSPIWriteBLKLEN(bus, shadow, cmd_length);
+	MMIO_WRITE(bus->CNT, NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate);
 
-	__NSPIWriteLoop(bus, cmd, cmd_length);
+	if (!__NSPIWriteLoop(bus, cmd, cmd_length, budget, NULL))
+		return false;
 
-	bus->BLKLEN = data_length;
-	bus->CNT = NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_READ_BIT | (deviceid << 6) | rate;
+	__NSPIWriteBLKLEN(bus, shadow, data_length);
+	MMIO_WRITE(bus->CNT, NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_READ_BIT | (deviceid << 6) | rate);
 
-	__NSPIReadLoop(bus, data, data_length, sleep_wait);
+	if (!__NSPIReadLoop(bus, data, data_length, sleep_wait, budget, sum))
+		return false;
 
-	bus->DONE = 0;
+	__NSPIDone(bus, shadow);
+	return true;
 }
 
-static void _NSPICmdAndWriteBuf(NSPI_Bus_Regs* bus, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, const void* data, u32 data_length) {
+static bool _NSPICmdAndWriteBuf(NSPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const void* cmd, u32 cmd_length, const void* data, u32 data_length, SPI_Checksum* sum, u64 budget) {
 	deviceid = _mod3_u8(deviceid);
 
-	while (bus->CNT & NSPI_BUS_BUSY_BIT);
+	if (!__NSPIStart(bus, shadow, budget))
+		return false;
 
-	bus->BLKLEN = cmd_length;
-	bus->CNT = NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate;
+	__NSPIWriteBLKLEN(bus, shadow, cmd_length);
+	MMIO_WRITE(bus->CNT, NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate);
 
-	__NSPIWriteLoop(bus, cmd, cmd_length);
+	if (!__NSPIWriteLoop(bus, cmd, cmd_length, budget, NULL))
+		return false;
 
-	bus->BLKLEN = data_length;
-	bus->CNT = NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate;
+	__NSPIWriteBLKLEN(bus, shadow, data_length);
+	MMIO_WRITE(bus->CNT, NSPI_BUS_ENABLE_BIT | NSPI_BUS_TRANSFER_WRITE_BIT | (deviceid << 6) | rate);
 
-	__NSPIWriteLoop(bus, data, data_length);
+	if (!__NSPIWriteLoop(bus, data, data_length, budget, sum))
+		return false;
 
-	bus->DONE = 0;
+	__NSPIDone(bus, shadow);
+	return true;
 }
 
-static void SPIIPC_InitDeviceRate(u8 deviceid, u8 rate) {
-	// original SPI does not prevent a buffer overrun, also did not have a slot for dev 6 despite having supposed support for it
-	if (deviceid > 6)
-		Err_Panic(SPI_INVALID_SELECTION);
-
-	SPI_DeviceRates[deviceid].init = true;
-	SPI_DeviceRates[deviceid].rate = rate;
-}
+// vectored transfers, cmd 0x1A, client buffers straight onto the bus, the first nwrite of them out, the rest in
 
-static Result SPIIPC_SendCmdAndRead(u8 deviceid, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
-	if (cmd_length > 4)
-		return SPI_OUT_OF_RANGE;
+typedef struct {
+	u8* data;
+	u32 length; // never 0
+} SPI_Segment;
 
-	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+static bool _SPIVector(SPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const SPI_Segment* segs, u32 count, u32 nwrite, u64 budget) {
+	u32 byte_ns = __SPIGetRateByteTime(rate);
+	const SPI_Segment* last = &segs[count - 1];
 
-	if (!bus) // extra checks not part of original spi binary, my way to check if cant do this device
-		Err_Panic(SPI_INVALID_SELECTION);
+	deviceid = _mod3_u8(deviceid);
 
-	if (!SPI_DeviceRates[deviceid].init)
-		return SPI_NOT_INITIALIZED;
+	__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate);
 
-	LightLock_Lock(&bus->lock);
+	for (u32 i = 0; i < count; ++i) {
+		u32 length = &segs[i] == last ? segs[i].length - 1 : segs[i].length; // very last byte goes without the hold
+		bool done = i < nwrite ? __SPIWriteLoop(bus, segs[i].data, length, byte_ns, budget, NULL)
+			: __SPIReadLoop(bus, segs[i].data, length, byte_ns, budget, NULL);
+		if (!done)
+			return false;
+	}
 
-	if (bus->is_nspi_mode)
-		_NSPICmdAndReadBuf(bus->nspi_bus, deviceid, SPI_DeviceRates[deviceid].rate, cmd, cmd_length, data, data_length);
-	else
-		_SPICmdAndReadBuf(bus->spi_bus, deviceid, SPI_DeviceRates[deviceid].rate, cmd, cmd_length, data, data_length);
+	__SPIWriteCNT(bus, shadow, SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate);
 
-	LightLock_Unlock(&bus->lock);
+	if (nwrite == count) {
+		MMIO_WRITE(bus->DATA, last->data[last->length - 1]);
+		return __SPIWaitBusy(bus, byte_ns, budget);
+	}
 
-	return 0;
+	MMIO_WRITE(bus->DATA, 0);
+	if (!__SPIWaitBusy(bus, byte_ns, budget))
+		return false;
+	last->data[last->length - 1] = MMIO_READ(bus->DATA);
+	return true;
 }
 
-static Result SPIIPC_SendCmdAndWrite(u8 deviceid, const void* cmd, u32 cmd_length, const void* data, u32 data_length) {
-	if (cmd_length > 4)
-		return SPI_OUT_OF_RANGE;
+// a phase per buffer, chip select stays down between them until DONE
+static bool _NSPIVector(NSPI_Bus_Regs* bus, SPI_RegShadow* shadow, u8 deviceid, u8 rate, const SPI_Segment* segs, u32 count, u32 nwrite, u64 budget) {
+	u64 sleep_wait = __NSPIGetRateReadSleepTime(rate);
 
-	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+	deviceid = _mod3_u8(deviceid);
 
-	if (!bus) // extra checks not part of original spi binary, my way to check if cant do this device
-		Err_Panic(SPI_INVALID_SELECTION);
+	if (!__NSPIStart(bus, shadow, budget))
+		return false;
 
-	if (!SPI_DeviceRates[deviceid].init)
-		return SPI_NOT_INITIALIZED;
+	for (u32 i = 0; i < count; ++i) {
+		bool write = i < nwrite;
+
+		__NSPIWriteBLKLEN(bus, shadow, segs[i].length);
+		MMIO_WRITE(bus->CNT, NSPI_BUS_ENABLE_BIT | (write ? NSPI_BUS_TRANSFER_WRITE_BIT : NSPI_BUS_TRANSFER_READ_BIT) | (deviceid << 6) | rate);
+
+		bool done = write ? __NSPIWriteLoop(bus, segs[i].data, segs[i].length, budget, NULL)
+			: __NSPIReadLoop(bus, segs[i].data, segs[i].length, sleep_wait, budget, NULL);
+		if (!done)
+			return false;
+	}
+
+	__NSPIDone(bus, shadow);
+	return true;
+}
+
+static bool SPIWaiter_Before(const SPI_Waiter* a, const SPI_Waiter* b) {
+	if (a->sched_class != b->sched_class)
+		return a->sched_class < b->sched_class;
+	if (a->sched_class == SPI_CLASS_REALTIME)
+		return a->deadline - 1 < b->deadline - 1; // no deadline wraps around to last
+	if (a->sched_class == SPI_CLASS_BULK)
+		return (s32)(a->vtime - b->vtime) < 0;
+	return false; // interactive, arrival order
+}
+
+// Takes the bus for a transaction of cost bytes in mode, waiting for its turn if someone else has it
+// Every session has its own thread, so at most 5 waiters per bus, a sorted list is plenty
+// and a session never has two transactions waiting, reordering can't swap a client's own requests
+static void SPIBus_Acquire(SPI_Bus* bus, SPI_Session* session, u32 cost, u8 mode) {
+	SPI_Waiter self;
+	self.sched_class = session->sched_class;
+	self.mode = mode;
+	self.skips = 0;
+	self.deadline = session->deadline;
+	self.granted = 0;
 
 	LightLock_Lock(&bus->lock);
 
-	if (bus->is_nspi_mode)
-		_NSPICmdAndWriteBuf(bus->nspi_bus, deviceid, SPI_DeviceRates[deviceid].rate, cmd, cmd_length, data, data_length);
-	else
-		_SPICmdAndWriteBuf(bus->spi_bus, deviceid, SPI_DeviceRates[deviceid].rate, cmd, cmd_length, data, data_length);
+	if (self.sched_class == SPI_CLASS_BULK) {
+		// coming back from idle doesn't earn a burst over the ones that kept the bus busy
+		if ((s32)(session->vtime - bus->bulk_vtime) < 0)
+			session->vtime = bus->bulk_vtime;
+		self.vtime = session->vtime;
+		session->vtime += (cost >> session->weight) + 1;
+	}
+
+	if (!bus->busy) {
+		bus->busy = true;
+		bus->deadline = self.deadline;
+		if (self.sched_class == SPI_CLASS_BULK)
+			bus->bulk_vtime = self.vtime;
+		LightLock_Unlock(&bus->lock);
+		return;
+	}
+
+	SPI_Waiter** link = &bus->waiters;
+	while (*link && !SPIWaiter_Before(&self, *link))
+		link = &(*link)->next;
+	self.next = *link;
+	*link = &self;
 
 	LightLock_Unlock(&bus->lock);
 
-	return 0;
+	while (!self.granted)
+		syncArbitrateAddress(&self.granted, ARBITRATION_WAIT_IF_LESS_THAN, 1);
 }
 
-static Result SPIIPC_SendCmdOnly(u8 deviceid, const void* cmd, u32 cmd_length) {
-	if (cmd_length > 4)
-		return SPI_OUT_OF_RANGE;
+// First waiter that can go without switching the bus mode, looking no further than SPI_REORDER_WINDOW waiters
+// and never past a real time one or one that was already passed over SPI_REORDER_MAX_SKIPS times
+// if there's none, it's the switch and the head of the queue
+static SPI_Waiter** SPIBus_PickNext(SPI_Bus* bus) {
+	SPI_Waiter** link = &bus->waiters;
+	for (u32 i = 0; *link && i < SPI_REORDER_WINDOW; ++i) {
+		SPI_Waiter* w = *link;
+		if (w->mode == SPI_MODE_ANY || w->mode == (bus->is_nspi_mode ? SPI_MODE_NSPI : SPI_MODE_LEGACY))
+			return link;
+		if (w->sched_class == SPI_CLASS_REALTIME || w->skips >= SPI_REORDER_MAX_SKIPS)
+			break;
+		link = &w->next;
+	}
+	return &bus->waiters;
+}
 
-	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+// Hands the bus straight to the next waiter, if any
+static void SPIBus_Release(SPI_Bus* bus) {
+	LightLock_Lock(&bus->lock);
 
-	if (!bus) // extra checks not part of original spi binary, my way to check if cant do this device
-		Err_Panic(SPI_INVALID_SELECTION);
+	if (bus->deadline && svcGetSystemTick() > bus->deadline)
+		++bus->stats.deadline_misses;
 
-	if (!SPI_DeviceRates[deviceid].init)
-		return SPI_NOT_INITIALIZED;
+	SPI_Waiter** link = SPIBus_PickNext(bus);
+	SPI_Waiter* next = *link;
+	if (next) {
+		if (next != bus->waiters) {
+			for (SPI_Waiter* w = bus->waiters; w != next; w = w->next)
+				++w->skips;
+			++bus->stats.reordered;
+		}
+		*link = next->next;
+		bus->deadline = next->deadline;
+		if (next->sched_class == SPI_CLASS_BULK)
+			bus->bulk_vtime = next->vtime;
+		next->granted = 1;
+	} else
+		bus->busy = false;
 
-	LightLock_Lock(&bus->lock);
+	LightLock_Unlock(&bus->lock);
 
-	if (bus->is_nspi_mode)
-		_NSPISendCmdOnly(bus->nspi_bus, deviceid, SPI_DeviceRates[deviceid].rate, cmd, cmd_length);
+	// waiter may already be gone when it saw granted early, signaling a stale address wakes nobody
+	if (next)
+		syncArbitrateAddress(&next->granted, ARBITRATION_SIGNAL, 1);
+}
+
+// bus must be acquired for these
+
+static void SPIBus_SetMode(SPI_Bus* bus, bool nspi) {
+	if (bus->is_nspi_mode == nspi)
+		return;
+
+	u16 bit = BIT(bus - SPI_Bus_list);
+
+	LightLock_Lock(&SPI_CFGLock);
+	if (nspi)
+		SPI_CFGShadow |= bit;
 	else
-		_SPISendCmdOnly(bus->spi_bus, deviceid, SPI_DeviceRates[deviceid].rate, cmd, cmd_length);
+		SPI_CFGShadow &= ~bit;
+	MMIO_WRITE(CFG11_SPI_CNT, SPI_CFGShadow);
+	LightLock_Unlock(&SPI_CFGLock);
+
+	// no telling what the other controller was left at, the shadows start over
+	bus->regs = (SPI_RegShadow){ 0 };
+	bus->is_nspi_mode = nspi;
+	++bus->stats.mode_switches;
+}
 
-	LightLock_Unlock(&bus->lock);
+// puts the bus in the mode the transfer goes in, gives the rate for it
+static u8 SPIDevice_Rate(u8 deviceid, bool nspi) {
+	SPI_DeviceBaudrate* dev = SPIDevice_Config(deviceid);
+	u8 rate = dev->rate;
 
-	return 0;
+	if (nspi && !dev->nspi)
+		rate = 3 - (rate & 3);
+
+	return rate;
 }
 
-static void SPIIPC_SetDeviceNSPIModeAndRate(u8 deviceid, u8 enable_nspi, u8 rate) {
-	int index = GetBusIndexFromDeviceId(deviceid);
-	if (index < 0)
-		Err_Panic(SPI_INVALID_SELECTION);
+static u8 SPIBus_Prepare(SPI_Bus* bus, u8 deviceid, u32 length) {
+	bool nspi = SPIDevice_Mode(deviceid, length) == SPI_MODE_NSPI;
 
-	SPI_Bus* bus = &SPI_Bus_list[index];
+	SPIBus_SetMode(bus, nspi);
+	return SPIDevice_Rate(deviceid, nspi);
+}
 
-	// original spi binary did not have anything preventing mode switch while another thread *could've* been working on the bus
-	LightLock_Lock(&bus->lock);
+// wire time of the whole transfer four times over, plus slack, in ticks
+// NSPI reads leave the wire idle while sleeping between FIFO blocks, that alone can double it
+static u32 SPIBus_ByteTime(bool nspi, u8 rate) {
+	if (nspi)
+		return 16000u >> (rate > 5 ? 0 : rate); // 512KHz up to 16MHz
+	return __SPIGetRateByteTime(rate);
+}
 
-	bus->is_nspi_mode = enable_nspi ? true : false;
+static u64 SPIBus_WaitBudget(SPI_Bus* bus, u8 rate, u32 length) {
+	u64 ns = (u64)length * SPIBus_ByteTime(bus->is_nspi_mode, rate) * 4 + SPI_TIMEOUT_SLACK_NS;
+	return (ns * 275u) >> 10; // ~268.11 ticks per us, no division
+}
 
-	if (enable_nspi)
-		CFG11_SPI_CNT |= BIT(index);
-	else
-		CFG11_SPI_CNT &= ~BIT(index);
+// controller never finished, stop it and put things back to how the rest of the module thinks they are
+// chip select drops with the enable bit, next transaction starts from a clean controller
+static Result SPIBus_Recover(SPI_Bus* bus) {
+	u16 bit = BIT(bus - SPI_Bus_list);
+
+	++bus->stats.timeouts;
+
+	LightLock_Lock(&SPI_CFGLock);
+	if (bus->is_nspi_mode) {
+		MMIO_WRITE(bus->nspi_bus->CNT, 0);
+		MMIO_WRITE(bus->nspi_bus->DONE, 0);
+		SPI_CFGShadow |= bit;
+	} else {
+		MMIO_WRITE(bus->spi_bus->CNT, 0);
+		SPI_CFGShadow &= ~bit;
+	}
+	MMIO_WRITE(CFG11_SPI_CNT, SPI_CFGShadow);
+	LightLock_Unlock(&SPI_CFGLock);
 
-	SPI_DeviceRates[deviceid].rate = rate;
-	// should I also flag init?
+	bus->regs = (SPI_RegShadow){ 0 };
 
-	LightLock_Unlock(&bus->lock);
+	return SPI_TIMEOUT;
 }
 
-static void SPIIPC_SetBUS2NSPIMode(u8 enable_nspi) {
-	SPI_Bus* bus = &SPI_Bus_list[2];
+// Register cache, not part of original spi
+// One pool for all devices, 4 way sets, a full set gives up its oldest.
+// Only ever updated while holding the device's bus, lookups just take the cache lock.
 
-	// original spi binary did not have anything preventing mode switch while another thread *could've* been working on the bus
-	LightLock_Lock(&bus->lock);
+#define SPI_REGCACHE_SETS   64
+#define SPI_REGCACHE_WAYS   4
+#define SPI_REGCACHE_VALID  BIT(31)
 
-	// also originally nothing informing internally that this has suffered a mode switch for this ipc alone
-	bus->is_nspi_mode = enable_nspi ? true : false;
+typedef struct {
+	u32 tag; // SPI_REGCACHE_VALID | deviceid << 16 | page << 8 | reg, 0 when empty
+	u8 value;
+} SPI_RegCacheEntry;
 
-	if (enable_nspi)
-		CFG11_SPI_CNT |= BIT(2);
-	else
-		CFG11_SPI_CNT &= ~BIT(2);
+typedef struct {
+	bool enabled;
+	bool page_known;
+	u8 page;
+	SPI_RegCacheConfig config;
+} SPI_RegCacheDevice;
+
+static LightLock SPI_RegCacheLock = LIGHTLOCK_STATICINIT;
+static SPI_RegCacheEntry SPI_RegCache[SPI_REGCACHE_SETS][SPI_REGCACHE_WAYS];
+static u8 SPI_RegCacheNextWay[SPI_REGCACHE_SETS];
+static SPI_RegCacheDevice SPI_RegCacheDevices[7];
+
+static SPI_RegCacheEntry* _RegCacheFind(u32 tag, bool insert) {
+	u32 set = (tag ^ (tag >> 6) ^ (tag >> 16)) & (SPI_REGCACHE_SETS - 1);
+
+	for (u32 way = 0; way < SPI_REGCACHE_WAYS; ++way)
+		if (SPI_RegCache[set][way].tag == tag)
+			return &SPI_RegCache[set][way];
+
+	if (!insert)
+		return NULL;
+
+	SPI_RegCacheEntry* entry = &SPI_RegCache[set][SPI_RegCacheNextWay[set]++ & (SPI_REGCACHE_WAYS - 1)];
+	entry->tag = tag;
+	return entry;
+}
 
-	LightLock_Unlock(&bus->lock);
+static bool _RegCacheVolatile(const SPI_RegCacheConfig* config, u8 page, u8 reg) {
+	for (u32 i = 0; i < config->nvolatile; ++i) {
+		const SPI_RegRange* range = &config->volatile_regs[i];
+		if ((range->page == SPI_REGCACHE_ANY_PAGE || range->page == page) && reg >= range->first && reg <= range->last)
+			return true;
+	}
+	return false;
 }
 
-static void SPI_IPCSession() {
-	u32* cmdbuf = getThreadCommandBuffer();
+// lock held
+static void SPIRegCache_Forget(u8 deviceid) {
+	for (u32 set = 0; set < SPI_REGCACHE_SETS; ++set)
+		for (u32 way = 0; way < SPI_REGCACHE_WAYS; ++way)
+			if (((SPI_RegCache[set][way].tag >> 16) & 0xFF) == deviceid)
+				SPI_RegCache[set][way].tag = 0;
+	SPI_RegCacheDevices[deviceid].page_known = false;
+}
 
-	switch (cmdbuf[0] >> 16) {
-	case 0x1:
-		SPIIPC_InitDeviceRate(cmdbuf[1], cmdbuf[2]);
-		cmdbuf[0] = IPC_MakeHeader(0x1, 1, 0);
-		cmdbuf[1] = 0;
-		break;
-	case 0x2: // stub, always 0
-		cmdbuf[0] = IPC_MakeHeader(0x2, 1, 0);
-		cmdbuf[1] = 0;
-		break;
-	case 0x3: {
-			u8 deviceid = cmdbuf[1];
-			u32 cmd = cmdbuf[2];
-			u32 cmd_length = cmdbuf[3];
+// true when the command is the one register protocol step the cache knows, a read or a write starting at reg
+static bool _RegCacheCmd(const SPI_RegCacheConfig* config, const void* cmd, u32 cmd_length, bool* read, u8* reg) {
+	if (cmd_length != 1)
+		return false;
 
-			void* data_out = (void*)&cmdbuf[2];
-			u32 data_length = cmdbuf[4];
+	u8 byte = *(const u8*)cmd;
+	u8 flags = byte & ((1u << config->addr_shift) - 1);
+	*reg = byte >> config->addr_shift;
+	*read = flags == config->read_flag;
+	return *read || flags == config->write_flag;
+}
 
-			if (data_length > 64)
-				cmdbuf[1] = SPI_OUT_OF_RANGE;
-			else
-				cmdbuf[1] = SPIIPC_SendCmdAndRead(deviceid, &cmd, cmd_length, data_out, data_length);
-		}
-		cmdbuf[0] = IPC_MakeHeader(0x3, 17, 0);
-		break;
-	case 0x4: {
-			u8 deviceid = cmdbuf[1];
-			u32 cmd = cmdbuf[2];
-			u32 cmd_length = cmdbuf[3];
+// stats bumped without the bus, ldrex/strex so none of it gets lost to a bump from another thread
+static void _StatAdd(u32* counter, u32 n) {
+	s32 value;
+	do
+		value = __ldrex((s32*)counter);
+	while (__strex((s32*)counter, value + n));
+}
 
-			const void* data_in = (void*)&cmdbuf[4];
-			u32 data_length = cmdbuf[20];
+// the bus time a hit saved goes in as whole microseconds, the rest stays in regcache_saved_ns, no division
+static void _StatAddSaved(SPI_Bus* bus, u32 ns) {
+	s32 value;
+	u32 us;
+	do {
+		value = __ldrex((s32*)&bus->regcache_saved_ns);
+		for (us = 0, value += ns; (u32)value >= 1000; ++us)
+			value -= 1000;
+	} while (__strex((s32*)&bus->regcache_saved_ns, value));
+	if (us)
+		_StatAdd(&bus->stats.regcache_saved_us, us);
+}
 
-			if (data_length > 64)
-				cmdbuf[1] = SPI_OUT_OF_RANGE;
-			else
-				cmdbuf[1] = SPIIPC_SendCmdAndWrite(deviceid, &cmd, cmd_length, data_in, data_length);
-		}
-		cmdbuf[0] = IPC_MakeHeader(0x4, 1, 0);
-		break;
-	case 0x5: {
-			u8 deviceid = cmdbuf[1];
-			u32 cmd = cmdbuf[2];
-			u32 cmd_length = cmdbuf[3];
+// answers a read from the cache if all of it is there, data is left undefined otherwise
+static bool SPIRegCache_Read(SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
+	SPI_RegCacheDevice* dev = &SPI_RegCacheDevices[deviceid];
+	const SPI_RegCacheConfig* config = &dev->config;
+	bool read, hit = true;
+	u8 reg;
 
-			cmdbuf[1] = SPIIPC_SendCmdOnly(deviceid, &cmd, cmd_length);
-		}
-		cmdbuf[0] = IPC_MakeHeader(0x5, 1, 0);
-		break;
-	case 0x6:
-		if (!IPC_CompareHeader(cmdbuf[0], 0x6, 4, 2) || !IPC_Is_Desc_Buffer(cmdbuf[5], IPC_BUFFER_W)) {
-			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
-			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
-		} else {
-			u8 deviceid = cmdbuf[1];
-			u32 cmd = cmdbuf[2];
-			u32 cmd_length = cmdbuf[3];
+	if (!dev->enabled)
+		return false;
 
-			// v1025 -> v2049, start getting buffer length from desc buffer instead of length copy in cmdbuf[4]
-			// cmdbuf[4] - buffer length also
+	LightLock_Lock(&SPI_RegCacheLock);
 
-			u32 data_length = IPC_Get_Desc_Buffer_Size(cmdbuf[5]);
-			void *data_out = (void*)cmdbuf[6];
+	if (!dev->enabled || !_RegCacheCmd(config, cmd, cmd_length, &read, &reg) || !read) {
+		LightLock_Unlock(&SPI_RegCacheLock);
+		return false;
+	}
+
+	bool paged = config->page_reg != SPI_REGCACHE_NO_PAGE_REG;
+	u8 page = paged ? dev->page : 0;
+	u8 reg_mask = 0xFF >> config->addr_shift;
 
-			cmdbuf[1] = SPIIPC_SendCmdAndRead(deviceid, &cmd, cmd_length, data_out, data_length);
-			cmdbuf[0] = IPC_MakeHeader(0x6, 1, 2);
-			cmdbuf[2] = IPC_Desc_Buffer(data_length, IPC_BUFFER_W);
-			cmdbuf[3] = (u32)data_out;
+	if (paged && !dev->page_known)
+		hit = false;
+
+	for (u32 i = 0; i < data_length && hit; ++i, reg = (reg + 1) & reg_mask) {
+		if (paged && reg == config->page_reg) {
+			*SILENT_PTR_CAST(u8, data, i) = page;
+			continue;
 		}
-		break;
-	case 0x7:
-		if (!IPC_CompareHeader(cmdbuf[0], 0x7, 4, 2) || !IPC_Is_Desc_Buffer(cmdbuf[5], IPC_BUFFER_R)) {
-			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
-			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
-		} else {
-			u8 deviceid = cmdbuf[1];
-			u32 cmd = cmdbuf[2];
-			u32 cmd_length = cmdbuf[3];
 
-			// v1025 -> v2049, start getting buffer length from desc buffer instead of length copy in cmdbuf[4]
-			// cmdbuf[4] - buffer length also
+		SPI_RegCacheEntry* entry = _RegCacheVolatile(config, page, reg) ? NULL :
+			_RegCacheFind(SPI_REGCACHE_VALID | deviceid << 16 | page << 8 | reg, false);
+		if (!entry)
+			hit = false;
+		else
+			*SILENT_PTR_CAST(u8, data, i) = entry->value;
+	}
 
-			u32 data_length = IPC_Get_Desc_Buffer_Size(cmdbuf[5]);
-			const void *data_in = (void*)cmdbuf[6];
+	LightLock_Unlock(&SPI_RegCacheLock);
 
-			cmdbuf[1] = SPIIPC_SendCmdAndWrite(deviceid, &cmd, cmd_length, data_in, data_length);
-			cmdbuf[0] = IPC_MakeHeader(0x7, 1, 2);
-			cmdbuf[2] = IPC_Desc_Buffer(data_length, IPC_BUFFER_R);
-			cmdbuf[3] = (u32)data_in;
-		}
-		break;
-	case 0x8:
-		SPIIPC_SetDeviceNSPIModeAndRate(cmdbuf[1], cmdbuf[2], cmdbuf[3]);
-		cmdbuf[0] = IPC_MakeHeader(0x8, 1, 0);
-		cmdbuf[1] = 0;
-		break;
-	case 0x9: // specifically set BUS 2 nspi on/off, for some reason
-		SPIIPC_SetBUS2NSPIMode(cmdbuf[1]);
-		cmdbuf[0] = IPC_MakeHeader(0x9, 1, 0);
-		cmdbuf[1] = 0;
-		break;
-	default:
-		cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
-		cmdbuf[1] = OS_INVALID_HEADER;
+	if (hit) {
+		bool nspi = SPIDevice_Mode(deviceid, cmd_length + data_length) == SPI_MODE_NSPI;
+		_StatAdd(&bus->stats.regcache_hits, 1);
+		_StatAddSaved(bus, (cmd_length + data_length) * SPIBus_ByteTime(nspi, SPIDevice_Rate(deviceid, nspi)));
+	} else {
+		_StatAdd(&bus->stats.regcache_misses, 1);
 	}
+
+	return hit;
 }
 
-static void SPIThread(void* _session_handle) {
-	Handle session_handle = (Handle)_session_handle;
+// bus held, after any transaction on a cached device, data is what went over the wire, read_data true if it came from the device
+static void SPIRegCache_Update(u8 deviceid, const void* cmd, u32 cmd_length, const void* data, u32 data_length, bool read_data, bool done) {
+	SPI_RegCacheDevice* dev = &SPI_RegCacheDevices[deviceid];
+	const SPI_RegCacheConfig* config = &dev->config;
+	bool read;
+	u8 reg;
 
-	*getThreadCommandBuffer() = 0xFFFF0000;
-	for (;;) {
-		s32 index;
+	if (!dev->enabled) // only changes with the bus held too
+		return;
 
-		Result res = svcReplyAndReceive(&index, &session_handle, 1, session_handle);
+	LightLock_Lock(&SPI_RegCacheLock);
 
-		if (R_FAILED(res)) {
-			if (res != OS_REMOTE_SESSION_CLOSED)
-				Err_Throw(res);
+	if (!done || !data_length || !_RegCacheCmd(config, cmd, cmd_length, &read, &reg) || read != read_data) {
+		// no telling what a failed or unknown command did to the device,
+		// nor one moving data the other way than its flag says, data read back on a write or sent on a read
+		SPIRegCache_Forget(deviceid);
+		LightLock_Unlock(&SPI_RegCacheLock);
+		return;
+	}
 
-			break;
+	bool paged = config->page_reg != SPI_REGCACHE_NO_PAGE_REG;
+	u8 reg_mask = 0xFF >> config->addr_shift;
+
+	// reads and writes alike, afterwards the device holds what went over the wire in the command's direction
+	for (u32 i = 0; i < data_length; ++i, reg = (reg + 1) & reg_mask) {
+		u8 value = *SILENT_PTR_CAST(const u8, data, i);
+
+		if (paged && reg == config->page_reg) {
+			dev->page = value;
+			dev->page_known = true;
+			continue;
 		}
 
-		if (index != 0)
-			Err_Throw(SPI_INTERNAL_RANGE);
+		u8 page = paged ? dev->page : 0;
+		if ((paged && !dev->page_known) || _RegCacheVolatile(config, page, reg))
+			continue;
 
-		SPI_IPCSession();
+		_RegCacheFind(SPI_REGCACHE_VALID | deviceid << 16 | page << 8 | reg, true)->value = value;
 	}
 
-	svcCloseHandle(session_handle);
+	LightLock_Unlock(&SPI_RegCacheLock);
 }
 
-static inline void initBSS() {
-	extern void* __bss_start__;
-	extern void* __bss_end__;
-	_memset32_aligned(__bss_start__, 0, (size_t)__bss_end__ - (size_t)__bss_start__);
-}
+static Result SPIBus_CmdAndRead(SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
+	u8 rate = SPIBus_Prepare(bus, deviceid, cmd_length + data_length);
+	u64 budget = SPIBus_WaitBudget(bus, rate, cmd_length + data_length);
+	bool done;
 
-Result __sync_init(void);
-void __sync_fini(void);
+	++bus->stats.transactions;
 
-static void LoadSPICFGStatus() {
-	u16 spi_cnt = CFG11_SPI_CNT;
+	if (bus->is_nspi_mode)
+		done = _NSPICmdAndReadBuf(bus->nspi_bus, &bus->regs, deviceid, rate, cmd, cmd_length, data, data_length, bus->sum, budget);
+	else
+		done = _SPICmdAndReadBuf(bus->spi_bus, &bus->regs, deviceid, rate, cmd, cmd_length, data, data_length, bus->sum, budget);
+
+	SPIRegCache_Update(deviceid, cmd, cmd_length, data, data_length, true, done);
+
+	return done ? 0 : SPIBus_Recover(bus);
+}
+
+static Result SPIBus_CmdAndWrite(SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length, const void* data, u32 data_length) {
+	u8 rate = SPIBus_Prepare(bus, deviceid, cmd_length + data_length);
+	u64 budget = SPIBus_WaitBudget(bus, rate, cmd_length + data_length);
+	bool done;
+
+	++bus->stats.transactions;
+	++bus->device_writes[_mod3_u8(deviceid)];
+
+	if (bus->is_nspi_mode)
+		done = _NSPICmdAndWriteBuf(bus->nspi_bus, &bus->regs, deviceid, rate, cmd, cmd_length, data, data_length, bus->sum, budget);
+	else
+		done = _SPICmdAndWriteBuf(bus->spi_bus, &bus->regs, deviceid, rate, cmd, cmd_length, data, data_length, bus->sum, budget);
+
+	SPIRegCache_Update(deviceid, cmd, cmd_length, data, data_length, false, done);
+
+	return done ? 0 : SPIBus_Recover(bus);
+}
+
+static Result SPIBus_CmdOnly(SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length) {
+	u8 rate = SPIBus_Prepare(bus, deviceid, cmd_length);
+	u64 budget = SPIBus_WaitBudget(bus, rate, cmd_length);
+	bool done;
+
+	++bus->stats.transactions;
+	++bus->device_writes[_mod3_u8(deviceid)];
+
+	if (bus->is_nspi_mode)
+		done = _NSPISendCmdOnly(bus->nspi_bus, &bus->regs, deviceid, rate, cmd, cmd_length, budget);
+	else
+		done = _SPISendCmdOnly(bus->spi_bus, &bus->regs, deviceid, rate, cmd, cmd_length, budget);
+
+	SPIRegCache_Update(deviceid, cmd, cmd_length, NULL, 0, false, false);
+
+	return done ? 0 : SPIBus_Recover(bus);
+}
+
+static Result SPIBus_Vector(SPI_Bus* bus, u8 deviceid, const SPI_Segment* segs, u32 count, u32 nwrite, u32 length) {
+	u8 rate = SPIBus_Prepare(bus, deviceid, length);
+	u64 budget = SPIBus_WaitBudget(bus, rate, length);
+	bool done;
+
+	++bus->stats.transactions;
+	if (nwrite)
+		++bus->device_writes[_mod3_u8(deviceid)];
+
+	if (bus->is_nspi_mode)
+		done = _NSPIVector(bus->nspi_bus, &bus->regs, deviceid, rate, segs, count, nwrite, budget);
+	else
+		done = _SPIVector(bus->spi_bus, &bus->regs, deviceid, rate, segs, count, nwrite, budget);
+
+	// no single command to go by, the register cache starts over
+	SPIRegCache_Update(deviceid, NULL, 0, NULL, 0, false, false);
+
+	return done ? 0 : SPIBus_Recover(bus);
+}
+
+static u32 _CmdWord(const void* cmd, u32 cmd_length) {
+	u32 word = 0;
+	for (u32 i = 0; i < cmd_length; ++i)
+		word |= (u32)*SILENT_PTR_CAST(const u8, cmd, i) << (i * 8);
+	return word;
+}
+
+static Result SPIBus_SharedCmdAndRead(SPI_Bus* bus, SPI_Session* session, u8 deviceid, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
+	SPI_ReadShare* share = &bus->share;
+	u32 cmd_word = _CmdWord(cmd, cmd_length);
+	bool leader = false;
+	bool joined = false;
+
+	LightLock_Lock(&bus->share_lock);
+
+	if (share->state == SPI_SHARE_FREE) {
+		share->state = SPI_SHARE_OPEN;
+		share->pending = 0;
+		share->deviceid = deviceid;
+		share->cmd_length = cmd_length;
+		share->cmd = cmd_word;
+		share->data = data;
+		share->data_length = data_length;
+		leader = true;
+	} else if (share->state == SPI_SHARE_OPEN && share->deviceid == deviceid && share->cmd_length == cmd_length
+		&& share->cmd == cmd_word && share->data_length == data_length) {
+		--share->pending;
+		joined = true;
+	}
+
+	LightLock_Unlock(&bus->share_lock);
+
+	if (joined) {
+		while (share->state != SPI_SHARE_DONE)
+			syncArbitrateAddress(&share->state, ARBITRATION_WAIT_IF_LESS_THAN, SPI_SHARE_DONE);
+
+		for (u32 i = 0; i < data_length; ++i)
+			*SILENT_PTR_CAST(u8, data, i) = *SILENT_PTR_CAST(const u8, share->data, i);
+
+		Result res = share->result;
+
+		LightLock_Lock(&bus->share_lock);
+		bool last = ++share->pending == 0;
+		LightLock_Unlock(&bus->share_lock);
+
+		if (last)
+			syncArbitrateAddress(&share->pending, ARBITRATION_SIGNAL, 1);
+
+		return res;
+	}
+
+	SPIBus_Acquire(bus, session, cmd_length + data_length, SPIDevice_Mode(deviceid, cmd_length + data_length));
+
+	if (leader) {
+		LightLock_Lock(&bus->share_lock);
+		share->state = SPI_SHARE_RUNNING;
+		u32 joined_reads = -share->pending; // nobody joins once it's running
+		LightLock_Unlock(&bus->share_lock);
+		bus->stats.coalesced_reads += joined_reads; // counted here, where the bus is held
+	}
+
+	Result res = SPIBus_CmdAndRead(bus, deviceid, cmd, cmd_length, data, data_length);
+
+	SPIBus_Release(bus);
+
+	if (!leader)
+		return res;
+
+	LightLock_Lock(&bus->share_lock);
+	share->result = res;
+	share->state = SPI_SHARE_DONE;
+	s32 joiners = -share->pending;
+	LightLock_Unlock(&bus->share_lock);
+
+	if (joiners) {
+		syncArbitrateAddress(&share->state, ARBITRATION_SIGNAL, joiners);
+		// our buffer has to stay around until everyone got their copy
+		while (share->pending < 0)
+			syncArbitrateAddress(&share->pending, ARBITRATION_WAIT_IF_LESS_THAN, 0);
+	}
+
+	LightLock_Lock(&bus->share_lock);
+	share->state = SPI_SHARE_FREE;
+	LightLock_Unlock(&bus->share_lock);
+
+	return res;
+}
+
+// single transactions, taking the bus for just that
+
+static Result SPIDevice_CmdAndRead(SPI_Session* session, SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
+	SPIBus_Acquire(bus, session, cmd_length + data_length, SPIDevice_Mode(deviceid, cmd_length + data_length));
+
+	Result res = SPIBus_CmdAndRead(bus, deviceid, cmd, cmd_length, data, data_length);
+
+	SPIBus_Release(bus);
+
+	return res;
+}
+
+static Result SPIDevice_CmdAndWrite(SPI_Session* session, SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length, const void* data, u32 data_length) {
+	SPIBus_Acquire(bus, session, cmd_length + data_length, SPIDevice_Mode(deviceid, cmd_length + data_length));
+
+	Result res = SPIBus_CmdAndWrite(bus, deviceid, cmd, cmd_length, data, data_length);
+
+	SPIBus_Release(bus);
+
+	return res;
+}
+
+static Result SPIDevice_CmdOnly(SPI_Session* session, SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length) {
+	SPIBus_Acquire(bus, session, cmd_length, SPIDevice_Mode(deviceid, cmd_length));
+
+	Result res = SPIBus_CmdOnly(bus, deviceid, cmd, cmd_length);
+
+	SPIBus_Release(bus);
+
+	return res;
+}
+
+// Read conversion, cmd 0x1E
+
+#define SPI_CONVERT_SIZES (SPI_CONVERT_SWAP16 | SPI_CONVERT_SWAP32 | SPI_CONVERT_UNPACK12)
+
+// ARMv6 media instructions on the console, plain C for hostsim and anything else
+#ifdef __ARM_ARCH_6K__
+static inline u32 _Rev(u32 x) {
+	u32 r;
+	__asm__("rev %0, %1" : "=r"(r) : "r"(x));
+	return r;
+}
+
+static inline u32 _Rev16(u32 x) {
+	u32 r;
+	__asm__("rev16 %0, %1" : "=r"(r) : "r"(x));
+	return r;
+}
+
+// low half of lo, low half of hi on top
+static inline u32 _PackLow(u32 lo, u32 hi) {
+	u32 r;
+	__asm__("pkhbt %0, %1, %2, lsl #16" : "=r"(r) : "r"(lo), "r"(hi));
+	return r;
+}
+
+// high half of lo at the bottom, high half of hi
+static inline u32 _PackHigh(u32 lo, u32 hi) {
+	u32 r;
+	__asm__("pkhtb %0, %1, %2, asr #16" : "=r"(r) : "r"(hi), "r"(lo));
+	return r;
+}
+#else
+static inline u32 _Rev(u32 x) {
+	return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+}
+
+static inline u32 _Rev16(u32 x) {
+	return ((x >> 8) & 0x00FF00FF) | ((x << 8) & 0xFF00FF00);
+}
+
+static inline u32 _PackLow(u32 lo, u32 hi) {
+	return (lo & 0xFFFF) | (hi << 16);
+}
+
+static inline u32 _PackHigh(u32 lo, u32 hi) {
+	return (lo >> 16) | (hi & 0xFFFF0000);
+}
+#endif
+
+static bool SPIConvert_Valid(u8 convert) {
+	u8 sizes = convert & SPI_CONVERT_SIZES;
+	if (convert & ~(SPI_CONVERT_SIZES | SPI_CONVERT_DEINTERLEAVE))
+		return false;
+	if (sizes & (sizes - 1)) // more than one
+		return false;
+	return !((convert & SPI_CONVERT_DEINTERLEAVE) && (convert & SPI_CONVERT_SWAP32));
+}
+
+// what comes off the wire for length converted bytes, 0 if the length or buffer can't be converted
+static u32 SPIConvert_WireLength(u8 convert, const void* data, u32 length) {
+	if (!convert)
+		return length;
+	if ((length & 3) || ((u32)data & 3))
+		return 0;
+	if (convert & SPI_CONVERT_UNPACK12)
+		return (length >> 2) * 3;
+	return length;
+}
+
+static void _Reverse16(u16* a, u32 n) {
+	for (u16* b = a + n - 1; a < b; ++a, --b) {
+		u16 t = *a;
+		*a = *b;
+		*b = t;
+	}
+}
+
+// first k to the back, by three reversals, nothing but the samples themselves to move them with
+static void _Rotate16(u16* a, u32 n, u32 k) {
+	_Reverse16(a, k);
+	_Reverse16(a + k, n - k);
+	_Reverse16(a, n);
+}
+
+// in place, bottom up merges with no recursion and no scratch space, fine for the small stacks here
+// pairs of pairs in a word each get done with a pack first, then each merge of two runs of b pairs
+// (L1 R1 L2 R2) rotates R1 L2 around to give (L1 L2 R1 R2)
+static SPI_HOT void _Deinterleave16(u32* words, u32 pairs) {
+	u32 i = 0;
+	for (; i + 2 <= pairs; i += 2) {
+		u32 a = words[i], b = words[i + 1];
+		words[i] = _PackLow(a, b);
+		words[i + 1] = _PackHigh(a, b);
+	}
+
+	u16* samples = (u16*)(void*)words;
+	for (u32 b = 2; b < pairs; b <<= 1) {
+		for (i = 0; i + b < pairs; i += b * 2) {
+			u32 m = pairs - i - b < b ? pairs - i - b : b;
+			_Rotate16(samples + i * 2 + b, b + m, b);
+		}
+	}
+}
+
+// length is the converted length, the wire bytes are at the start of data
+static SPI_HOT void SPIConvert_Buffer(u8 convert, void* data, u32 length) {
+	u32* words = (u32*)data;
+	u32 count = length >> 2;
+
+	if (convert & SPI_CONVERT_SWAP16) {
+		for (u32 i = 0; i < count; ++i)
+			words[i] = _Rev16(words[i]);
+	} else if (convert & SPI_CONVERT_SWAP32) {
+		for (u32 i = 0; i < count; ++i)
+			words[i] = _Rev(words[i]);
+	} else if (convert & SPI_CONVERT_UNPACK12) {
+		// from the back, each 3 byte pair is read before the word it grows into is written
+		const u8* in = (const u8*)data;
+		for (u32 i = count; i--;) {
+			const u8* p = in + i * 3;
+			u32 w = (p[0] << 16) | (p[1] << 8) | p[2];
+			words[i] = _PackLow(w >> 12, w) & 0x0FFF0FFF;
+		}
+	}
+
+	if (convert & SPI_CONVERT_DEINTERLEAVE)
+		_Deinterleave16(words, count);
+}
+
+static void SPIIPC_InitDeviceRate(u8 deviceid, u8 rate) {
+	// original SPI does not prevent a buffer overrun, also did not have a slot for dev 6 despite having supposed support for it
+	if (deviceid > 6)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	SPI_DeviceBaudrate* dev = SPIDevice_Config(deviceid);
+	dev->init = true;
+	dev->rate = rate;
+}
+
+static Result SPIIPC_SendCmdAndRead(SPI_Session* session, u8 deviceid, const void* cmd, u32 cmd_length, void* data, u32 data_length) {
+	if (cmd_length > 4)
+		return SPI_OUT_OF_RANGE;
+
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus) // extra checks not part of original spi binary, my way to check if cant do this device
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	SPI_DeviceBaudrate* dev = &bus->devices[_mod3_u8(deviceid)];
+	if (!dev->init)
+		return SPI_NOT_INITIALIZED;
+
+	u8 convert = dev->convert;
+	u32 wire_length = SPIConvert_WireLength(convert, data, data_length);
+	if (!wire_length && data_length)
+		return SPI_OUT_OF_RANGE;
+
+	Result res = 0;
+	if (!SPIRegCache_Read(bus, deviceid, cmd, cmd_length, data, wire_length)) {
+		if (dev->flags & SPI_DEVICE_FLAG_COALESCE_READS)
+			res = SPIBus_SharedCmdAndRead(bus, session, deviceid, cmd, cmd_length, data, wire_length);
+		else
+			res = SPIDevice_CmdAndRead(session, bus, deviceid, cmd, cmd_length, data, wire_length);
+	}
+
+	// bus is already let go, the samples are still in cache from the read loop
+	if (convert && R_SUCCEEDED(res))
+		SPIConvert_Buffer(convert, data, data_length);
+	return res;
+}
+
+static Result SPIIPC_SendCmdAndWrite(SPI_Session* session, u8 deviceid, const void* cmd, u32 cmd_length, const void* data, u32 data_length) {
+	if (cmd_length > 4)
+		return SPI_OUT_OF_RANGE;
+
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus) // extra checks not part of original spi binary, my way to check if cant do this device
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	if (!bus->devices[_mod3_u8(deviceid)].init)
+		return SPI_NOT_INITIALIZED;
+
+	return SPIDevice_CmdAndWrite(session, bus, deviceid, cmd, cmd_length, data, data_length);
+}
+
+static Result SPIIPC_SendCmdOnly(SPI_Session* session, u8 deviceid, const void* cmd, u32 cmd_length) {
+	if (cmd_length > 4)
+		return SPI_OUT_OF_RANGE;
+
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus) // extra checks not part of original spi binary, my way to check if cant do this device
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	if (!bus->devices[_mod3_u8(deviceid)].init)
+		return SPI_NOT_INITIALIZED;
+
+	return SPIDevice_CmdOnly(session, bus, deviceid, cmd, cmd_length);
+}
+
+static Result SPIIPC_Vector(SPI_Session* session, u8 deviceid, const SPI_Segment* segs, u32 count, u32 nwrite) {
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	if (!bus->devices[_mod3_u8(deviceid)].init)
+		return SPI_NOT_INITIALIZED;
+
+	u32 length = 0;
+	for (u32 i = 0; i < count; ++i) {
+		if (!segs[i].length)
+			return SPI_OUT_OF_RANGE;
+		length += segs[i].length;
+	}
+
+	SPIBus_Acquire(bus, session, length, SPIDevice_Mode(deviceid, length));
+
+	Result res = SPIBus_Vector(bus, deviceid, segs, count, nwrite, length);
+
+	SPIBus_Release(bus);
+
+	return res;
+}
+
+// not inlined, so the segment list is only on the stack for this one, not for every request
+static __attribute__((noinline)) void SPIIPC_VectorRequest(SPI_Session* session, u32* cmdbuf) {
+	u32 translate = cmdbuf[0] & 0x3F;
+	u32 count = translate / 2;
+	u32 nwrite = 0;
+	SPI_Segment segs[SPI_VECTOR_MAX];
+	bool valid = ((cmdbuf[0] >> 6) & 0x3F) == 1 && !(translate & 1) && count && count <= SPI_VECTOR_MAX;
+
+	// every buffer the device reads from, then every one it fills
+	for (u32 i = 0; valid && i < count; ++i) {
+		u32 desc = cmdbuf[2 + i * 2];
+		if (nwrite == i && IPC_Is_Desc_Buffer(desc, IPC_BUFFER_R))
+			++nwrite;
+		else if (!IPC_Is_Desc_Buffer(desc, IPC_BUFFER_W))
+			valid = false;
+		segs[i] = (SPI_Segment){ (u8*)cmdbuf[3 + i * 2], IPC_Get_Desc_Buffer_Size(desc) };
+	}
+
+	if (!valid) {
+		cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+		cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		return;
+	}
+
+	// descriptors go back as they came, right where they are
+	cmdbuf[1] = SPIIPC_Vector(session, cmdbuf[1], segs, count, nwrite);
+	cmdbuf[0] = IPC_MakeHeader(0x1A, 1, translate);
+}
+
+static void SPIIPC_SetDeviceNSPIModeAndRate(SPI_Session* session, u8 deviceid, u8 enable_nspi, u8 rate) {
+	int index = GetBusIndexFromDeviceId(deviceid);
+	if (index < 0)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	SPI_Bus* bus = &SPI_Bus_list[index];
+
+	// original spi switched the whole bus here, last caller deciding for every device on it
+	// now it's only this device's mode, the bus follows whoever transfers next
+	// still holding the bus so a transfer on this device never sees the new mode with the old rate
+	SPIBus_Acquire(bus, session, 0, SPI_MODE_ANY);
+
+	SPI_DeviceBaudrate* dev = &bus->devices[_mod3_u8(deviceid)];
+	dev->nspi = enable_nspi ? true : false;
+	dev->rate = rate;
+	// should I also flag init?
+
+	SPIBus_Release(bus);
+}
+
+static void SPIIPC_SetDeviceFlags(u8 deviceid, u8 mask, u8 flags) {
+	if (deviceid > 6)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	// plain byte store, transfers only look at it once per request
+	SPI_DeviceBaudrate* dev = SPIDevice_Config(deviceid);
+	dev->flags = (dev->flags & ~mask) | (flags & mask);
+}
+
+static Result SPIIPC_SetDeviceConvert(u8 deviceid, u8 convert) {
+	if (deviceid > 6)
+		Err_Panic(SPI_INVALID_SELECTION);
+	if (!SPIConvert_Valid(convert))
+		return SPI_OUT_OF_RANGE;
+
+	// like the flags, a plain byte store, reads look at it once each
+	SPIDevice_Config(deviceid)->convert = convert;
+	return 0;
+}
+
+static void SPIIPC_SetBUS2NSPIMode(SPI_Session* session, u8 enable_nspi) {
+	SPI_Bus* bus = &SPI_Bus_list[2];
+
+	// dev 6 is all there is on BUS2, so this is its mode, bus switches on its next transfer
+	SPIBus_Acquire(bus, session, 0, SPI_MODE_ANY);
+
+	bus->devices[0].nspi = enable_nspi ? true : false;
+
+	SPIBus_Release(bus);
+}
+
+// NOR flash commands, not part of original spi
+
+#define NOR_CMD_WREN            0x06
+#define NOR_CMD_RDSR            0x05
+#define NOR_CMD_RDID            0x9F
+#define NOR_CMD_READ            0x03
+#define NOR_CMD_FAST_READ       0x0B
+#define NOR_CMD_PP              0x02
+#define NOR_CMD_PE              0xDB // 256 bytes, M45PE parts
+#define NOR_CMD_SSE             0x20 // 4KiB
+#define NOR_CMD_SE              0xD8 // 64KiB
+
+#define NOR_SR_WIP              BIT(0)
+
+#define NOR_PAGE_SIZE           256
+#define NOR_SECTOR_SIZE         0x10000
+
+// one bus hold per chunk, a whole flash read doesn't keep everyone else on the bus waiting
+#define SPI_NOR_READ_CHUNK      0x1000
+
+// write in progress polls, with the bus released and the thread asleep in between
+#define SPI_NOR_PROGRAM_POLL_NS 100000
+#define SPI_NOR_PROGRAM_POLLS   100  // 10ms, pages take 5ms at worst
+#define SPI_NOR_ERASE_POLL_NS   1000000
+#define SPI_NOR_ERASE_POLLS     5000 // 5s, sector erases go up to 3s
+
+typedef struct {
+	u32 jedec_id;
+	u8 small_erase_opcode;
+	u8 small_erase_shift;
+	u8 read_mhz; // fastest clock plain read is good for
+} SPI_NORPart;
+
+// anything not in here is taken as 4KiB subsector erase and plain read up to 20MHz
+static const SPI_NORPart SPI_NORParts[] = {
+	{ 0x204011, NOR_CMD_PE, 8, 33 }, // ST M45PE10, the wifi flash
+	{ 0x204012, NOR_CMD_PE, 8, 33 }, // ST M45PE20
+};
+
+typedef struct {
+	bool probed;
+	u32 jedec_id;
+	u32 size;
+	SPI_NORPart part;
+} SPI_NORInfo;
+
+static SPI_NORInfo SPI_NOR[7];
+// write enable up to write done has to go uninterrupted by other flash commands
+static LightLock SPI_NORLock = LIGHTLOCK_STATICINIT;
+static u32 SPI_NORVerify[NOR_PAGE_SIZE / 4]; // a page read back after programming, NOR lock held
+
+static u32 _NORAddrCmd(u8 opcode, u32 addr) {
+	return opcode | ((addr >> 16) & 0xFF) << 8 | ((addr >> 8) & 0xFF) << 16 | (addr & 0xFF) << 24;
+}
+
+// NOR lock held for these
+
+static Result SPINOR_Probe(SPI_Session* session, SPI_Bus* bus, u8 deviceid) {
+	SPI_NORInfo* nor = &SPI_NOR[deviceid];
+
+	if (nor->probed)
+		return 0;
+
+	u32 cmd = NOR_CMD_RDID;
+	u32 id = 0; // word sized, NSPI reads whole words
+
+	Result res = SPIDevice_CmdAndRead(session, bus, deviceid, &cmd, 1, &id, 3);
+	if (R_FAILED(res))
+		return res;
+
+	u8 manufacturer = id & 0xFF;
+	u8 capacity = (id >> 16) & 0xFF;
+
+	// nothing answering reads all 0s or all 1s, and 24 bit addresses only go up to 16MiB
+	if (manufacturer == 0x00 || manufacturer == 0xFF || capacity < 0x10 || capacity > 0x18)
+		return SPI_NOR_NOT_FOUND;
+
+	nor->jedec_id = manufacturer << 16 | (id & 0xFF00) | capacity;
+	nor->size = 1u << capacity;
+	nor->part = (SPI_NORPart){ nor->jedec_id, NOR_CMD_SSE, 12, 20 };
+
+	for (u32 i = 0; i < sizeof(SPI_NORParts) / sizeof(SPI_NORParts[0]); ++i) {
+		if (SPI_NORParts[i].jedec_id == nor->jedec_id)
+			nor->part = SPI_NORParts[i];
+	}
+
+	nor->probed = true;
+	return 0;
+}
+
+// plain read has no dummy byte, so it's the faster one for as long as the part takes it at this clock
+static bool SPINOR_UseFastRead(const SPI_NORInfo* nor, u8 deviceid) {
+	SPI_DeviceBaudrate* dev = SPIDevice_Config(deviceid);
+	u32 khz;
+	if (dev->nspi)
+		khz = 512u << (dev->rate > 5 ? 0 : dev->rate);
+	else
+		khz = 4000u >> (dev->rate & 3);
+	return khz > nor->part.read_mhz * 1000u;
+}
+
+// bus held, from the write enable on, so nobody else's command lands between it and what it enables
+static Result SPINOR_WaitReady(SPI_Bus* bus, u8 deviceid, s64 poll_ns, u32 polls) {
+	u32 cmd = NOR_CMD_RDSR;
+
+	for (u32 i = 0; i < polls; ++i) {
+		u32 status = 0;
+		Result res = SPIBus_CmdAndRead(bus, deviceid, &cmd, 1, &status, 1);
+		if (R_FAILED(res))
+			return res;
+		if (!(status & NOR_SR_WIP))
+			return 0;
+		svcSleepThread(poll_ns);
+	}
+
+	return SPI_TIMEOUT;
+}
+
+static Result SPINOR_WriteEnable(SPI_Bus* bus, u8 deviceid) {
+	u32 cmd = NOR_CMD_WREN;
+	return SPIBus_CmdOnly(bus, deviceid, &cmd, 1);
+}
+
+// one transaction like SPIDevice_CmdAndRead/Write, data summed by the transfer loops when the request asked
+static Result SPINOR_Transfer(SPI_Session* session, SPI_Bus* bus, u8 deviceid, const void* cmd, u32 cmd_length, void* data, u32 length, bool write) {
+	SPIBus_Acquire(bus, session, cmd_length + length, SPIDevice_Mode(deviceid, cmd_length + length));
+
+	bus->sum = session->sum.kind ? &session->sum : NULL;
+	Result res = write ? SPIBus_CmdAndWrite(bus, deviceid, cmd, cmd_length, data, length)
+		: SPIBus_CmdAndRead(bus, deviceid, cmd, cmd_length, data, length);
+	bus->sum = NULL;
+
+	SPIBus_Release(bus);
+
+	return res;
+}
+
+static Result SPINOR_Read(SPI_Session* session, SPI_Bus* bus, u8 deviceid, u32 addr, void* data, u32 length) {
+	bool fast = SPINOR_UseFastRead(&SPI_NOR[deviceid], deviceid);
+	u32 cmd[2] = { 0, 0 }; // dummy byte goes out as 0
+	u32 cmd_length = fast ? 5 : 4;
+
+	while (length) {
+		u32 chunk = length > SPI_NOR_READ_CHUNK ? SPI_NOR_READ_CHUNK : length;
+
+		cmd[0] = _NORAddrCmd(fast ? NOR_CMD_FAST_READ : NOR_CMD_READ, addr);
+
+		Result res = SPINOR_Transfer(session, bus, deviceid, cmd, cmd_length, data, chunk, false);
+		if (R_FAILED(res))
+			return res;
+
+		addr += chunk;
+		data = SILENT_PTR_CAST(u8, data, chunk);
+		length -= chunk;
+	}
+
+	return 0;
+}
+
+static Result SPINOR_Program(SPI_Session* session, SPI_Bus* bus, u8 deviceid, u32 addr, const void* data, u32 length, bool verify) {
+	u32 kind = session->sum.kind;
+	bool fast = verify && SPINOR_UseFastRead(&SPI_NOR[deviceid], deviceid);
+
+	while (length) {
+		// page program wraps around inside the page, so never cross one
+		u32 chunk = NOR_PAGE_SIZE - (addr & (NOR_PAGE_SIZE - 1));
+		if (chunk > length)
+			chunk = length;
+
+		u32 cmd = _NORAddrCmd(NOR_CMD_PP, addr);
+
+		// write enable, program and the wait for it in one bus hold, only the page itself gets summed
+		SPIBus_Acquire(bus, session, 5 + chunk, SPIDevice_Mode(deviceid, 4 + chunk));
+		Result res = SPINOR_WriteEnable(bus, deviceid);
+		if (R_SUCCEEDED(res)) {
+			bus->sum = kind ? &session->sum : NULL;
+			res = SPIBus_CmdAndWrite(bus, deviceid, &cmd, 4, data, chunk);
+			bus->sum = NULL;
+		}
+		if (R_SUCCEEDED(res))
+			res = SPINOR_WaitReady(bus, deviceid, SPI_NOR_PROGRAM_POLL_NS, SPI_NOR_PROGRAM_POLLS);
+		SPIBus_Release(bus);
+
+		if (R_SUCCEEDED(res) && verify) {
+			// what was written is what gets summed, a page is never more than a read chunk
+			u32 read_cmd[2] = { _NORAddrCmd(fast ? NOR_CMD_FAST_READ : NOR_CMD_READ, addr), 0 };
+			session->sum.kind = SPI_CHECK_NONE;
+			res = SPINOR_Transfer(session, bus, deviceid, read_cmd, fast ? 5 : 4, SPI_NORVerify, chunk, false);
+			session->sum.kind = kind;
+		}
+		if (R_FAILED(res))
+			return res;
+
+		// bits program can't set, or a write that never made it, still the client's copy to hand
+		for (u32 i = 0; verify && i < chunk; ++i)
+			if (*SILENT_PTR_CAST(const u8, SPI_NORVerify, i) != *SILENT_PTR_CAST(const u8, data, i))
+				return SPI_NOR_VERIFY_FAILED;
+
+		addr += chunk;
+		data = SILENT_PTR_CAST(const u8, data, chunk);
+		length -= chunk;
+	}
+
+	return 0;
+}
+
+static Result SPINOR_Erase(SPI_Session* session, SPI_Bus* bus, u8 deviceid, u32 addr, u32 length) {
+	const SPI_NORPart* part = &SPI_NOR[deviceid].part;
+	u32 small = 1u << part->small_erase_shift;
+
+	if ((addr | length) & (small - 1))
+		return SPI_NOR_MISALIGNED;
+
+	while (length) {
+		u8 opcode = part->small_erase_opcode;
+		u32 chunk = small;
+
+		if (!(addr & (NOR_SECTOR_SIZE - 1)) && length >= NOR_SECTOR_SIZE) {
+			opcode = NOR_CMD_SE;
+			chunk = NOR_SECTOR_SIZE;
+		}
+
+		u32 cmd = _NORAddrCmd(opcode, addr);
+
+		// the bus stays ours through the whole erase, other devices on it wait that out
+		SPIBus_Acquire(bus, session, 5, SPIDevice_Mode(deviceid, 4));
+		Result res = SPINOR_WriteEnable(bus, deviceid);
+		if (R_SUCCEEDED(res))
+			res = SPIBus_CmdOnly(bus, deviceid, &cmd, 4);
+		if (R_SUCCEEDED(res))
+			res = SPINOR_WaitReady(bus, deviceid, SPI_NOR_ERASE_POLL_NS, SPI_NOR_ERASE_POLLS);
+		SPIBus_Release(bus);
+
+		if (R_FAILED(res))
+			return res;
+
+		addr += chunk;
+		length -= chunk;
+	}
+
+	return 0;
+}
+
+#define SPI_NOR_OP_GEOMETRY 0
+#define SPI_NOR_OP_READ     1
+#define SPI_NOR_OP_PROGRAM  2
+#define SPI_NOR_OP_ERASE    3
+
+// geometry fills out, the rest use addr, data and length
+static Result SPIIPC_NOR(SPI_Session* session, u8 op, u8 deviceid, u32 addr, void* data, u32 length, u32 check, SPI_NORGeometry* out) {
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	if (!bus->devices[_mod3_u8(deviceid)].init)
+		return SPI_NOT_INITIALIZED;
+
+	u32 kind = check & ~SPI_CHECK_VERIFY;
+	if (kind > SPI_CHECK_SUM32 || ((check & SPI_CHECK_VERIFY) && op != SPI_NOR_OP_PROGRAM))
+		return SPI_OUT_OF_RANGE;
+
+	session->sum = (SPI_Checksum){ kind, kind == SPI_CHECK_CRC32 ? ~0u : 0, 0 };
+
+	LightLock_Lock(&SPI_NORLock);
+
+	SPI_NORInfo* nor = &SPI_NOR[deviceid];
+	Result res = SPINOR_Probe(session, bus, deviceid);
+
+	if (R_SUCCEEDED(res) && op != SPI_NOR_OP_GEOMETRY && (addr > nor->size || length > nor->size - addr))
+		res = SPI_OUT_OF_RANGE;
+
+	if (R_SUCCEEDED(res)) {
+		switch (op) {
+		case SPI_NOR_OP_GEOMETRY: {
+				bool fast = SPINOR_UseFastRead(nor, deviceid);
+				out->jedec_id = nor->jedec_id;
+				out->size = nor->size;
+				out->page_size = NOR_PAGE_SIZE;
+				out->erase_size = 1u << nor->part.small_erase_shift;
+				out->read_opcode = fast ? NOR_CMD_FAST_READ : NOR_CMD_READ;
+				out->read_dummy = fast ? 1 : 0;
+				out->reserved[0] = out->reserved[1] = 0;
+			}
+			break;
+		case SPI_NOR_OP_READ:
+			res = SPINOR_Read(session, bus, deviceid, addr, data, length);
+			break;
+		case SPI_NOR_OP_PROGRAM:
+			res = SPINOR_Program(session, bus, deviceid, addr, data, length, check & SPI_CHECK_VERIFY);
+			break;
+		default:
+			res = SPINOR_Erase(session, bus, deviceid, addr, length);
+		}
+	}
+
+	LightLock_Unlock(&SPI_NORLock);
+
+	if (kind == SPI_CHECK_CRC32)
+		session->sum.value = ~session->sum.value;
+
+	return res;
+}
+
+// Register updates, not part of original spi
+// Changing a few bits from outside was a cmd 0x3 and a cmd 0x4, two round trips with the bus up for grabs in between.
+
+static u32 _RegWidthMask(u32 width) {
+	return width >= 4 ? 0xFFFFFFFF : (1u << (width * 8)) - 1;
+}
+
+static bool _RegUpdateValid(const SPI_RegUpdate* update) {
+	if (!update->width || update->width > 4 || !update->write_cmd_length || update->write_cmd_length > 4
+		|| update->read_cmd_length > 4)
+		return false;
+
+	// a partial update has to read what it keeps
+	return update->read_cmd_length || (update->mask & _RegWidthMask(update->width)) == _RegWidthMask(update->width);
+}
+
+// bus held
+static Result SPIBus_RegUpdate(SPI_Bus* bus, u8 deviceid, const SPI_RegUpdate* update, u32* previous) {
+	u32 full = _RegWidthMask(update->width);
+	u32 mask = update->mask & full;
+	u32 cmd = update->read_cmd; // client buffer for lists, own copies so the kernels get whole aligned words
+	u32 reg = 0;
+	Result res;
+
+	if (mask != full) {
+		if (!SPIRegCache_Read(bus, deviceid, &cmd, update->read_cmd_length, &reg, update->width)) {
+			res = SPIBus_CmdAndRead(bus, deviceid, &cmd, update->read_cmd_length, &reg, update->width);
+			if (R_FAILED(res))
+				return res;
+		}
+		reg &= full;
+	}
+
+	if (previous)
+		*previous = reg;
+
+	reg = (reg & ~mask) | (update->value & mask);
+	cmd = update->write_cmd;
+	return SPIBus_CmdAndWrite(bus, deviceid, &cmd, update->write_cmd_length, &reg, update->width);
+}
+
+static Result SPIIPC_RegUpdate(SPI_Session* session, u8 deviceid, const SPI_RegUpdate* updates, u32 count, u32* done, u32* previous) {
+	*done = 0;
+
+	if (!count || count > SPI_REG_UPDATE_MAX)
+		return SPI_OUT_OF_RANGE;
+
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	if (!bus->devices[_mod3_u8(deviceid)].init)
+		return SPI_NOT_INITIALIZED;
+
+	// all checked before the bus is taken, so a list either fails whole or only on the bus
+	u32 cost = 0;
+	u32 longest = 0;
+	for (u32 i = 0; i < count; ++i) {
+		if (!_RegUpdateValid(&updates[i]))
+			return SPI_OUT_OF_RANGE;
+		u32 length = updates[i].write_cmd_length + updates[i].width;
+		cost += updates[i].read_cmd_length + updates[i].width + length;
+		if (length > longest)
+			longest = length;
+	}
+
+	SPIBus_Acquire(bus, session, cost, SPIDevice_Mode(deviceid, longest));
+
+	Result res = 0;
+	for (u32 i = 0; i < count && R_SUCCEEDED(res); ++i) {
+		res = SPIBus_RegUpdate(bus, deviceid, &updates[i], previous);
+		if (R_SUCCEEDED(res))
+			++*done;
+	}
+
+	SPIBus_Release(bus);
+
+	return res;
+}
+
+static Result SPIIPC_SetRegCache(SPI_Session* session, u8 deviceid, bool enable, const SPI_RegCacheConfig* config) {
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	// the flags have to fit under the register bits, or they'd be taken for part of the address
+	if (enable && (config->addr_shift < 1 || config->addr_shift > 7 || config->read_flag >= 1u << config->addr_shift
+		|| config->write_flag >= 1u << config->addr_shift || config->nvolatile > SPI_REGCACHE_MAX_VOLATILE
+		|| config->read_flag == config->write_flag))
+		return SPI_OUT_OF_RANGE;
+
+	// bus held, so nothing is updating the device's entries meanwhile
+	SPIBus_Acquire(bus, session, 0, SPI_MODE_ANY);
+	LightLock_Lock(&SPI_RegCacheLock);
+
+	SPI_RegCacheDevice* dev = &SPI_RegCacheDevices[deviceid];
+	SPIRegCache_Forget(deviceid);
+	dev->enabled = enable;
+	if (enable)
+		dev->config = *config;
+
+	LightLock_Unlock(&SPI_RegCacheLock);
+	SPIBus_Release(bus);
+
+	return 0;
+}
+
+// Microprograms, not part of original spi
+// Checked once when loaded, copied first so the client can't change them after, running only watches the limits.
+// Slots are module wide, each owned by the session that loaded it, only that session's thread runs or frees it.
+
+typedef struct {
+	SPI_Session* owner; // NULL when free
+	u32 count;
+	SPI_ProgOp ops[SPI_PROG_MAX_OPS];
+} SPI_Program;
+
+// lock apart from the slots, a static init would put them all in .data
+static LightLock SPI_ProgLock = LIGHTLOCK_STATICINIT;
+static SPI_Program SPI_Programs[SPI_PROG_SLOTS];
+
+static bool _ProgOpValid(const SPI_ProgOp* op, u32 count) {
+	if (op->reg >= SPI_PROG_REGS)
+		return false;
+
+	switch (op->op) {
+	case SPI_PROG_WRITE_IMM:
+	case SPI_PROG_WRITE_REG:
+	case SPI_PROG_READ_REG:
+	case SPI_PROG_POLL:
+	case SPI_PROG_OUT_REG:
+		return op->length && op->length <= 4;
+	case SPI_PROG_JUMP:
+		return op->length < count;
+	case SPI_PROG_READ_OUT:
+	case SPI_PROG_SET:
+	case SPI_PROG_ADD:
+	case SPI_PROG_DELAY:
+	case SPI_PROG_EXIT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static SPI_Program* SPIProg_Get(SPI_Session* session, u32 handle) {
+	if (handle >= SPI_PROG_SLOTS || SPI_Programs[handle].owner != session)
+		return NULL;
+	return &SPI_Programs[handle];
+}
+
+static Result SPIIPC_ProgFree(SPI_Session* session, u32 handle) {
+	SPI_Program* prog = SPIProg_Get(session, handle);
+
+	if (!prog)
+		return SPI_PROG_NOT_FOUND;
+
+	LightLock_Lock(&SPI_ProgLock);
+	prog->owner = NULL;
+	LightLock_Unlock(&SPI_ProgLock);
+	return 0;
+}
+
+static Result SPIIPC_ProgLoad(SPI_Session* session, const SPI_ProgOp* ops, u32 count, u32* handle) {
+	SPI_Program* prog = NULL;
+
+	if (!count || count > SPI_PROG_MAX_OPS)
+		return SPI_PROG_INVALID;
+
+	LightLock_Lock(&SPI_ProgLock);
+	for (u32 i = 0; i < SPI_PROG_SLOTS && !prog; ++i) {
+		if (!SPI_Programs[i].owner) {
+			prog = &SPI_Programs[i];
+			prog->owner = session;
+			*handle = i;
+		}
+	}
+	LightLock_Unlock(&SPI_ProgLock);
+
+	if (!prog)
+		return SPI_PROG_NO_SLOT;
+
+	u32* dst = (u32*)prog->ops;
+	const u32* src = (const u32*)ops;
+	for (u32 i = 0; i < count * sizeof(SPI_ProgOp) / 4; ++i)
+		dst[i] = src[i];
+	prog->count = count;
+
+	for (u32 i = 0; i < count; ++i) {
+		if (!_ProgOpValid(&prog->ops[i], count)) {
+			SPIIPC_ProgFree(session, *handle);
+			return SPI_PROG_INVALID;
+		}
+	}
+
+	return 0;
+}
+
+static void SPIProg_Release(SPI_Session* session) {
+	for (u32 i = 0; i < SPI_PROG_SLOTS; ++i)
+		SPIIPC_ProgFree(session, i);
+}
+
+// bus held, one transfer op, opens the window if it isn't, and closes it after with end
+static bool SPIBus_ProgTransfer(SPI_Bus* bus, u8 deviceid, u8 rate, bool* open, bool write, void* data, u32 length, bool end) {
+	u64 budget = SPIBus_WaitBudget(bus, rate, length);
+
+	if (!*open)
+		++bus->stats.transactions;
+
+	deviceid = _mod3_u8(deviceid);
+
+	if (bus->is_nspi_mode) {
+		NSPI_Bus_Regs* regs = bus->nspi_bus;
+
+		if (!*open && !__NSPIStart(regs, &bus->regs, budget))
+			return false;
+		*open = true;
+
+		__NSPIWriteBLKLEN(regs, &bus->regs, length);
+		MMIO_WRITE(regs->CNT, NSPI_BUS_ENABLE_BIT | (write ? NSPI_BUS_TRANSFER_WRITE_BIT : NSPI_BUS_TRANSFER_READ_BIT) | (deviceid << 6) | rate);
+
+		bool done = write ? __NSPIWriteLoop(regs, data, length, budget, NULL)
+			: __NSPIReadLoop(regs, data, length, __NSPIGetRateReadSleepTime(rate), budget, NULL);
+		if (!done)
+			return false;
+
+		if (end) {
+			__NSPIDone(regs, &bus->regs);
+			*open = false;
+		}
+		return true;
+	}
+
+	SPI_Bus_Regs* regs = bus->spi_bus;
+	u32 byte_ns = __SPIGetRateByteTime(rate);
+	u8* last = (u8*)data + length - 1;
+
+	__SPIWriteCNT(regs, &bus->regs, SPI_BUS_ENABLE_BIT | SPI_BUS_SELECTHOLD_BIT | (deviceid << 8) | rate);
+	*open = true;
+
+	u32 held = end ? length - 1 : length; // the last byte of the window goes without the hold
+	bool done = write ? __SPIWriteLoop(regs, data, held, byte_ns, budget, NULL) : __SPIReadLoop(regs, data, held, byte_ns, budget, NULL);
+	if (!done || !end)
+		return done;
+
+	__SPIWriteCNT(regs, &bus->regs, SPI_BUS_ENABLE_BIT | (deviceid << 8) | rate);
+	*open = false;
+
+	MMIO_WRITE(regs->DATA, write ? *last : 0);
+	if (!__SPIWaitBusy(regs, byte_ns, budget))
+		return false;
+	if (!write)
+		*last = MMIO_READ(regs->DATA);
+	return true;
+}
+
+// window left open by a poll or by the program stopping, nothing left to send it off with
+static void SPIBus_ProgClose(SPI_Bus* bus) {
+	if (bus->is_nspi_mode) {
+		__NSPIDone(bus->nspi_bus, &bus->regs);
+	} else {
+		MMIO_WRITE(bus->spi_bus->CNT, 0); // disabled, chip select drops
+		bus->regs.cnt = 0;
+	}
+}
+
+// a transfer that would still be on the wire at expiry isn't started, the limit holds for long reads too
+static bool _ProgFits(SPI_Bus* bus, u8 rate, u32 length, u64 expiry) {
+	u64 ns = (u64)length * SPIBus_ByteTime(bus->is_nspi_mode, rate);
+	return svcGetSystemTick() + ((ns * 275u) >> 10) <= expiry;
+}
+
+static bool _ProgMatch(u32 reg, u32 arg) {
+	return (reg & (arg & 0xFFFF)) == arg >> 16;
+}
+
+// bus held, reply is exit value, output bytes, ops run
+static Result SPIBus_ProgRun(SPI_Bus* bus, u8 deviceid, const SPI_Program* prog, u32* regs, u8* out, u32 out_size, u32* reply) {
+	u8 rate = SPIBus_Prepare(bus, deviceid, 0);
+	u64 expiry = svcGetSystemTick() + (u64)SPI_PROG_MAX_US * 268;
+	bool open = false;
+	bool done = true;
+	Result res = 0;
+	u32 pc = 0;
+
+	++bus->device_writes[_mod3_u8(deviceid)];
+
+	while (done && R_SUCCEEDED(res) && pc < prog->count) {
+		const SPI_ProgOp* op = &prog->ops[pc++];
+		u32* reg = &regs[op->reg];
+		bool end = op->flags & SPI_PROG_FLAG_END;
+		u32 word = 0;
+
+		if (++reply[2] > SPI_PROG_MAX_STEPS || svcGetSystemTick() > expiry) {
+			res = SPI_PROG_LIMIT;
+			break;
+		}
+
+		switch (op->op) {
+		case SPI_PROG_WRITE_IMM:
+		case SPI_PROG_WRITE_REG:
+		case SPI_PROG_READ_REG:
+			if (!_ProgFits(bus, rate, op->length, expiry)) {
+				res = SPI_PROG_LIMIT;
+				break;
+			}
+			word = op->op == SPI_PROG_WRITE_IMM ? op->arg : *reg;
+			done = SPIBus_ProgTransfer(bus, deviceid, rate, &open, op->op != SPI_PROG_READ_REG, &word, op->length, end);
+			if (op->op == SPI_PROG_READ_REG)
+				*reg = word;
+			break;
+		case SPI_PROG_READ_OUT: {
+				u32 length = op->flags & SPI_PROG_FLAG_REG ? *reg : op->arg;
+				if (length > out_size - reply[1]) {
+					res = SPI_OUT_OF_RANGE;
+				} else if (length && !_ProgFits(bus, rate, length, expiry)) {
+					res = SPI_PROG_LIMIT;
+				} else if (length) {
+					done = SPIBus_ProgTransfer(bus, deviceid, rate, &open, false, out + reply[1], length, end);
+					reply[1] += length;
+				} else if (end && open) {
+					SPIBus_ProgClose(bus);
+					open = false;
+				}
+			}
+			break;
+		case SPI_PROG_POLL:
+			do {
+				if (!_ProgFits(bus, rate, op->length, expiry))
+					res = SPI_PROG_LIMIT;
+				else
+					done = SPIBus_ProgTransfer(bus, deviceid, rate, &open, false, &word, op->length, false);
+			} while (done && R_SUCCEEDED(res) && !_ProgMatch(word, op->arg));
+			*reg = word;
+			if (end && open && done && R_SUCCEEDED(res)) {
+				SPIBus_ProgClose(bus);
+				open = false;
+			}
+			break;
+		case SPI_PROG_OUT_REG:
+			if (op->length > out_size - reply[1]) {
+				res = SPI_OUT_OF_RANGE;
+				break;
+			}
+			for (u32 i = 0; i < op->length; ++i)
+				out[reply[1]++] = *reg >> (i * 8);
+			break;
+		case SPI_PROG_SET:
+			*reg = op->arg;
+			break;
+		case SPI_PROG_ADD:
+			*reg += op->arg;
+			break;
+		case SPI_PROG_JUMP:
+			if (_ProgMatch(*reg, op->arg) != !!(op->flags & SPI_PROG_FLAG_NOT))
+				pc = op->length;
+			break;
+		case SPI_PROG_DELAY:
+			if (svcGetSystemTick() + (u64)op->arg * 268 > expiry)
+				res = SPI_PROG_LIMIT;
+			else
+				svcSleepThread((s64)op->arg * 1000);
+			break;
+		case SPI_PROG_EXIT:
+			reply[0] = op->arg;
+			pc = prog->count;
+			break;
+		}
+	}
+
+	// what a program did to the device's registers isn't followed
+	SPIRegCache_Update(deviceid, NULL, 0, NULL, 0, false, false);
+
+	if (!done)
+		return SPIBus_Recover(bus);
+
+	if (open)
+		SPIBus_ProgClose(bus);
+	return res;
+}
+
+static Result SPIIPC_ProgRun(SPI_Session* session, u32 handle, u8 deviceid, u32* regs, u8* out, u32 out_size, u32* reply) {
+	const SPI_Program* prog = SPIProg_Get(session, handle);
+
+	if (!prog)
+		return SPI_PROG_NOT_FOUND;
+
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+
+	if (!bus)
+		Err_Panic(SPI_INVALID_SELECTION);
+
+	if (!bus->devices[_mod3_u8(deviceid)].init)
+		return SPI_NOT_INITIALIZED;
+
+	// no telling up front what it moves, the output is a fair guess for bulk accounting
+	SPIBus_Acquire(bus, session, out_size + prog->count, SPIDevice_Mode(deviceid, 0));
+
+	Result res = SPIBus_ProgRun(bus, deviceid, prog, regs, out, out_size, reply);
+
+	SPIBus_Release(bus);
+
+	return res;
+}
+
+// Read ahead, not part of original spi
+// A session reading a device with plain 0x03 reads, each starting where the last one ended, gets the next one
+// read into a buffer once its reply is out, if the bus has nothing else to do. Only one buffer for the module,
+// whichever stream prefetched last owns it. Anyone showing up on the bus stops the prefetch in between steps.
+
+#define NOR_CMD_READ_SEQ_MIN   2 // reads in a row before it counts as a stream
+#define SPI_READAHEAD_SIZE     0x1000
+#define SPI_READAHEAD_STEP     0x100
+
+typedef struct {
+	SPI_Session* owner;
+	u8 deviceid;
+	bool valid;
+	u32 writes;  // device_writes of the device when the prefetch started
+	u32 addr;
+	u32 length;
+	u32 data[SPI_READAHEAD_SIZE / 4];
+} SPI_ReadAheadBuffer;
+
+// lock apart from the buffer, a static init would put the whole buffer in .data
+static LightLock SPI_ReadAheadLock = LIGHTLOCK_STATICINIT;
+static SPI_ReadAheadBuffer SPI_ReadAhead;
+
+static u32 _NORCmdAddr(u32 cmd) {
+	return ((cmd >> 8) & 0xFF) << 16 | ((cmd >> 16) & 0xFF) << 8 | (cmd >> 24);
+}
+
+// lock held
+static void SPIReadAhead_Drop(void) {
+	SPI_ReadAheadBuffer* ra = &SPI_ReadAhead;
+	if (ra->valid)
+		GetBusFromDeviceId(ra->deviceid)->stats.readahead_wasted += ra->length;
+	ra->valid = false;
+}
+
+static Result SPIReadAhead_Read(SPI_Session* session, u8 deviceid, u32 cmd, u32 cmd_length, void* data, u32 data_length) {
+	SPI_ReadAheadBuffer* ra = &SPI_ReadAhead;
+
+	if (deviceid > 6 || !(SPIDevice_Config(deviceid)->flags & SPI_DEVICE_FLAG_READ_AHEAD) || SPIDevice_Config(deviceid)->convert
+		|| cmd_length != 4 || (cmd & 0xFF) != NOR_CMD_READ)
+		return SPIIPC_SendCmdAndRead(session, deviceid, &cmd, cmd_length, data, data_length);
+
+	u32 addr = _NORCmdAddr(cmd);
+	bool streaming = session->ra_streak >= NOR_CMD_READ_SEQ_MIN && session->ra_deviceid == deviceid && session->ra_next == addr;
+	bool hit = false;
+	Result res = 0;
+
+	if (streaming && ra->owner == session) {
+		LightLock_Lock(&SPI_ReadAheadLock);
+		if (ra->valid && ra->owner == session && ra->deviceid == deviceid && ra->writes == GetBusFromDeviceId(deviceid)->device_writes[_mod3_u8(deviceid)]
+			&& ra->addr == addr && ra->length >= data_length) {
+			for (u32 i = 0; i < data_length; ++i)
+				*SILENT_PTR_CAST(u8, data, i) = *SILENT_PTR_CAST(const u8, ra->data, i);
+			ra->length -= data_length;
+			SPIReadAhead_Drop(); // anything past what was asked for
+			hit = true;
+		}
+		LightLock_Unlock(&SPI_ReadAheadLock);
+	}
+
+	if (!hit)
+		res = SPIIPC_SendCmdAndRead(session, deviceid, &cmd, cmd_length, data, data_length);
+
+	if (R_FAILED(res)) {
+		session->ra_streak = 0;
+		return res;
+	}
+
+	if (streaming) {
+		SPI_BusStats* stats = &GetBusFromDeviceId(deviceid)->stats;
+		if (hit)
+			++stats->readahead_hits;
+		else
+			++stats->readahead_misses;
+	}
+
+	if (session->ra_deviceid == deviceid && session->ra_next == addr) {
+		if (session->ra_streak < NOR_CMD_READ_SEQ_MIN)
+			++session->ra_streak;
+	} else
+		session->ra_streak = 1;
+
+	session->ra_deviceid = deviceid;
+	session->ra_next = (addr + data_length) & 0xFFFFFF;
+	session->ra_length = data_length;
+	session->ra_want = session->ra_streak >= NOR_CMD_READ_SEQ_MIN && data_length <= SPI_READAHEAD_SIZE;
+
+	return 0;
+}
+
+static void SPIReadAhead_Fill(SPI_Session* session) {
+	SPI_ReadAheadBuffer* ra = &SPI_ReadAhead;
+	u8 deviceid = session->ra_deviceid;
+	SPI_Bus* bus = GetBusFromDeviceId(deviceid);
+	u32 addr = session->ra_next;
+	u32 length = session->ra_length;
+
+	session->ra_want = false;
+
+	// plain reads into the wire lock, a stale peek only means one prefetch more or less
+	if (bus->busy || bus->waiters)
+		return;
+
+	LightLock_Lock(&SPI_ReadAheadLock);
+
+	SPIReadAhead_Drop();
+	ra->owner = session;
+	ra->deviceid = deviceid;
+	ra->addr = addr;
+	ra->length = 0;
+	ra->writes = bus->device_writes[_mod3_u8(deviceid)];
+
+	for (u32 done = 0; done < length; done += SPI_READAHEAD_STEP) {
+		if (done && (bus->busy || bus->waiters))
+			break;
+
+		u32 step = length - done > SPI_READAHEAD_STEP ? SPI_READAHEAD_STEP : length - done;
+		u32 cmd = _NORAddrCmd(NOR_CMD_READ, (addr + done) & 0xFFFFFF);
+
+		Result res = SPIDevice_CmdAndRead(session, bus, deviceid, &cmd, 4, SILENT_PTR_CAST(u8, ra->data, done), step);
+		if (R_FAILED(res))
+			break;
+		ra->length = done + step;
+	}
+
+	// half a prefetch is no use for a read of the full length
+	ra->valid = true;
+	if (ra->length != length)
+		SPIReadAhead_Drop();
+
+	LightLock_Unlock(&SPI_ReadAheadLock);
+}
+
+static void SPIReadAhead_Stop(SPI_Session* session) {
+	SPI_ReadAheadBuffer* ra = &SPI_ReadAhead;
+
+	session->ra_streak = 0;
+	session->ra_want = false;
+
+	LightLock_Lock(&SPI_ReadAheadLock);
+	if (ra->owner == session) {
+		SPIReadAhead_Drop();
+		ra->owner = NULL;
+	}
+	LightLock_Unlock(&SPI_ReadAheadLock);
+}
+
+// sysmodules get shared memory mapped in 0x10000000 onward, one window per service session
+#define SPI_RING_MAP_BASE 0x10000000
+
+// a mapping neighbouring windows can show up merged into, so it's only checked to reach at least size past addr
+static bool SPI_MappedAtLeast(u32 addr, u32 size) {
+	MemInfo info;
+	PageInfo page;
+	return R_SUCCEEDED(svcQueryMemory(&info, &page, addr)) && (info.perm & MEMPERM_READWRITE) == MEMPERM_READWRITE
+		&& info.base_addr <= addr && info.base_addr + info.size >= addr + size;
+}
+
+static Result SPIRing_Setup(SPI_Session* session, u32 size, Handle block, Handle doorbell, Handle done) {
+	if (session->ring)
+		return SPI_RING_ALREADY_SETUP;
+
+	if (size <= sizeof(SPI_Ring) || size > SPI_RING_MAX_SIZE || (size & 0xFFF))
+		return SPI_RING_INVALID_SIZE;
+
+	u32 addr = SPI_RING_MAP_BASE + (u32)(session - SPI_Sessions) * SPI_RING_MAX_SIZE;
+
+	Result res = svcMapMemoryBlock(block, addr, MEMPERM_READWRITE, MEMPERM_DONTCARE);
+	if (R_FAILED(res))
+		return res;
+
+	// size is only what the client says, the block has to cover it
+	if (!SPI_MappedAtLeast(addr, size)) {
+		svcUnmapMemoryBlock(block, addr);
+		return SPI_RING_INVALID_SIZE;
+	}
+
+	session->ring = (SPI_Ring*)addr;
+	session->ring_data_size = size - sizeof(SPI_Ring);
+	session->ring_block = block;
+	session->ring_done = done;
+	session->handles[1] = doorbell;
+
+	return 0;
+}
+
+static void SPIRing_Teardown(SPI_Session* session) {
+	if (!session->ring)
+		return;
+
+	svcUnmapMemoryBlock(session->ring_block, (u32)session->ring);
+	svcCloseHandle(session->ring_block);
+	svcCloseHandle(session->handles[1]);
+	svcCloseHandle(session->ring_done);
+
+	session->ring = NULL;
+	session->handles[1] = 0;
+}
+
+static Result SPIRing_Execute(SPI_Session* session, const SPI_RingSubmission* sub) {
+	u32 data_length = sub->data_length;
+	u32 data_offset = sub->data_offset;
+
+	// the IPC path panics on a bad device, one stray byte in a shared slot shouldn't take every session down with us
+	if (!GetBusFromDeviceId(sub->deviceid))
+		return SPI_INVALID_SELECTION;
+
+	if (sub->op == SPI_RING_OP_CMD_ONLY)
+		return SPIIPC_SendCmdOnly(session, sub->deviceid, &sub->cmd, sub->cmd_length);
+
+	// data comes straight from the shared block, so bounds are on us, and no zero lengths either
+	if (!data_length || data_length > session->ring_data_size || data_offset > session->ring_data_size - data_length)
+		return SPI_OUT_OF_RANGE;
+
+	void* data = &session->ring->data[data_offset];
+
+	if (sub->op == SPI_RING_OP_READ)
+		return SPIIPC_SendCmdAndRead(session, sub->deviceid, &sub->cmd, sub->cmd_length, data, data_length);
+	if (sub->op == SPI_RING_OP_WRITE)
+		return SPIIPC_SendCmdAndWrite(session, sub->deviceid, &sub->cmd, sub->cmd_length, data, data_length);
+
+	return OS_INVALID_HEADER;
+}
+
+static void SPIRing_Drain(SPI_Session* session) {
+	SPI_Ring* ring = session->ring;
+	u32 sub_tail = ring->sub_tail;
+	u32 comp_head = ring->comp_head;
+	bool completed = false;
+
+	for (;;) {
+		u32 sub_head = ring->sub_head;
+		if (sub_tail == sub_head || comp_head - ring->comp_tail >= SPI_RING_ENTRIES)
+			break;
+
+		__dmb(); // see the entry only after we saw the head that published it
+
+		// copy out, client could still be scribbling over the slot
+		SPI_RingSubmission sub = ring->sub[sub_tail & (SPI_RING_ENTRIES - 1)];
+
+		SPI_RingCompletion* comp = &ring->comp[comp_head & (SPI_RING_ENTRIES - 1)];
+		comp->user = sub.user;
+		comp->result = SPIRing_Execute(session, &sub);
+
+		__dmb();
+
+		ring->sub_tail = ++sub_tail;
+		ring->comp_head = ++comp_head;
+		completed = true;
+	}
+
+	if (completed)
+		svcSignalEvent(session->ring_done);
+}
+
+static Result SPIAsync_Submit(SPI_Session* session, const u32* args, Handle event, u32* ticket) {
+	SPI_AsyncTicket* t = &session->async[session->async_next & (SPI_ASYNC_TICKETS - 1)];
+
+	if (t->state != SPI_ASYNC_FREE)
+		return SPI_ASYNC_FULL;
+
+	// whatever can be told now is, rather than the client only finding out at collect
+	// the slot only keeps bytes, so the whole words get looked at
+	if (args[0] != SPI_RING_OP_READ && args[0] != SPI_RING_OP_WRITE && args[0] != SPI_RING_OP_CMD_ONLY)
+		return OS_INVALID_HEADER;
+	if (args[1] > 0xFF || !GetBusFromDeviceId(args[1]))
+		return SPI_INVALID_SELECTION;
+	if (args[3] > 4)
+		return SPI_OUT_OF_RANGE;
+	if (args[0] != SPI_RING_OP_CMD_ONLY && !session->ring)
+		return SPI_NOT_INITIALIZED;
+	if (args[0] != SPI_RING_OP_CMD_ONLY && (!args[5] || args[5] > session->ring_data_size || args[4] > session->ring_data_size - args[5]))
+		return SPI_OUT_OF_RANGE;
+
+	t->sub.op = args[0];
+	t->sub.deviceid = args[1];
+	t->sub.cmd = args[2];
+	t->sub.cmd_length = args[3];
+	t->sub.data_offset = args[4];
+	t->sub.data_length = args[5];
+	t->sub.user = session->async_next;
+	t->state = SPI_ASYNC_QUEUED;
+	t->event = event;
+
+	*ticket = session->async_next++;
+	return 0;
+}
+
+static void SPIAsync_RunNext(SPI_Session* session) {
+	SPI_AsyncTicket* t = &session->async[session->async_run++ & (SPI_ASYNC_TICKETS - 1)];
+
+	// the ring could have been torn down since, bounds are checked against whatever is there now
+	if (t->sub.op != SPI_RING_OP_CMD_ONLY && !session->ring)
+		t->result = SPI_NOT_INITIALIZED;
+	else
+		t->result = SPIRing_Execute(session, &t->sub);
+
+	t->state = SPI_ASYNC_DONE;
+	if (t->event)
+		svcSignalEvent(t->event);
+}
+
+// after the reply, at least one, then on until the queue is empty or the client has a request waiting,
+// the ring doorbell is left alone, waiting on it would eat the signal
+static void SPIAsync_Run(SPI_Session* session) {
+	do {
+		SPIAsync_RunNext(session);
+	} while (session->async_run != session->async_next && svcWaitSynchronization(session->handles[0], 0) != 0); // timeouts aren't failures
+}
+
+static Result SPIAsync_Collect(SPI_Session* session, u32 ticket, bool wait, Result* result) {
+	SPI_AsyncTicket* t = &session->async[ticket & (SPI_ASYNC_TICKETS - 1)];
+
+	if (t->state == SPI_ASYNC_FREE || t->sub.user != ticket)
+		return SPI_ASYNC_NOT_FOUND;
+
+	if (t->state == SPI_ASYNC_QUEUED) {
+		if (!wait)
+			return SPI_ASYNC_PENDING;
+		while (t->state == SPI_ASYNC_QUEUED)
+			SPIAsync_RunNext(session);
+	}
+
+	*result = t->result;
+	if (t->event)
+		svcCloseHandle(t->event);
+	t->event = 0;
+	t->state = SPI_ASYNC_FREE;
+	return 0;
+}
+
+static void SPIAsync_Release(SPI_Session* session) {
+	for (u32 i = 0; i < SPI_ASYNC_TICKETS; ++i) {
+		SPI_AsyncTicket* t = &session->async[i];
+		if (t->event)
+			svcCloseHandle(t->event);
+		t->event = 0;
+		t->state = SPI_ASYNC_FREE;
+	}
+	session->async_run = session->async_next;
+}
+
+// mapped right after the ring windows
+#define SPI_TRACE_MAP_ADDR (SPI_RING_MAP_BASE + 5 * SPI_RING_MAX_SIZE)
+
+static struct {
+	LightLock lock;
+	SPI_Session* owner;
+	Handle block;
+	SPI_Trace* trace; // also read without the lock, as a cheap is capturing check
+	u32 capacity;     // in records
+	u64 last_tick;
+} SPI_Capture = { .lock = LIGHTLOCK_STATICINIT };
+
+static Result SPICapture_Start(SPI_Session* session, u32 size, Handle block) {
+	if (size <= sizeof(SPI_Trace) || size > SPI_TRACE_MAX_SIZE || (size & 0xFFF))
+		return SPI_TRACE_INVALID_SIZE;
+
+	LightLock_Lock(&SPI_Capture.lock);
+
+	Result res = SPI_TRACE_ALREADY_SETUP;
+
+	if (!SPI_Capture.trace) {
+		res = svcMapMemoryBlock(block, SPI_TRACE_MAP_ADDR, MEMPERM_READWRITE, MEMPERM_DONTCARE);
+		if (R_SUCCEEDED(res)) {
+			SPI_Trace* trace = (SPI_Trace*)SPI_TRACE_MAP_ADDR;
+			SPI_Capture.owner = session;
+			SPI_Capture.block = block;
+			SPI_Capture.capacity = (size - sizeof(SPI_Trace)) / sizeof(SPI_TraceRecord);
+			SPI_Capture.last_tick = svcGetSystemTick();
+			trace->count = 0;
+			trace->dropped = 0;
+			trace->start_tick = SPI_Capture.last_tick;
+			SPI_Capture.trace = trace;
+		}
+	}
+
+	LightLock_Unlock(&SPI_Capture.lock);
+
+	return res;
+}
+
+static Result SPICapture_Stop(SPI_Session* session) {
+	Result res = SPI_TRACE_NOT_OWNER;
+
+	LightLock_Lock(&SPI_Capture.lock);
+
+	if (SPI_Capture.trace && SPI_Capture.owner == session) {
+		SPI_Capture.trace = NULL;
+		svcUnmapMemoryBlock(SPI_Capture.block, SPI_TRACE_MAP_ADDR);
+		svcCloseHandle(SPI_Capture.block);
+		res = 0;
+	}
+
+	LightLock_Unlock(&SPI_Capture.lock);
+
+	return res;
+}
+
+static void SPICapture_Record(SPI_Session* session, const u32* cmdbuf) {
+	if (!SPI_Capture.trace)
+		return;
+
+	u32 header = cmdbuf[0];
+	u16 id = header >> 16;
+	u32 normal = (header >> 6) & 0x3F;
+	u32 length = 0;
+	u32 deadline = 0;
+
+	if (id == 0xF || id == 0x10)
+		return;
+
+	if (id >= 0x3 && id <= 0x7) {
+		u32 base = id == 0x4 ? 20 : id == 0x5 ? 3 : 4;
+		if (normal == base + 1)
+			deadline = cmdbuf[base + 1];
+		if (id == 0x3)
+			length = cmdbuf[4];
+		else if (id == 0x4)
+			length = cmdbuf[20];
+		else if (id != 0x5)
+			length = IPC_Get_Desc_Buffer_Size(cmdbuf[normal + 1]);
+	} else if (id >= 0x12 && id <= 0x14) {
+		length = cmdbuf[3];
+	} else if (id == 0x1F) {
+		length = cmdbuf[6];
+	} else if (id == 0x1A) {
+		for (u32 i = normal + 1; i < normal + 1 + (header & 0x3F) && i < 63; i += 2)
+			length += IPC_Get_Desc_Buffer_Size(cmdbuf[i]);
+	}
+
+	LightLock_Lock(&SPI_Capture.lock);
+
+	SPI_Trace* trace = SPI_Capture.trace;
+
+	if (trace) {
+		u32 count = trace->count;
+		if (count >= SPI_Capture.capacity) {
+			++trace->dropped;
+		} else {
+			SPI_TraceRecord* rec = &trace->records[count];
+			u64 now = svcGetSystemTick();
+			u64 delta = now - SPI_Capture.last_tick;
+			SPI_Capture.last_tick = now;
+
+			rec->delta = delta > 0xFFFFFFFF ? 0xFFFFFFFF : (u32)delta;
+			rec->header = header;
+			rec->args[0] = cmdbuf[1];
+			rec->args[1] = cmdbuf[2];
+			rec->args[2] = cmdbuf[3];
+			rec->length = length;
+			rec->deadline = deadline;
+			rec->service = session - SPI_Sessions;
+
+			__dmb(); // record lands before the count that publishes it
+			trace->count = count + 1;
+		}
+	}
+
+	LightLock_Unlock(&SPI_Capture.lock);
+}
+
+// cmds 0x3 to 0x7 may carry a deadline in one more normal parameter, gives back how many they carry
+static u32 SPI_TakeDeadline(SPI_Session* session, const u32* cmdbuf, u32 normal) {
+	if (((cmdbuf[0] >> 6) & 0x3F) != normal + 1)
+		return normal;
+
+	// ticks run at 268111856Hz, a hair over 268 per microsecond, if anything misses get counted a touch early
+	session->deadline = svcGetSystemTick() + (u64)cmdbuf[normal + 1] * 268;
+	return normal + 1;
+}
+
+#ifdef SPI_STACK_DEBUG
+// bit 0 main, then a bit per service, set once its stack got painted
+static u8 SPI_StackPainted;
+static u16 SPI_StackPeak[SPI_STACK_COUNT];
+
+static void _StackPaint(uptr bottom, uptr top) {
+	for (u32* p = (u32*)bottom; p < (u32*)top; ++p)
+		*p = SPI_STACK_CANARY;
+}
+
+// stacks grow down, so the first word up from the bottom that isn't canary anymore is as deep as it got
+static u32 _StackUsed(uptr bottom, u32 size) {
+	const u32* p = (const u32*)bottom;
+	while (size && *p == SPI_STACK_CANARY) {
+		++p;
+		size -= 4;
+	}
+	return size;
+}
+
+static uptr _ThreadStackBottom(u32 service) {
+	return _thread_stack_sp_top_offset - (service + 1) * SPI_THREAD_STACK_SIZE;
+}
+
+static u32 SPIStack_Peak(u32 index) {
+	if (!(SPI_StackPainted & BIT(index)))
+		return 0;
+
+	u32 used = index ? _StackUsed(_ThreadStackBottom(index - 1), SPI_THREAD_STACK_SIZE)
+		: _StackUsed(_thread_stack_sp_top_offset, SPI_MAIN_STACK_SIZE);
+	if (used > SPI_StackPeak[index])
+		SPI_StackPeak[index] = used;
+	return SPI_StackPeak[index];
+}
+
+// everything below this frame, less some room for the loop itself
+static __attribute__((noinline)) void SPIStack_PaintMain() {
+	uptr bottom = _thread_stack_sp_top_offset;
+	volatile u32 here = 0;
+	uptr sp = (uptr)&here;
+
+	// main isn't always where start.s put it, hostsim runs it on a host thread
+	if (sp <= bottom + 64 || sp - bottom > SPI_MAIN_STACK_SIZE)
+		return;
+
+	_StackPaint(bottom, (sp - 64) & ~3);
+	SPI_StackPainted |= BIT(0);
+}
+
+// right before the thread starts, the previous session on it has already exited
+static void SPIStack_PaintThread(u32 service) {
+	SPIStack_Peak(service + 1);
+
+	uptr bottom = _ThreadStackBottom(service);
+	_StackPaint(bottom, bottom + SPI_THREAD_STACK_SIZE - 8); // top 2 words are StartThread's function and arg
+	SPI_StackPainted |= BIT(service + 1);
+}
+#endif
+
+// 0x1B to 0x1D, not inlined either, the register copies stay off every other request's stack
+static __attribute__((noinline)) void SPIIPC_ProgRequest(SPI_Session* session, u32* cmdbuf) {
+	u16 id = cmdbuf[0] >> 16;
+
+	if (id == 0x1D) {
+		cmdbuf[1] = SPIIPC_ProgFree(session, cmdbuf[1]);
+		cmdbuf[0] = IPC_MakeHeader(0x1D, 1, 0);
+		return;
+	}
+
+	u32 access = id == 0x1B ? IPC_BUFFER_R : IPC_BUFFER_W;
+	u32 normal = id == 0x1B ? 1 : 2 + SPI_PROG_REGS;
+
+	if (!IPC_CompareHeader(cmdbuf[0], id, normal, 2) || !IPC_Is_Desc_Buffer(cmdbuf[normal + 1], access)) {
+		cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+		cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		return;
+	}
+
+	u32 size = IPC_Get_Desc_Buffer_Size(cmdbuf[normal + 1]);
+	void* buffer = (void*)cmdbuf[normal + 2];
+
+	if (id == 0x1B) {
+		u32 count = cmdbuf[1];
+		u32 handle = 0;
+
+		if (count > SPI_PROG_MAX_OPS || size < count * sizeof(SPI_ProgOp) || ((u32)buffer & 3))
+			cmdbuf[1] = SPI_PROG_INVALID;
+		else
+			cmdbuf[1] = SPIIPC_ProgLoad(session, (const SPI_ProgOp*)buffer, count, &handle);
+		cmdbuf[0] = IPC_MakeHeader(0x1B, 2, 2);
+		cmdbuf[2] = handle;
+		cmdbuf[3] = IPC_Desc_Buffer(size, IPC_BUFFER_R);
+		cmdbuf[4] = (u32)buffer;
+		return;
+	}
+
+	u32 regs[SPI_PROG_REGS];
+	u32 reply[3] = { 0, 0, 0 }; // exit value, output bytes, ops run
+	for (u32 i = 0; i < SPI_PROG_REGS; ++i)
+		regs[i] = cmdbuf[3 + i];
+
+	cmdbuf[1] = SPIIPC_ProgRun(session, cmdbuf[1], cmdbuf[2], regs, (u8*)buffer, size, reply);
+	cmdbuf[0] = IPC_MakeHeader(0x1C, 4 + SPI_PROG_REGS, 2);
+	for (u32 i = 0; i < 3; ++i)
+		cmdbuf[2 + i] = reply[i];
+	for (u32 i = 0; i < SPI_PROG_REGS; ++i)
+		cmdbuf[5 + i] = regs[i];
+	cmdbuf[5 + SPI_PROG_REGS] = IPC_Desc_Buffer(size, IPC_BUFFER_W);
+	cmdbuf[6 + SPI_PROG_REGS] = (u32)buffer;
+}
+
+static SPI_HOT void SPI_IPCSession(SPI_Session* session) {
+	u32* cmdbuf = getThreadCommandBuffer();
+
+	SPICapture_Record(session, cmdbuf);
+
+	switch (cmdbuf[0] >> 16) {
+	case 0x1:
+		SPIIPC_InitDeviceRate(cmdbuf[1], cmdbuf[2]);
+		cmdbuf[0] = IPC_MakeHeader(0x1, 1, 0);
+		cmdbuf[1] = 0;
+		break;
+	case 0x2: // stub, always 0
+		cmdbuf[0] = IPC_MakeHeader(0x2, 1, 0);
+		cmdbuf[1] = 0;
+		break;
+	case 0x3: {
+			SPI_TakeDeadline(session, cmdbuf, 4);
+
+			u8 deviceid = cmdbuf[1];
+			u32 cmd = cmdbuf[2];
+			u32 cmd_length = cmdbuf[3];
+
+			void* data_out = (void*)&cmdbuf[2];
+			u32 data_length = cmdbuf[4];
+
+			if (data_length > 64)
+				cmdbuf[1] = SPI_OUT_OF_RANGE;
+			else
+				cmdbuf[1] = SPIIPC_SendCmdAndRead(session, deviceid, &cmd, cmd_length, data_out, data_length);
+		}
+		cmdbuf[0] = IPC_MakeHeader(0x3, 17, 0);
+		break;
+	case 0x4: {
+			SPI_TakeDeadline(session, cmdbuf, 20);
+
+			u8 deviceid = cmdbuf[1];
+			u32 cmd = cmdbuf[2];
+			u32 cmd_length = cmdbuf[3];
+
+			const void* data_in = (void*)&cmdbuf[4];
+			u32 data_length = cmdbuf[20];
+
+			if (data_length > 64)
+				cmdbuf[1] = SPI_OUT_OF_RANGE;
+			else
+				cmdbuf[1] = SPIIPC_SendCmdAndWrite(session, deviceid, &cmd, cmd_length, data_in, data_length);
+		}
+		cmdbuf[0] = IPC_MakeHeader(0x4, 1, 0);
+		break;
+	case 0x5: {
+			SPI_TakeDeadline(session, cmdbuf, 3);
+
+			u8 deviceid = cmdbuf[1];
+			u32 cmd = cmdbuf[2];
+			u32 cmd_length = cmdbuf[3];
+
+			cmdbuf[1] = SPIIPC_SendCmdOnly(session, deviceid, &cmd, cmd_length);
+		}
+		cmdbuf[0] = IPC_MakeHeader(0x5, 1, 0);
+		break;
+	case 0x6: {
+			u32 normal = SPI_TakeDeadline(session, cmdbuf, 4);
+
+			if (!IPC_CompareHeader(cmdbuf[0], 0x6, normal, 2) || !IPC_Is_Desc_Buffer(cmdbuf[normal + 1], IPC_BUFFER_W)) {
+				cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+				cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+			} else {
+				u8 deviceid = cmdbuf[1];
+				u32 cmd = cmdbuf[2];
+				u32 cmd_length = cmdbuf[3];
+
+				// v1025 -> v2049, start getting buffer length from desc buffer instead of length copy in cmdbuf[4]
+				// cmdbuf[4] - buffer length also
+
+				u32 data_length = IPC_Get_Desc_Buffer_Size(cmdbuf[normal + 1]);
+				void *data_out = (void*)cmdbuf[normal + 2];
+
+				cmdbuf[1] = SPIReadAhead_Read(session, deviceid, cmd, cmd_length, data_out, data_length);
+				cmdbuf[0] = IPC_MakeHeader(0x6, 1, 2);
+				cmdbuf[2] = IPC_Desc_Buffer(data_length, IPC_BUFFER_W);
+				cmdbuf[3] = (u32)data_out;
+			}
+		}
+		break;
+	case 0x7: {
+			u32 normal = SPI_TakeDeadline(session, cmdbuf, 4);
+
+			if (!IPC_CompareHeader(cmdbuf[0], 0x7, normal, 2) || !IPC_Is_Desc_Buffer(cmdbuf[normal + 1], IPC_BUFFER_R)) {
+				cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+				cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+			} else {
+				u8 deviceid = cmdbuf[1];
+				u32 cmd = cmdbuf[2];
+				u32 cmd_length = cmdbuf[3];
+
+				// v1025 -> v2049, start getting buffer length from desc buffer instead of length copy in cmdbuf[4]
+				// cmdbuf[4] - buffer length also
+
+				u32 data_length = IPC_Get_Desc_Buffer_Size(cmdbuf[normal + 1]);
+				const void *data_in = (void*)cmdbuf[normal + 2];
+
+				cmdbuf[1] = SPIIPC_SendCmdAndWrite(session, deviceid, &cmd, cmd_length, data_in, data_length);
+				cmdbuf[0] = IPC_MakeHeader(0x7, 1, 2);
+				cmdbuf[2] = IPC_Desc_Buffer(data_length, IPC_BUFFER_R);
+				cmdbuf[3] = (u32)data_in;
+			}
+		}
+		break;
+	case 0x8:
+		SPIIPC_SetDeviceNSPIModeAndRate(session, cmdbuf[1], cmdbuf[2], cmdbuf[3]);
+		cmdbuf[0] = IPC_MakeHeader(0x8, 1, 0);
+		cmdbuf[1] = 0;
+		break;
+	case 0x9: // specifically set BUS 2 nspi on/off, for some reason
+		SPIIPC_SetBUS2NSPIMode(session, cmdbuf[1]);
+		cmdbuf[0] = IPC_MakeHeader(0x9, 1, 0);
+		cmdbuf[1] = 0;
+		break;
+	case 0xA: // from here on, not part of original spi
+		if (!IPC_CompareHeader(cmdbuf[0], 0xA, 1, 4) || cmdbuf[2] != IPC_Desc_SharedHandles(3)) {
+			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		} else {
+			Result res = SPIRing_Setup(session, cmdbuf[1], cmdbuf[3], cmdbuf[4], cmdbuf[5]);
+			if (R_FAILED(res)) {
+				svcCloseHandle(cmdbuf[3]);
+				svcCloseHandle(cmdbuf[4]);
+				svcCloseHandle(cmdbuf[5]);
+			} else // anything submitted before setup is picked up right away
+				SPIRing_Drain(session);
+			cmdbuf[0] = IPC_MakeHeader(0xA, 1, 0);
+			cmdbuf[1] = res;
+		}
+		break;
+	case 0xB:
+		SPIRing_Teardown(session);
+		cmdbuf[0] = IPC_MakeHeader(0xB, 1, 0);
+		cmdbuf[1] = 0;
+		break;
+	case 0xC:
+		SPIIPC_SetDeviceFlags(cmdbuf[1], cmdbuf[2], cmdbuf[3]);
+		cmdbuf[0] = IPC_MakeHeader(0xC, 1, 0);
+		cmdbuf[1] = 0;
+		break;
+	case 0xD:
+		if (cmdbuf[1] > 2) {
+			cmdbuf[0] = IPC_MakeHeader(0xD, 1, 0);
+			cmdbuf[1] = SPI_OUT_OF_RANGE;
+		} else {
+			// counters are only ever bumped, a torn snapshot across words is fine
+			const u32* stats = (const u32*)&SPI_Bus_list[cmdbuf[1]].stats;
+			for (u32 i = 0; i < sizeof(SPI_BusStats) / 4; ++i)
+				cmdbuf[2 + i] = stats[i];
+			cmdbuf[0] = IPC_MakeHeader(0xD, 1 + sizeof(SPI_BusStats) / 4, 0);
+			cmdbuf[1] = 0;
+		}
+		break;
+	case 0xE:
+		if (cmdbuf[1] > SPI_CLASS_BULK || cmdbuf[2] > SPI_WEIGHT_MAX) {
+			cmdbuf[1] = SPI_OUT_OF_RANGE;
+		} else {
+			session->sched_class = cmdbuf[1];
+			session->weight = cmdbuf[2];
+			cmdbuf[1] = 0;
+		}
+		cmdbuf[0] = IPC_MakeHeader(0xE, 1, 0);
+		break;
+	case 0xF:
+		if (!IPC_CompareHeader(cmdbuf[0], 0xF, 1, 2) || cmdbuf[2] != IPC_Desc_SharedHandles(1)) {
+			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		} else {
+			Result res = SPICapture_Start(session, cmdbuf[1], cmdbuf[3]);
+			if (R_FAILED(res))
+				svcCloseHandle(cmdbuf[3]);
+			cmdbuf[0] = IPC_MakeHeader(0xF, 1, 0);
+			cmdbuf[1] = res;
+		}
+		break;
+	case 0x10:
+		cmdbuf[1] = SPICapture_Stop(session);
+		cmdbuf[0] = IPC_MakeHeader(0x10, 1, 0);
+		break;
+	case 0x11: {
+			SPI_NORGeometry geometry;
+			Result res = SPIIPC_NOR(session, SPI_NOR_OP_GEOMETRY, cmdbuf[1], 0, NULL, 0, 0, &geometry);
+			if (R_FAILED(res)) {
+				cmdbuf[0] = IPC_MakeHeader(0x11, 1, 0);
+			} else {
+				const u32* words = (const u32*)&geometry;
+				for (u32 i = 0; i < sizeof(geometry) / 4; ++i)
+					cmdbuf[2 + i] = words[i];
+				cmdbuf[0] = IPC_MakeHeader(0x11, 1 + sizeof(geometry) / 4, 0);
+			}
+			cmdbuf[1] = res;
+		}
+		break;
+	case 0x12:
+	case 0x13: {
+			u16 id = cmdbuf[0] >> 16;
+			u32 access = id == 0x12 ? IPC_BUFFER_W : IPC_BUFFER_R;
+			u32 normal = (cmdbuf[0] >> 6) & 0x3F; // 4 with a checksum asked for
+
+			if ((normal != 3 && normal != 4) || !IPC_CompareHeader(cmdbuf[0], id, normal, 2) || !IPC_Is_Desc_Buffer(cmdbuf[normal + 1], access)) {
+				cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+				cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+			} else {
+				// buffer size is what goes, cmdbuf[3] is the same length for the capture's sake
+				u32 length = IPC_Get_Desc_Buffer_Size(cmdbuf[normal + 1]);
+				void* data = (void*)cmdbuf[normal + 2];
+				cmdbuf[1] = SPIIPC_NOR(session, id == 0x12 ? SPI_NOR_OP_READ : SPI_NOR_OP_PROGRAM, cmdbuf[1], cmdbuf[2], data, length,
+					normal == 4 ? cmdbuf[4] : SPI_CHECK_NONE, NULL);
+				cmdbuf[0] = IPC_MakeHeader(id, normal - 2, 2);
+				cmdbuf[2] = session->sum.value; // only there when asked for, descriptor goes over it otherwise
+				cmdbuf[normal - 1] = IPC_Desc_Buffer(length, access);
+				cmdbuf[normal] = (u32)data;
+			}
+		}
+		break;
+	case 0x14:
+		if (!IPC_CompareHeader(cmdbuf[0], 0x14, 3, 0)) {
+			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		} else {
+			cmdbuf[1] = SPIIPC_NOR(session, SPI_NOR_OP_ERASE, cmdbuf[1], cmdbuf[2], NULL, cmdbuf[3], 0, NULL);
+			cmdbuf[0] = IPC_MakeHeader(0x14, 1, 0);
+		}
+		break;
+	case 0x15:
+		if (!IPC_CompareHeader(cmdbuf[0], 0x15, 1 + sizeof(SPI_RegUpdate) / 4, 0)) {
+			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		} else {
+			// copied out, the reply overwrites it
+			SPI_RegUpdate update;
+			u32* words = (u32*)&update;
+			for (u32 i = 0; i < sizeof(update) / 4; ++i)
+				words[i] = cmdbuf[2 + i];
+
+			u32 done, previous = 0; // stays 0 when a full mask skips the read
+			cmdbuf[1] = SPIIPC_RegUpdate(session, cmdbuf[1], &update, 1, &done, &previous);
+			cmdbuf[2] = previous;
+			cmdbuf[0] = IPC_MakeHeader(0x15, 2, 0);
+		}
+		break;
+	case 0x16:
+		if (!IPC_CompareHeader(cmdbuf[0], 0x16, 2, 2) || !IPC_Is_Desc_Buffer(cmdbuf[3], IPC_BUFFER_R)) {
+			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		} else {
+			u32 size = IPC_Get_Desc_Buffer_Size(cmdbuf[3]);
+			const SPI_RegUpdate* updates = (const SPI_RegUpdate*)cmdbuf[4];
+			u32 count = cmdbuf[2];
+			u32 done = 0;
+
+			if (count > SPI_REG_UPDATE_MAX || size < count * sizeof(SPI_RegUpdate) || ((u32)updates & 3))
+				cmdbuf[1] = SPI_OUT_OF_RANGE;
+			else
+				cmdbuf[1] = SPIIPC_RegUpdate(session, cmdbuf[1], updates, count, &done, NULL);
+			cmdbuf[0] = IPC_MakeHeader(0x16, 2, 2);
+			cmdbuf[2] = done;
+			cmdbuf[3] = IPC_Desc_Buffer(size, IPC_BUFFER_R);
+			cmdbuf[4] = (u32)updates;
+		}
+		break;
+	case 0x17:
+		if (!IPC_CompareHeader(cmdbuf[0], 0x17, 2 + sizeof(SPI_RegCacheConfig) / 4, 0)) {
+			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		} else {
+			SPI_RegCacheConfig config;
+			u32* words = (u32*)&config;
+			for (u32 i = 0; i < sizeof(config) / 4; ++i)
+				words[i] = cmdbuf[3 + i];
+
+			cmdbuf[1] = SPIIPC_SetRegCache(session, cmdbuf[1], cmdbuf[2] != 0, &config);
+			cmdbuf[0] = IPC_MakeHeader(0x17, 1, 0);
+		}
+		break;
+#ifdef SPI_STACK_DEBUG
+	case 0x18:
+		cmdbuf[2] = SPI_MAIN_STACK_SIZE;
+		cmdbuf[3] = SPI_THREAD_STACK_SIZE;
+		for (u32 i = 0; i < SPI_STACK_COUNT; ++i)
+			cmdbuf[4 + i] = SPIStack_Peak(i);
+		cmdbuf[0] = IPC_MakeHeader(0x18, 3 + SPI_STACK_COUNT, 0);
+		cmdbuf[1] = 0;
+		break;
+#endif
+	case 0x19:
+		for (u32 i = 0; i < SPI_BOOT_COUNT; ++i) {
+			cmdbuf[2 + i * 2] = (u32)SPI_BootTicks[i];
+			cmdbuf[3 + i * 2] = (u32)(SPI_BootTicks[i] >> 32);
+		}
+		cmdbuf[0] = IPC_MakeHeader(0x19, 1 + SPI_BOOT_COUNT * 2, 0);
+		cmdbuf[1] = 0;
+		break;
+	case 0x1A:
+		SPIIPC_VectorRequest(session, cmdbuf);
+		break;
+	case 0x1B:
+	case 0x1C:
+	case 0x1D:
+		SPIIPC_ProgRequest(session, cmdbuf);
+		break;
+	case 0x1E:
+		cmdbuf[1] = SPIIPC_SetDeviceConvert(cmdbuf[1], cmdbuf[2]);
+		cmdbuf[0] = IPC_MakeHeader(0x1E, 1, 0);
+		break;
+	case 0x1F: // the event is optional
+		if (!IPC_CompareHeader(cmdbuf[0], 0x1F, 6, 0) && (!IPC_CompareHeader(cmdbuf[0], 0x1F, 6, 2) || cmdbuf[7] != IPC_Desc_SharedHandles(1))) {
+			cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+			cmdbuf[1] = OS_INVALID_IPC_PARAMATER;
+		} else {
+			Handle event = (cmdbuf[0] & 0x3F) ? cmdbuf[8] : 0;
+			u32 ticket = 0;
+			Result res = SPIAsync_Submit(session, &cmdbuf[1], event, &ticket);
+			if (R_FAILED(res) && event)
+				svcCloseHandle(event);
+			cmdbuf[0] = IPC_MakeHeader(0x1F, 2, 0);
+			cmdbuf[1] = res;
+			cmdbuf[2] = ticket;
+		}
+		break;
+	case 0x20: {
+			Result result = 0;
+			cmdbuf[1] = SPIAsync_Collect(session, cmdbuf[1], cmdbuf[2] != 0, &result);
+			cmdbuf[2] = result;
+			cmdbuf[0] = IPC_MakeHeader(0x20, 2, 0);
+		}
+		break;
+	default:
+		cmdbuf[0] = IPC_MakeHeader(0x0, 1, 0);
+		cmdbuf[1] = OS_INVALID_HEADER;
+	}
+
+	session->deadline = 0; // only ever for the request that carried it
+}
+
+static void SPIThread_Serve(SPI_Session* session) {
+	*getThreadCommandBuffer() = 0xFFFF0000;
+	for (;;) {
+		s32 index;
+
+		Result res = svcReplyAndReceive(&index, session->handles, session->ring ? 2 : 1, session->handles[0]);
+
+		if (R_FAILED(res)) {
+			if (res != OS_REMOTE_SESSION_CLOSED)
+				Err_Throw(res);
+
+			break;
+		}
+
+		if (index == 1) { // ring doorbell, nothing to reply to afterwards
+			SPIRing_Drain(session);
+			*getThreadCommandBuffer() = 0xFFFF0000;
+			continue;
+		}
+
+		if (index != 0)
+			Err_Throw(SPI_INTERNAL_RANGE);
+
+		SPI_IPCSession(session);
+
+		if (!SPI_BootTicks[SPI_BOOT_FIRST_REQUEST]) // two services racing here are a request apart at most
+			SPIBoot_Mark(SPI_BOOT_FIRST_REQUEST);
+
+#ifdef SPI_STACK_DEBUG
+		if (*(const u32*)_ThreadStackBottom(session - SPI_Sessions) != SPI_STACK_CANARY)
+			Err_Panic(SPI_STACK_OVERFLOW);
+#endif
+
+		if (session->ra_want || session->async_run != session->async_next) {
+			// reply alone, no handles to wait on, so the client has its data while the next chunk is read,
+			// or its ticket while the transfers it submitted run
+			// if the client went away meanwhile, the next wait finds out
+			svcReplyAndReceive(&index, NULL, 0, session->handles[0]);
+			*getThreadCommandBuffer() = 0xFFFF0000;
+			if (session->ra_want)
+				SPIReadAhead_Fill(session);
+			if (session->async_run != session->async_next)
+				SPIAsync_Run(session);
+		}
+	}
+
+	SPIAsync_Release(session);
+	SPIRing_Teardown(session);
+	SPICapture_Stop(session);
+	SPIReadAhead_Stop(session);
+	SPIProg_Release(session);
+	svcCloseHandle(session->handles[0]);
+}
+
+static void SPIThread(void* _session) {
+	SPIThread_Serve((SPI_Session*)_session);
+}
+
+// saves creating a thread between CD2's session showing up and its first request
+static void SPIResidentThread(void* _session) {
+	SPI_Session* session = (SPI_Session*)_session;
+
+	for (;;) {
+		Err_FailedThrow(svcWaitSynchronization(SPI_ResidentWake, U64_MAX));
+		if (!session->handles[0])
+			break;
+
+		SPIThread_Serve(session);
+		svcSignalEvent(SPI_ResidentIdle);
+	}
+}
+
+static inline void initBSS() {
+	extern void* __bss_start__;
+	extern void* __bss_end__;
+	_memset32_aligned(__bss_start__, 0, (size_t)__bss_end__ - (size_t)__bss_start__);
+}
+
+Result __sync_init(void);
+void __sync_fini(void);
+
+static void LoadSPICFGStatus() {
+	u16 spi_cnt = MMIO_READ(CFG11_SPI_CNT);
+	SPI_CFGShadow = spi_cnt;
 	SPI_Bus_list[0].is_nspi_mode = (spi_cnt & BIT(0)) ? true : false;
 	SPI_Bus_list[1].is_nspi_mode = (spi_cnt & BIT(1)) ? true : false;
 	SPI_Bus_list[2].is_nspi_mode = (spi_cnt & BIT(2)) ? true : false;
+
+	// devices start off in whatever mode their bus was left in
+	for (u8 i = 0; i < 7; ++i)
+		SPIDevice_Config(i)->nspi = GetBusFromDeviceId(i)->is_nspi_mode;
+}
+
+static void StartServiceThread(Handle* thread, int index, ThreadFunc function) {
+	s32 priority = 20;
+	s32 processor_id = -2;
+
+	if (index == 1 && IS_SOCINFO_LGR2_SET) { // n3ds specific, for SPI::CD2 only
+		priority = 15;
+		processor_id = 3;
+	}
+
+#ifdef SPI_STACK_DEBUG
+	SPIStack_PaintThread(index);
+#endif
+
+	Err_FailedThrow(StartThread(thread, function, &SPI_Sessions[index], _thread_stack_sp_top_offset - index * SPI_THREAD_STACK_SIZE, priority, processor_id));
 }
 
 void SPIMain() {
 	initBSS();
+	SPI_BootTicks[SPI_BOOT_START] = _start_tick;
 
 	Err_Panic(__sync_init());
+	SPIBoot_Mark(SPI_BOOT_SYNC_INIT);
+
+#ifdef SPI_STACK_DEBUG
+	SPIStack_PaintMain();
+#endif
 
 	LoadSPICFGStatus();
 
@@ -594,12 +3359,31 @@ void SPIMain() {
 	_memset32_aligned(thread_handles, 0, sizeof(thread_handles));
 
 	static const char* const service_names[] = {"SPI::NOR", "SPI::CD2", "SPI::CS2", "SPI::CS3", "SPI::DEF"};
+	// CD2 is the codec, audio can't wait on a NOR dump
+	static const u8 service_classes[] = {SPI_CLASS_BULK, SPI_CLASS_REALTIME, SPI_CLASS_INTERACTIVE, SPI_CLASS_INTERACTIVE, SPI_CLASS_INTERACTIVE};
 
 	Err_FailedThrow(srvInit());
+	SPIBoot_Mark(SPI_BOOT_SRV_INIT);
+
+	// CD2 goes up first, the rest can wait a few srv calls more than audio can
+	// on n3ds its worker is already waiting by the time a session can show up
+	if (IS_SOCINFO_LGR2_SET) {
+		Err_FailedThrow(svcCreateEvent(&SPI_ResidentWake, RESET_ONESHOT));
+		Err_FailedThrow(svcCreateEvent(&SPI_ResidentIdle, RESET_ONESHOT));
+		svcSignalEvent(SPI_ResidentIdle);
+		StartServiceThread(&thread_handles[1], 1, SPIResidentThread);
+		SPI_HasResident = true;
+	}
+	Err_FailedThrow(srvRegisterService(&service_handles[2], service_names[1], 1));
+	SPIBoot_Mark(SPI_BOOT_CD2_REGISTERED);
 
-	Err_FailedThrow(srvEnableNotification(&service_handles[0]));
 	for (int i = 0; i < 5; ++i)
-		Err_FailedThrow(srvRegisterService(&service_handles[i+1], service_names[i], 1));
+		if (i != 1)
+			Err_FailedThrow(srvRegisterService(&service_handles[i+1], service_names[i], 1));
+	SPIBoot_Mark(SPI_BOOT_ALL_REGISTERED);
+
+	Err_FailedThrow(srvEnableNotification(&service_handles[0]));
+	SPIBoot_Mark(SPI_BOOT_NOTIFICATION);
 
 	while (!TerminationFlag) {
 		s32 index;
@@ -614,24 +3398,36 @@ void SPIMain() {
 
 		Handle session_handle;
 		Err_FailedThrow(svcAcceptSession(&session_handle, service_handles[index]));
+		if (!SPI_BootTicks[SPI_BOOT_FIRST_ACCEPT])
+			SPIBoot_Mark(SPI_BOOT_FIRST_ACCEPT);
 
 		--index;
 
-		if (thread_handles[index]) {
+		bool resident = index == 1 && SPI_HasResident;
+
+		if (resident) {
+			Err_NonSuccessThrow(svcWaitSynchronization(SPI_ResidentIdle, U64_MAX));
+		} else if (thread_handles[index]) {
 			Err_NonSuccessThrow(svcWaitSynchronization(thread_handles[index], U64_MAX));
 			svcCloseHandle(thread_handles[index]);
 			thread_handles[index] = 0;
 		}
 
-		s32 priority = 20;
-		s32 processor_id = -2;
+		SPI_Sessions[index].handles[0] = session_handle;
+		SPI_Sessions[index].sched_class = service_classes[index];
+		SPI_Sessions[index].weight = 0;
+		SPI_Sessions[index].vtime = 0;
 
-		if (index == 1 && IS_SOCINFO_LGR2_SET) { // n3ds specific, for SPI::CD2 only
-			priority = 15;
-			processor_id = 3;
-		}
+		if (resident)
+			svcSignalEvent(SPI_ResidentWake);
+		else
+			StartServiceThread(&thread_handles[index], index, SPIThread);
+	}
 
-		Err_FailedThrow(StartThread(&thread_handles[index], SPIThread, (void*)session_handle, _thread_stack_sp_top_offset - index * 0x280, priority, processor_id));
+	if (SPI_HasResident) {
+		Err_NonSuccessThrow(svcWaitSynchronization(SPI_ResidentIdle, U64_MAX));
+		SPI_Sessions[1].handles[0] = 0;
+		svcSignalEvent(SPI_ResidentWake);
 	}
 
 	for (int i = 0; i < 5; ++i) {
@@ -648,6 +3444,11 @@ void SPIMain() {
 
 	svcCloseHandle(service_handles[0]);
 
+	if (SPI_HasResident) {
+		svcCloseHandle(SPI_ResidentWake);
+		svcCloseHandle(SPI_ResidentIdle);
+	}
+
 	srvExit();
 	__sync_fini();
 }
@@ -6,6 +6,9 @@
 	.global _start
 	.type   _start, %function
 _start:
+	svc     0x28 @ GetSystemTick, boot timeline starts here
+	ldr     r12, .L1
+	stm     r12, {r0,r1}
 	ldr     r12, .L0
 	sub     r0, sp, 0x280 @ spi is not that stack hungry.... so...
 	str     r0, [r12]
@@ -15,6 +18,8 @@ _start:
 	svc     0x03
 .L0:
 	.word   _thread_stack_sp_top_offset
+.L1:
+	.word   _start_tick
 	.size   _start, .-_start
 
 	.section .text._thread_start, "ax", %progbits
@@ -32,3 +37,11 @@ _thread_start:
 _thread_stack_sp_top_offset:
 	.word 0
 	.size   _thread_stack_sp_top_offset, .-_thread_stack_sp_top_offset
+
+	@ .data, SPIMain clears .bss only after this got written
+	.section .data._start_tick, "aw"
+	.align  3
+	.global _start_tick
+_start_tick:
+	.word 0, 0
+	.size   _start_tick, .-_start_tick
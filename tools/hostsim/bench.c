@@ -0,0 +1,1791 @@
+// spibench, multi client load generator against the host build of the module
+// Every service gets N client threads sharing that service's session, like real clients would,
+// each replaying a weighted mix of cmds 0x3-0x7 at a fixed rate or back to back.
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <3ds/types.h>
+#include <3ds/result.h>
+#include <3ds/svc.h>
+#include <3ds/ipc.h>
+#include <spi.h>
+#include "hostsim.h"
+#include "spi_client.h"
+
+#define MAX_MIX       8
+#define MAX_CLIENTS   16
+#define MAX_BUF       0x10000
+
+typedef struct {
+	u8 cmd;
+	u32 length;
+	u32 weight;
+} MixEntry;
+
+typedef struct {
+	const char* name;
+	const char* key;
+	u8 deviceid;
+	u8 rate;
+	int clients;
+	u32 hz; // per client, 0 is back to back
+	int sched_class; // -1 keeps what the module picks for the service
+	u8 weight;
+	u32 deadline_us; // sent with every request, 0 for none
+	bool sequential; // NOR reads pick up where the client's last one ended
+	MixEntry mix[MAX_MIX];
+	int nmix;
+
+	Handle session;
+
+	pthread_mutex_t lock;
+	u64* lat;
+	size_t nlat;
+	size_t cap;
+	u64 ops;
+	u64 bytes; // data moved by successful requests
+	u64 errors;
+	u64 starved;
+} Service;
+
+static Service services[5] = {
+	{ .name = "SPI::NOR", .key = "nor", .sched_class = -1, .deviceid = 1, .clients = 1, .hz = 0,
+	  .mix = { { 0x6, 4096, 1 }, { 0x3, 64, 2 } }, .nmix = 2 },
+	{ .name = "SPI::CD2", .key = "cd2", .sched_class = -1, .deviceid = 3, .clients = 1, .hz = 1000,
+	  .mix = { { 0x3, 2, 3 }, { 0x4, 2, 1 } }, .nmix = 2 },
+	{ .name = "SPI::CS2", .key = "cs2", .sched_class = -1, .deviceid = 4, .clients = 1, .hz = 200,
+	  .mix = { { 0x3, 8, 1 } }, .nmix = 1 },
+	{ .name = "SPI::CS3", .key = "cs3", .sched_class = -1, .deviceid = 5, .clients = 1, .hz = 200,
+	  .mix = { { 0x3, 8, 1 }, { 0x5, 1, 1 } }, .nmix = 2 },
+	{ .name = "SPI::DEF", .key = "def", .sched_class = -1, .deviceid = 0, .clients = 1, .hz = 50,
+	  .mix = { { 0x3, 16, 1 }, { 0x7, 256, 1 } }, .nmix = 2 },
+};
+
+static u64 duration_ns = 2000000000ULL;
+static u64 starve_ns = 20000000ULL;
+static bool nspi_bus[3];
+static u8 coalesce_devices; // bitmask of device ids
+static u8 nspi_capable_devices; // same
+static u8 readahead_devices; // same
+static volatile bool stop;
+static const char* capture_path;
+static int wedge_bus = -1;
+static u64 wedge_ns;
+static SPI_Trace* capture;
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: spibench [options]\n"
+		"  -d MS             run time per phase (2000)\n"
+		"  -c SVC=N          clients for a service, SVC is nor, cd2, cs2, cs3 or def\n"
+		"  -r SVC=HZ         requests per second per client, 0 is back to back\n"
+		"  -x SVC=CMD:LEN:W[,CMD:LEN:W...]\n"
+		"                    traffic mix, CMD is 3 to 7, LEN the data length, W the weight\n"
+		"  -D SVC=DEV        device id a service talks to\n"
+		"  -b SVC=RATE       device rate (cmd 0x1/0x8 rate field)\n"
+		"  -n BUS            run bus 0, 1 or 2 in NSPI mode\n"
+		"  -C DEV            enable read coalescing on a device\n"
+		"  -a DEV            flag a device NSPI capable, its large transfers switch the bus to NSPI on their own\n"
+		"  -R DEV            enable read ahead on a device\n"
+		"  -S SVC            NOR reads of a service walk the flash in order instead of jumping around\n"
+		"  -p SVC=CLASS[:W]  scheduling class, rt, int or bulk, and bulk weight (cmd 0xE)\n"
+		"  -t SVC=US         deadline sent with every request\n"
+		"  -s MS             latency counted as a starvation event (20)\n"
+		"  -w FILE           capture the run's IPC traffic to FILE (cmd 0xF), for spireplay\n"
+		"  -k BUS:MS         wedge a bus controller MS into every phase, the module has to time out and reset it\n"
+		"  -N                run as an N3DS, CD2 gets its worker before its first session\n"
+		"  -M cd2tail        CD2 tail latency alone, then under back to back 4KiB NOR reads\n"
+		"  -M nor            flash commands 0x11 to 0x14 against the NOR model, checked, then read speed against raw 0x6 and with checksums\n"
+		"  -M regs           register updates, cmd 0x15 and 0x16, checked, timed and raced against cmd 0x3 then 0x4\n"
+		"  -M regcache       register cache (cmd 0x17) on the CD2 codec model, checked against the device, then timed\n"
+		"  -M client         client library, checked, then a register sequence one by one and batched\n"
+		"  -M stream         paced 4KiB NOR reads in order next to the usual mix, without read ahead, then with it\n"
+		"  -M boot           boot timeline (cmd 0x19), then a second CD2 session\n"
+		"  -M contention     every service back to back 1 byte reads with 2 clients, bus and lock traffic over transfer time\n"
+		"  -M prog           microprograms (cmds 0x1B to 0x1D) on the NOR model, checked, then against the same steps as requests\n"
+		"  -M vector         gather writes and scatter reads (cmd 0x1A) on the CS2 register file, checked, then against a joined cmd 0x7\n"
+		"  -M convert        read conversion (cmd 0x1E), every format on the CS2 register file checked, then against the client doing it\n"
+		"  -M async          asynchronous transfers (cmds 0x1F and 0x20) of NOR reads, checked, then with client work in between\n");
+	exit(1);
+}
+
+static Service* find_service(const char* arg, const char** value) {
+	const char* eq = strchr(arg, '=');
+	if (!eq)
+		usage();
+	for (int i = 0; i < 5; ++i) {
+		if (strlen(services[i].key) == (size_t)(eq - arg) && !strncmp(arg, services[i].key, eq - arg)) {
+			*value = eq + 1;
+			return &services[i];
+		}
+	}
+	usage();
+	return NULL;
+}
+
+static void parse_mix(Service* svc, const char* value) {
+	svc->nmix = 0;
+	while (*value && svc->nmix < MAX_MIX) {
+		unsigned cmd, len, weight;
+		int used;
+		if (sscanf(value, "%u:%u:%u%n", &cmd, &len, &weight, &used) != 3 || cmd < 3 || cmd > 7)
+			usage();
+		if ((cmd == 3 || cmd == 4) && len > 64)
+			usage();
+		if (len > MAX_BUF)
+			usage();
+		svc->mix[svc->nmix++] = (MixEntry){ cmd, len, weight };
+		value += used;
+		if (*value == ',')
+			++value;
+	}
+}
+
+static void parse_class(Service* svc, const char* value) {
+	static const char* const names[] = { "rt", "int", "bulk" };
+	size_t len = strcspn(value, ":");
+	svc->sched_class = -1;
+	for (int i = 0; i < 3; ++i)
+		if (strlen(names[i]) == len && !strncmp(value, names[i], len))
+			svc->sched_class = i;
+	if (svc->sched_class < 0)
+		usage();
+	svc->weight = value[len] == ':' ? strtoul(value + len + 1, NULL, 0) : 0;
+	if (svc->weight > SPI_WEIGHT_MAX)
+		usage();
+}
+
+static u32 xorshift(u32* state) {
+	u32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// opcode bytes for the device model behind a device id
+// cursor, if not NULL, is where the last read ended
+static u32 device_cmd(u8 deviceid, u8 ipc_cmd, u32 length, u32* state, u32* cursor, u32* cmd_length) {
+	if (deviceid == 1) { // NOR flash
+		u32 addr = xorshift(state) & 0x1F000;
+		if (cursor && ipc_cmd == 0x6) {
+			addr = *cursor;
+			*cursor = (addr + length) & 0x1FFFF;
+		}
+		*cmd_length = ipc_cmd == 0x5 ? 1 : 4;
+		u8 op = ipc_cmd == 0x5 ? 0x04 : (ipc_cmd == 0x4 || ipc_cmd == 0x7) ? 0x02 : 0x03;
+		return op | ((addr >> 16) & 0xFF) << 8 | ((addr >> 8) & 0xFF) << 16 | (addr & 0xFF) << 24;
+	}
+	*cmd_length = 1;
+	u8 reg = 1 + (xorshift(state) & 0x3F);
+	return (reg << 1) | ((ipc_cmd == 0x4 || ipc_cmd == 0x7) ? 0 : 1);
+}
+
+static Result issue(Service* svc, const MixEntry* op, u32* state, u32* cursor, void* buf) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	u32 cmd_length;
+	u32 cmd = device_cmd(svc->deviceid, op->cmd, op->length, state, svc->sequential ? cursor : NULL, &cmd_length);
+
+	// the deadline rides as one more normal parameter, in front of any descriptors
+	u32 normal = op->cmd == 0x4 ? 20 : op->cmd == 0x5 ? 3 : 4;
+	u32 translate = op->cmd >= 0x6 ? 2 : 0;
+	if (svc->deadline_us)
+		cmdbuf[++normal] = svc->deadline_us;
+	cmdbuf[0] = IPC_MakeHeader(op->cmd, normal, translate);
+
+	switch (op->cmd) {
+	case 0x3:
+		cmdbuf[4] = op->length;
+		break;
+	case 0x4:
+		memset(&cmdbuf[4], 0x5A, 64);
+		cmdbuf[20] = op->length;
+		break;
+	case 0x6:
+	case 0x7:
+		cmdbuf[4] = op->length;
+		cmdbuf[normal + 1] = IPC_Desc_Buffer(op->length, op->cmd == 0x6 ? IPC_BUFFER_W : IPC_BUFFER_R);
+		cmdbuf[normal + 2] = (u32)(uptr)buf;
+		break;
+	}
+	cmdbuf[1] = svc->deviceid;
+	cmdbuf[2] = cmd;
+	cmdbuf[3] = cmd_length;
+
+	Result res = svcSendSyncRequest(svc->session);
+	if (R_FAILED(res))
+		return res;
+	return cmdbuf[1];
+}
+
+static Result simple_cmd(Handle session, u16 id, u32 a, u32 b, u32 c) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(id, 3, 0);
+	cmdbuf[1] = a;
+	cmdbuf[2] = b;
+	cmdbuf[3] = c;
+	Result res = svcSendSyncRequest(session);
+	return R_FAILED(res) ? res : (Result)cmdbuf[1];
+}
+
+typedef struct {
+	Service* svc;
+	int index;
+	u64 start;
+	u64 end;
+} ClientArgs;
+
+static void record(Service* svc, u64 ns, Result res, u32 length) {
+	pthread_mutex_lock(&svc->lock);
+	++svc->ops;
+	if (R_FAILED(res))
+		++svc->errors;
+	else
+		svc->bytes += length;
+	if (ns >= starve_ns)
+		++svc->starved;
+	if (svc->nlat == svc->cap) {
+		svc->cap = svc->cap ? svc->cap * 2 : 4096;
+		svc->lat = realloc(svc->lat, svc->cap * sizeof(u64));
+		if (!svc->lat)
+			abort();
+	}
+	svc->lat[svc->nlat++] = ns;
+	pthread_mutex_unlock(&svc->lock);
+}
+
+static void* client_thread(void* _args) {
+	ClientArgs* args = _args;
+	Service* svc = args->svc;
+	void* buf = HostKernel_Alloc32(MAX_BUF);
+	u32 state = 0x9E3779B9u ^ (u32)(args->index * 7919 + svc->deviceid * 104729 + 1);
+	u32 total = 0;
+	u32 cursor = 0;
+	u64 period = svc->hz ? 1000000000ULL / svc->hz : 0;
+	u64 next = args->start + (period ? (xorshift(&state) % period) : 0); // spread clients out
+
+	for (int i = 0; i < svc->nmix; ++i)
+		total += svc->mix[i].weight;
+
+	while (!stop) {
+		u64 now = HostKernel_Now();
+		if (now >= args->end)
+			break;
+		if (period) {
+			if (now < next)
+				svcSleepThread(next - now);
+			next += period;
+		}
+
+		u32 pick = total ? xorshift(&state) % total : 0;
+		const MixEntry* op = &svc->mix[0];
+		for (int i = 0; i < svc->nmix; ++i) {
+			if (pick < svc->mix[i].weight) {
+				op = &svc->mix[i];
+				break;
+			}
+			pick -= svc->mix[i].weight;
+		}
+
+		u64 t0 = HostKernel_Now();
+		Result res = issue(svc, op, &state, &cursor, buf);
+		record(svc, HostKernel_Now() - t0, res, op->length);
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	u64 x = *(const u64*)a, y = *(const u64*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct_us(const Service* svc, double q) {
+	if (!svc->nlat)
+		return 0.0;
+	size_t i = (size_t)(q * (double)svc->nlat);
+	if (i >= svc->nlat)
+		i = svc->nlat - 1;
+	return svc->lat[i] / 1000.0;
+}
+
+static void reset_results(void) {
+	for (int i = 0; i < 5; ++i) {
+		services[i].nlat = 0;
+		services[i].ops = 0;
+		services[i].bytes = 0;
+		services[i].errors = 0;
+		services[i].starved = 0;
+	}
+}
+
+static bool module_stats(u32 bus, SPI_BusStats* out) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0xD, 1, 0);
+	cmdbuf[1] = bus;
+	if (R_FAILED(svcSendSyncRequest(services[4].session)) || R_FAILED((Result)cmdbuf[1]))
+		return false;
+	memcpy(out, &cmdbuf[2], sizeof(*out));
+	return true;
+}
+
+// mode switches the module made over the phase, every bus
+static u64 module_switches(void) {
+	u64 total = 0;
+	for (u32 b = 0; b < 3; ++b) {
+		SPI_BusStats stats;
+		if (module_stats(b, &stats))
+			total += stats.mode_switches;
+	}
+	return total;
+}
+
+// read ahead hits, misses and wasted bytes, every bus
+static void module_readahead(u64 out[3]) {
+	out[0] = out[1] = out[2] = 0;
+	for (u32 b = 0; b < 3; ++b) {
+		SPI_BusStats stats;
+		if (!module_stats(b, &stats))
+			continue;
+		out[0] += stats.readahead_hits;
+		out[1] += stats.readahead_misses;
+		out[2] += stats.readahead_wasted;
+	}
+}
+
+static void run_phase(const char* title) {
+	pthread_t threads[5][MAX_CLIENTS];
+	ClientArgs args[5][MAX_CLIENTS];
+	HostBusStats before[3], after[3];
+	u64 ra_before[3], ra_after[3];
+
+	reset_results();
+	for (int b = 0; b < 3; ++b)
+		HostHW_GetBusStats(b, &before[b]);
+	u64 slept = HostKernel_ModuleSleptNs();
+	u64 switches = module_switches();
+	module_readahead(ra_before);
+
+	stop = false;
+	u64 start = HostKernel_Now();
+	for (int i = 0; i < 5; ++i) {
+		for (int c = 0; c < services[i].clients; ++c) {
+			args[i][c] = (ClientArgs){ &services[i], c, start, start + duration_ns };
+			pthread_create(&threads[i][c], NULL, client_thread, &args[i][c]);
+		}
+	}
+	if (wedge_bus >= 0 && wedge_ns < duration_ns) {
+		svcSleepThread(wedge_ns);
+		HostHW_Wedge(wedge_bus);
+	}
+	for (int i = 0; i < 5; ++i)
+		for (int c = 0; c < services[i].clients; ++c)
+			pthread_join(threads[i][c], NULL);
+	u64 wall = HostKernel_Now() - start;
+
+	for (int b = 0; b < 3; ++b)
+		HostHW_GetBusStats(b, &after[b]);
+	slept = HostKernel_ModuleSleptNs() - slept;
+	switches = module_switches() - switches;
+	module_readahead(ra_after);
+
+	printf("== %s (%.0f ms)\n", title, wall / 1e6);
+	printf("%-9s %3s %7s %8s %9s %9s %9s %9s %9s %7s %6s\n",
+		"service", "dev", "clients", "ops", "ops/s", "p50(us)", "p99(us)", "p999(us)", "max(us)", "starved", "errors");
+	for (int i = 0; i < 5; ++i) {
+		Service* svc = &services[i];
+		if (!svc->clients)
+			continue;
+		qsort(svc->lat, svc->nlat, sizeof(u64), cmp_u64);
+		printf("%-9s %3u %7d %8llu %9.0f %9.1f %9.1f %9.1f %9.1f %7llu %6llu\n",
+			svc->name, svc->deviceid, svc->clients, (unsigned long long)svc->ops, svc->ops * 1e9 / wall,
+			pct_us(svc, 0.50), pct_us(svc, 0.99), pct_us(svc, 0.999), pct_us(svc, 1.0),
+			(unsigned long long)svc->starved, (unsigned long long)svc->errors);
+	}
+
+	u64 ops = 0, bytes = 0;
+	for (int i = 0; i < 5; ++i) {
+		ops += services[i].ops;
+		bytes += services[i].bytes;
+	}
+	printf("all: %.0f ops/s, %.1f KiB/s, %.0f bus mode switches/s\n", ops * 1e9 / wall, bytes * 1e9 / 1024 / wall,
+		switches * 1e9 / wall);
+	u64 hits = ra_after[0] - ra_before[0], misses = ra_after[1] - ra_before[1];
+	if (hits + misses)
+		printf("read ahead: %llu hits, %llu misses, %.1f%% hit rate, %.1f KiB prefetched for nothing\n",
+			(unsigned long long)hits, (unsigned long long)misses, 100.0 * hits / (hits + misses),
+			(ra_after[2] - ra_before[2]) / 1024.0);
+
+	// register accesses per chip select window, reads are mostly status polling so they go with the wire time
+	printf("%-9s %6s %12s %10s %10s %7s %7s %10s %10s %6s\n", "bus", "util%", "transactions", "mmio_r", "mmio_w", "r/txn", "w/txn",
+		"collisions", "violations", "resets");
+	for (int b = 0; b < 3; ++b) {
+		u64 txns = after[b].transactions - before[b].transactions;
+		u64 reads = after[b].mmio_reads - before[b].mmio_reads;
+		u64 writes = after[b].mmio_writes - before[b].mmio_writes;
+		printf("BUS%-6d %6.1f %12llu %10llu %10llu %7.1f %7.1f %10llu %10llu %6llu\n", b,
+			100.0 * (after[b].busy_ns - before[b].busy_ns) / wall,
+			(unsigned long long)txns, (unsigned long long)reads, (unsigned long long)writes,
+			txns ? (double)reads / txns : 0.0, txns ? (double)writes / txns : 0.0,
+			(unsigned long long)(after[b].collisions - before[b].collisions),
+			(unsigned long long)(after[b].violations - before[b].violations),
+			(unsigned long long)(after[b].resets - before[b].resets));
+	}
+	// what the module threads didn't spend spinning, the console's other threads could have had it
+	printf("module threads slept %.1f ms, %.1f%% of a core given back\n", slept / 1e6, 100.0 * slept / wall);
+	printf("\n");
+}
+
+static void print_module_stats(void) {
+	printf("%-9s %12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "bus", "transactions", "coalesced", "dl_misses", "timeouts", "switches",
+		"reordered", "ra_hits", "ra_misses", "ra_wasted");
+	for (u32 b = 0; b < 3; ++b) {
+		SPI_BusStats stats;
+		if (!module_stats(b, &stats))
+			continue;
+		printf("BUS%-6u %12lu %10lu %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n", b, (unsigned long)stats.transactions,
+			(unsigned long)stats.coalesced_reads, (unsigned long)stats.deadline_misses, (unsigned long)stats.timeouts,
+			(unsigned long)stats.mode_switches, (unsigned long)stats.reordered, (unsigned long)stats.readahead_hits,
+			(unsigned long)stats.readahead_misses, (unsigned long)stats.readahead_wasted);
+	}
+}
+
+static Result nor_cmd(u16 id, u32 addr, void* buf, u32 length) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	bool buffer = id == 0x12 || id == 0x13;
+	cmdbuf[0] = IPC_MakeHeader(id, 3, buffer ? 2 : 0);
+	cmdbuf[1] = services[0].deviceid;
+	cmdbuf[2] = addr;
+	cmdbuf[3] = length;
+	cmdbuf[4] = IPC_Desc_Buffer(length, id == 0x12 ? IPC_BUFFER_W : IPC_BUFFER_R);
+	cmdbuf[5] = (u32)(uptr)buf;
+	Result res = svcSendSyncRequest(services[0].session);
+	return R_FAILED(res) ? res : (Result)cmdbuf[1];
+}
+
+// cmd 0x12 or 0x13 with the checksum parameter
+static Result nor_checked(u16 id, u32 addr, void* buf, u32 length, u32 check, u32* checksum) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(id, 4, 2);
+	cmdbuf[1] = services[0].deviceid;
+	cmdbuf[2] = addr;
+	cmdbuf[3] = length;
+	cmdbuf[4] = check;
+	cmdbuf[5] = IPC_Desc_Buffer(length, id == 0x12 ? IPC_BUFFER_W : IPC_BUFFER_R);
+	cmdbuf[6] = (u32)(uptr)buf;
+	Result res = svcSendSyncRequest(services[0].session);
+	if (R_FAILED(res))
+		return res;
+	*checksum = cmdbuf[2];
+	return cmdbuf[1];
+}
+
+// what a client does after reading, a bit at a time like most small firmware does it
+static u32 ref_crc32(const u8* data, u32 length) {
+	u32 crc = ~0u;
+	for (u32 i = 0; i < length; ++i) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; ++b)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+	}
+	return ~crc;
+}
+
+static u32 ref_sum32(const u8* data, u32 length) {
+	u32 sum = 0;
+	for (u32 i = 0; i < length; ++i)
+		sum += (u32)data[i] << ((i & 3) * 8);
+	return sum;
+}
+
+static bool nor_expect(const char* what, Result res) {
+	if (R_FAILED(res))
+		printf("%s failed, 0x%08lX\n", what, (unsigned long)(u32)res);
+	return R_SUCCEEDED(res);
+}
+
+#define NOR_VERIFY_LEN 300 // over a page boundary
+
+// every flash command against the model, with the content checked, then the same reads both ways
+// another session sending write disable to the NOR the whole time, as raw cmd 0x5
+typedef struct {
+	volatile bool stop;
+	u32 sent;
+} NorWrdiArgs;
+
+static void* nor_wrdi_thread(void* _args) {
+	NorWrdiArgs* args = _args;
+	while (!args->stop) {
+		simple_cmd(services[3].session, 0x5, services[0].deviceid, 0x04, 1);
+		++args->sent;
+	}
+	return NULL;
+}
+
+static bool nor_check(void) {
+	u8* buf = HostKernel_Alloc32(MAX_BUF);
+	u8* pattern = HostKernel_Alloc32(MAX_BUF);
+	bool ok = true;
+
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x11, 1, 0);
+	cmdbuf[1] = services[0].deviceid;
+	if (R_FAILED(svcSendSyncRequest(services[0].session)) || !nor_expect("geometry", cmdbuf[1]))
+		return false;
+	SPI_NORGeometry geo;
+	memcpy(&geo, &cmdbuf[2], sizeof(geo));
+	printf("== NOR flash, JEDEC %06lX, %lu KiB, %lu byte pages, %lu byte erase, read opcode %02X with %u dummy\n",
+		(unsigned long)geo.jedec_id, (unsigned long)geo.size / 1024, (unsigned long)geo.page_size,
+		(unsigned long)geo.erase_size, geo.read_opcode, geo.read_dummy);
+
+	// a whole sector and a few small erase units somewhere else, then program across page boundaries
+	u32 small = geo.erase_size * 4;
+	ok &= nor_expect("sector erase", nor_cmd(0x14, geo.size - 0x10000, NULL, 0x10000));
+	ok &= nor_expect("small erase", nor_cmd(0x14, geo.erase_size, NULL, small));
+	ok &= nor_cmd(0x14, geo.erase_size + 1, NULL, geo.erase_size) == SPI_NOR_MISALIGNED;
+	ok &= nor_cmd(0x12, geo.size - 16, buf, 32) == SPI_OUT_OF_RANGE;
+
+	for (u32 i = 0; i < MAX_BUF; ++i)
+		pattern[i] = (u8)(i * 7 + 3);
+	u32 prog_addr = geo.size - 0x10000 + 0x10, prog_len = 0x1000 + 100;
+	u64 t0 = HostKernel_Now();
+	ok &= nor_expect("program", nor_cmd(0x13, prog_addr, pattern, prog_len));
+	u64 prog_ns = HostKernel_Now() - t0;
+
+	ok &= nor_expect("read", nor_cmd(0x12, geo.size - 0x10000, buf, 0x2000));
+	for (u32 i = 0; i < 0x2000; ++i) {
+		u32 addr = geo.size - 0x10000 + i;
+		u8 want = addr >= prog_addr && addr < prog_addr + prog_len ? pattern[addr - prog_addr] : 0xFF;
+		if (buf[i] != want) {
+			printf("flash at %05lX reads %02X, should be %02X\n", (unsigned long)addr, buf[i], want);
+			ok = false;
+			break;
+		}
+	}
+	ok &= nor_expect("read", nor_cmd(0x12, geo.erase_size, buf, small));
+	for (u32 i = 0; i < small; ++i) {
+		if (buf[i] != 0xFF) {
+			printf("flash at %05lX reads %02X after erase\n", (unsigned long)(geo.erase_size + i), buf[i]);
+			ok = false;
+			break;
+		}
+	}
+	printf("erase, program %lu bytes (%.1f ms) and read back: %s\n", (unsigned long)prog_len, prog_ns / 1e6, ok ? "ok" : "FAILED");
+
+	// 64KiB through cmd 0x12, against a client doing 4KiB cmd 0x6 reads with its own opcodes
+	t0 = HostKernel_Now();
+	ok &= nor_expect("read", nor_cmd(0x12, 0, buf, MAX_BUF));
+	u64 nor_ns = HostKernel_Now() - t0;
+
+	t0 = HostKernel_Now();
+	for (u32 addr = 0; addr < MAX_BUF; addr += 0x1000) {
+		cmdbuf[0] = IPC_MakeHeader(0x6, 4, 2);
+		cmdbuf[1] = services[0].deviceid;
+		cmdbuf[2] = 0x03 | ((addr >> 16) & 0xFF) << 8 | ((addr >> 8) & 0xFF) << 16 | (addr & 0xFF) << 24;
+		cmdbuf[3] = 4;
+		cmdbuf[4] = 0x1000;
+		cmdbuf[5] = IPC_Desc_Buffer(0x1000, IPC_BUFFER_W);
+		cmdbuf[6] = (u32)(uptr)(pattern + addr);
+		if (R_FAILED(svcSendSyncRequest(services[0].session)) || !nor_expect("raw read", cmdbuf[1]))
+			return false;
+	}
+	u64 raw_ns = HostKernel_Now() - t0;
+	bool same = !memcmp(buf, pattern, MAX_BUF);
+	ok &= same;
+	printf("64KiB read: cmd 0x12 %.1f ms, 16 cmd 0x6 %.1f ms, same data: %s\n", nor_ns / 1e6, raw_ns / 1e6, same ? "yes" : "NO");
+
+	// checked reads, a whole one and one that starts and ends mid word, against the data read plain
+	bool checked = true;
+	u32 sum = 0;
+	t0 = HostKernel_Now();
+	checked &= nor_expect("crc read", nor_checked(0x12, 0, pattern, MAX_BUF, SPI_CHECK_CRC32, &sum));
+	u64 crc_ns = HostKernel_Now() - t0;
+	checked &= sum == ref_crc32(buf, MAX_BUF) && !memcmp(buf, pattern, MAX_BUF);
+	t0 = HostKernel_Now();
+	checked &= nor_expect("sum read", nor_checked(0x12, 0, pattern, MAX_BUF, SPI_CHECK_SUM32, &sum));
+	u64 sum_ns = HostKernel_Now() - t0;
+	checked &= sum == ref_sum32(buf, MAX_BUF);
+	checked &= nor_expect("sum read", nor_checked(0x12, 3, pattern, 1001, SPI_CHECK_SUM32, &sum));
+	checked &= sum == ref_sum32(buf + 3, 1001);
+	checked &= nor_expect("crc read", nor_checked(0x12, 3, pattern, 1001, SPI_CHECK_CRC32, &sum));
+	checked &= sum == ref_crc32(buf + 3, 1001);
+
+	// checked program on erased flash, then over it with bits program can't set
+	u32 verify_addr = geo.erase_size + 5, verify_len = NOR_VERIFY_LEN;
+	checked &= nor_expect("verified program", nor_checked(0x13, verify_addr, pattern + 7, verify_len, SPI_CHECK_CRC32 | SPI_CHECK_VERIFY, &sum));
+	checked &= sum == ref_crc32(pattern + 7, verify_len);
+	checked &= nor_checked(0x13, verify_addr, pattern + 8, verify_len, SPI_CHECK_VERIFY, &sum) == SPI_NOR_VERIFY_FAILED;
+	checked &= nor_checked(0x12, 0, buf, 16, 3, &sum) == SPI_OUT_OF_RANGE;
+	checked &= nor_checked(0x12, 0, buf, 16, SPI_CHECK_CRC32 | SPI_CHECK_VERIFY, &sum) == SPI_OUT_OF_RANGE;
+	ok &= checked;
+	printf("checksums and verified program: %s\n", checked ? "ok" : "FAILED");
+
+	// write enable and what it enables can't be split by someone else's write disable, nor a short erase header taken
+	bool held = true;
+	NorWrdiArgs wrdi = { false, 0 };
+	pthread_t wrdi_thread;
+	u32 race_addr = geo.size - 0x20000;
+	pthread_create(&wrdi_thread, NULL, nor_wrdi_thread, &wrdi);
+	held &= nor_expect("erase against write disable", nor_cmd(0x14, race_addr, NULL, 0x10000));
+	for (u32 i = 0; i < 8; ++i)
+		held &= nor_expect("program against write disable", nor_checked(0x13, race_addr + i * 0x100, pattern + i, 0x100, SPI_CHECK_VERIFY, &sum));
+	wrdi.stop = true;
+	pthread_join(wrdi_thread, NULL);
+	held &= wrdi.sent > 0;
+	cmdbuf[0] = IPC_MakeHeader(0x14, 2, 0);
+	cmdbuf[1] = services[0].deviceid;
+	cmdbuf[2] = race_addr;
+	held &= R_SUCCEEDED(svcSendSyncRequest(services[0].session)) && cmdbuf[0] == IPC_MakeHeader(0x0, 1, 0) && R_FAILED((Result)cmdbuf[1]);
+	ok &= held;
+	printf("program and erase with write disables from another session: %s, %lu sent meanwhile\n", held ? "ok" : "FAILED",
+		(unsigned long)wrdi.sent);
+	printf("64KiB cmd 0x12 read: plain %.1f ms, CRC32 %.1f ms, SUM32 %.1f ms\n", nor_ns / 1e6, crc_ns / 1e6, sum_ns / 1e6);
+	printf("\n");
+
+	return ok;
+}
+
+// register updates against the CS2 register file, (reg << 1) | 1 reads and reg << 1 writes
+#define REG_RACE_ROUNDS 300
+
+static Result reg_read(Handle session, u8 deviceid, u8 reg, u8* out) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x3, 4, 0);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = (reg << 1) | 1;
+	cmdbuf[3] = 1;
+	cmdbuf[4] = 1;
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	*out = cmdbuf[2];
+	return cmdbuf[1];
+}
+
+static Result reg_read_n(Handle session, u8 deviceid, u8 reg, u8* out, u32 length) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x3, 4, 0);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = (reg << 1) | 1;
+	cmdbuf[3] = 1;
+	cmdbuf[4] = length;
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	memcpy(out, &cmdbuf[2], length);
+	return cmdbuf[1];
+}
+
+static Result reg_write(Handle session, u8 deviceid, u8 reg, u8 value) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x4, 20, 0);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = reg << 1;
+	cmdbuf[3] = 1;
+	cmdbuf[4] = value;
+	cmdbuf[20] = 1;
+	Result res = svcSendSyncRequest(session);
+	return R_FAILED(res) ? res : (Result)cmdbuf[1];
+}
+
+static SPI_RegUpdate reg_update(u8 reg, u8 mask, u8 value) {
+	return (SPI_RegUpdate){ .read_cmd = (reg << 1) | 1, .write_cmd = reg << 1, .read_cmd_length = 1,
+		.write_cmd_length = 1, .width = 1, .mask = mask, .value = value };
+}
+
+static Result reg_update_one(Handle session, u8 deviceid, const SPI_RegUpdate* update, u8* previous) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x15, 1 + sizeof(*update) / 4, 0);
+	cmdbuf[1] = deviceid;
+	memcpy(&cmdbuf[2], update, sizeof(*update));
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	if (previous)
+		*previous = cmdbuf[2];
+	return cmdbuf[1];
+}
+
+static Result reg_update_list(Handle session, u8 deviceid, const SPI_RegUpdate* updates, u32 count, u32* done) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x16, 2, 2);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = count;
+	cmdbuf[3] = IPC_Desc_Buffer(count * sizeof(*updates), IPC_BUFFER_R);
+	cmdbuf[4] = (u32)(uptr)updates;
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	*done = cmdbuf[2];
+	return cmdbuf[1];
+}
+
+typedef struct {
+	Service* svc;
+	u8 bit;
+	bool atomic;
+	u32 lost;
+} RegRaceArgs;
+
+// both threads flip their own bit of the same register, any time a thread doesn't read back its own bit,
+// the other one wrote over it with a stale read
+static void* reg_race_thread(void* _args) {
+	RegRaceArgs* args = _args;
+	Service* svc = args->svc;
+	u8 mask = 1 << args->bit;
+
+	for (u32 i = 0; i < REG_RACE_ROUNDS; ++i) {
+		u8 want = i & 1 ? 0 : mask, reg = 0;
+		if (args->atomic) {
+			SPI_RegUpdate update = reg_update(0x20, mask, want);
+			reg_update_one(svc->session, svc->deviceid, &update, NULL);
+		} else {
+			reg_read(svc->session, svc->deviceid, 0x20, &reg);
+			reg_write(svc->session, svc->deviceid, 0x20, (reg & ~mask) | want);
+		}
+		reg_read(svc->session, svc->deviceid, 0x20, &reg);
+		if ((reg & mask) != want)
+			++args->lost;
+	}
+	return NULL;
+}
+
+static u32 reg_race(bool atomic) {
+	pthread_t threads[2];
+	RegRaceArgs args[2];
+
+	reg_write(services[2].session, services[2].deviceid, 0x20, 0);
+	for (int i = 0; i < 2; ++i) {
+		// CS2 and CS3 sessions on the same device, so they really are different clients
+		Service* svc = &services[2 + i];
+		svc->deviceid = services[2].deviceid;
+		args[i] = (RegRaceArgs){ svc, i, atomic, 0 };
+		pthread_create(&threads[i], NULL, reg_race_thread, &args[i]);
+	}
+	for (int i = 0; i < 2; ++i)
+		pthread_join(threads[i], NULL);
+	return args[0].lost + args[1].lost;
+}
+
+static bool reg_check(void) {
+	Service* svc = &services[2];
+	SPI_RegUpdate* list = HostKernel_Alloc32(SPI_REG_UPDATE_MAX * sizeof(SPI_RegUpdate));
+	bool ok = true;
+	u8 reg = 0, previous = 0;
+	u32 done = 0;
+
+	ok &= R_SUCCEEDED(reg_write(svc->session, svc->deviceid, 0x05, 0xA5));
+	SPI_RegUpdate update = reg_update(0x05, 0x0F, 0x03);
+	ok &= R_SUCCEEDED(reg_update_one(svc->session, svc->deviceid, &update, &previous)) && previous == 0xA5;
+	ok &= R_SUCCEEDED(reg_read(svc->session, svc->deviceid, 0x05, &reg)) && reg == 0xA3;
+
+	// whole register, no read needed, so nothing to give back as the previous value
+	update = reg_update(0x05, 0xFF, 0x3C);
+	update.read_cmd_length = 0;
+	previous = 0xEE;
+	ok &= R_SUCCEEDED(reg_update_one(svc->session, svc->deviceid, &update, &previous)) && previous == 0;
+	ok &= R_SUCCEEDED(reg_read(svc->session, svc->deviceid, 0x05, &reg)) && reg == 0x3C;
+	update.mask = 0x0F;
+	ok &= reg_update_one(svc->session, svc->deviceid, &update, NULL) == SPI_OUT_OF_RANGE;
+
+	for (u32 i = 0; i < 8; ++i) {
+		ok &= R_SUCCEEDED(reg_write(svc->session, svc->deviceid, 0x10 + i, 0xF0));
+		list[i] = reg_update(0x10 + i, 0x0F, i);
+	}
+	ok &= R_SUCCEEDED(reg_update_list(svc->session, svc->deviceid, list, 8, &done)) && done == 8;
+	for (u32 i = 0; i < 8; ++i)
+		ok &= R_SUCCEEDED(reg_read(svc->session, svc->deviceid, 0x10 + i, &reg)) && reg == (0xF0 | i);
+	list[3].width = 0;
+	ok &= reg_update_list(svc->session, svc->deviceid, list, 8, &done) == SPI_OUT_OF_RANGE && done == 0;
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x15, 1, 0); // update left out
+	cmdbuf[1] = svc->deviceid;
+	ok &= R_SUCCEEDED(svcSendSyncRequest(svc->session)) && cmdbuf[0] == IPC_MakeHeader(0x0, 1, 0) && R_FAILED((Result)cmdbuf[1]);
+	printf("== register updates, %s\n", ok ? "ok" : "FAILED");
+
+	// the same 8 register sequence, as 0x3 then 0x4 pairs, as 0x15 each and as one 0x16
+	u64 t0 = HostKernel_Now();
+	for (u32 i = 0; i < 8; ++i) {
+		reg_read(svc->session, svc->deviceid, 0x10 + i, &reg);
+		reg_write(svc->session, svc->deviceid, 0x10 + i, (reg & 0xF0) | i);
+	}
+	u64 pair_ns = HostKernel_Now() - t0;
+	list[3].width = 1;
+	t0 = HostKernel_Now();
+	for (u32 i = 0; i < 8; ++i)
+		reg_update_one(svc->session, svc->deviceid, &list[i], NULL);
+	u64 one_ns = HostKernel_Now() - t0;
+	t0 = HostKernel_Now();
+	reg_update_list(svc->session, svc->deviceid, list, 8, &done);
+	u64 list_ns = HostKernel_Now() - t0;
+	printf("8 register sequence: 16 round trips %.1f us, 8 cmd 0x15 %.1f us, 1 cmd 0x16 %.1f us\n",
+		pair_ns / 1e3, one_ns / 1e3, list_ns / 1e3);
+
+	u32 lost_pairs = reg_race(false);
+	u32 lost_atomic = reg_race(true);
+	printf("2 clients flipping their own bit of one register %u times each, updates lost: cmd 0x3 then 0x4 %lu, cmd 0x15 %lu\n",
+		REG_RACE_ROUNDS, (unsigned long)lost_pairs, (unsigned long)lost_atomic);
+	ok &= lost_atomic == 0;
+	printf("\n");
+
+	return ok;
+}
+
+static Result regcache_set(Handle session, u8 deviceid, bool enable, const SPI_RegCacheConfig* config) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x17, 2 + sizeof(*config) / 4, 0);
+	cmdbuf[1] = deviceid;
+	cmdbuf[2] = enable;
+	memcpy(&cmdbuf[3], config, sizeof(*config));
+	Result res = svcSendSyncRequest(session);
+	return R_FAILED(res) ? res : (Result)cmdbuf[1];
+}
+
+static u64 bus_transactions(u32 bus) {
+	HostBusStats stats;
+	HostHW_GetBusStats(bus, &stats);
+	return stats.transactions;
+}
+
+// the CDC model on CD2: page select in register 0, page 0 register 0x7F volatile
+static bool regcache_check(void) {
+	Service* svc = &services[1];
+	Handle s = svc->session;
+	u8 dev = svc->deviceid;
+	u32 bus = dev <= 2 ? 0 : dev <= 5 ? 1 : 2;
+	SPI_RegCacheConfig config = { .addr_shift = 1, .read_flag = 1, .write_flag = 0, .page_reg = 0, .nvolatile = 1,
+		.volatile_regs = { { 0, 0x7F, 0x7F, 0 } } };
+	u8 cached[8], direct[8], a = 0, b = 0;
+	bool ok = true;
+
+	ok &= R_SUCCEEDED(regcache_set(s, dev, true, &config));
+
+	// the page write teaches it the page, then the same register on two pages
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x00, 1));
+	for (u32 i = 0; i < 8; ++i)
+		ok &= R_SUCCEEDED(reg_write(s, dev, 0x10 + i, 0x40 + i));
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x00, 0));
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x10, 0x99));
+
+	u64 before = bus_transactions(bus);
+	ok &= R_SUCCEEDED(reg_read(s, dev, 0x10, &a)) && a == 0x99;
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x00, 1));
+	ok &= R_SUCCEEDED(reg_read_n(s, dev, 0x10, cached, 8));
+	u64 bus_for_hits = bus_transactions(bus) - before - 1; // the page write
+
+	// volatile reads have to see the device every time
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x00, 0));
+	ok &= R_SUCCEEDED(reg_read(s, dev, 0x7F, &a)) && R_SUCCEEDED(reg_read(s, dev, 0x7F, &b)) && a != b;
+
+	// read modify write goes through the cache both ways
+	SPI_RegUpdate update = reg_update(0x10, 0x0F, 0x05);
+	ok &= R_SUCCEEDED(reg_update_one(s, dev, &update, &a)) && a == 0x99;
+	ok &= R_SUCCEEDED(reg_read(s, dev, 0x10, &a)) && a == 0x95;
+
+	// commands sent the other way than their flag says, what went over the wire isn't what the device holds
+	u32* cmdbuf = getThreadCommandBuffer();
+	u8 wrong[2];
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x30, 0x11)) && R_SUCCEEDED(reg_write(s, dev, 0x31, 0x22));
+	cmdbuf[0] = IPC_MakeHeader(0x4, 20, 0);
+	cmdbuf[1] = dev;
+	cmdbuf[2] = (0x30 << 1) | 1;
+	cmdbuf[3] = 1;
+	cmdbuf[4] = 0xAB;
+	cmdbuf[20] = 1;
+	ok &= R_SUCCEEDED(svcSendSyncRequest(s)) && R_SUCCEEDED((Result)cmdbuf[1]);
+	cmdbuf[0] = IPC_MakeHeader(0x3, 4, 0);
+	cmdbuf[1] = dev;
+	cmdbuf[2] = 0x31 << 1;
+	cmdbuf[3] = 1;
+	cmdbuf[4] = 1;
+	ok &= R_SUCCEEDED(svcSendSyncRequest(s)) && R_SUCCEEDED((Result)cmdbuf[1]);
+	ok &= R_SUCCEEDED(reg_read_n(s, dev, 0x30, wrong, 2)) && wrong[0] == 0x11;
+
+	// what the cache answered against the device itself
+	ok &= R_SUCCEEDED(regcache_set(s, dev, false, &config));
+	ok &= R_SUCCEEDED(reg_read_n(s, dev, 0x30, direct, 2)) && !memcmp(wrong, direct, 2);
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x00, 1));
+	ok &= R_SUCCEEDED(reg_read_n(s, dev, 0x10, direct, 8));
+	ok &= !memcmp(cached, direct, 8) && direct[0] == 0x40 && direct[7] == 0x47;
+	ok &= R_SUCCEEDED(reg_write(s, dev, 0x00, 0));
+	ok &= R_SUCCEEDED(reg_read(s, dev, 0x10, &a)) && a == 0x95;
+	ok &= bus_for_hits == 0;
+	ok &= regcache_set(s, dev, true, &(SPI_RegCacheConfig){ .addr_shift = 1, .read_flag = 1, .write_flag = 1 }) == SPI_OUT_OF_RANGE;
+	ok &= regcache_set(s, dev, true, &(SPI_RegCacheConfig){ .addr_shift = 0, .read_flag = 1, .write_flag = 0 }) == SPI_OUT_OF_RANGE;
+	ok &= regcache_set(s, dev, true, &(SPI_RegCacheConfig){ .addr_shift = 1, .read_flag = 2, .write_flag = 0 }) == SPI_OUT_OF_RANGE;
+	ok &= regcache_set(s, dev, true, &(SPI_RegCacheConfig){ .addr_shift = 2, .read_flag = 1, .write_flag = 4 }) == SPI_OUT_OF_RANGE;
+	cmdbuf[0] = IPC_MakeHeader(0x17, 2, 0); // config left out
+	cmdbuf[1] = dev;
+	cmdbuf[2] = 1;
+	ok &= R_SUCCEEDED(svcSendSyncRequest(s)) && cmdbuf[0] == IPC_MakeHeader(0x0, 1, 0) && R_FAILED((Result)cmdbuf[1]);
+	printf("== register cache, %s\n", ok ? "ok" : "FAILED");
+
+	// polling a control register, as a driver rereading its own settings would
+	for (int pass = 0; pass < 2; ++pass) {
+		ok &= R_SUCCEEDED(regcache_set(s, dev, pass, &config));
+		ok &= R_SUCCEEDED(reg_write(s, dev, 0x00, 0));
+		before = bus_transactions(bus);
+		u64 t0 = HostKernel_Now();
+		for (u32 i = 0; i < 1000; ++i)
+			reg_read_n(s, dev, 0x20, cached, 4);
+		u64 ns = HostKernel_Now() - t0;
+		printf("1000 4 byte register reads %s: %.1f us each, %llu bus transactions\n", pass ? "cached" : "uncached",
+			ns / 1e3 / 1000, (unsigned long long)(bus_transactions(bus) - before));
+	}
+
+	SPI_BusStats stats;
+	if (module_stats(bus, &stats) && stats.regcache_hits + stats.regcache_misses)
+		printf("cache: %lu hits, %lu misses, %.1f%% hit rate, %lu us of bus time saved\n", (unsigned long)stats.regcache_hits,
+			(unsigned long)stats.regcache_misses, 100.0 * stats.regcache_hits / (stats.regcache_hits + stats.regcache_misses),
+			(unsigned long)stats.regcache_saved_us);
+	printf("\n");
+
+	return ok;
+}
+
+// asynchronous transfers, cmds 0x1F and 0x20, the data in the session's ring data area
+static Result async_submit(Handle session, u32 deviceid, u8 op, u32 cmd, u32 cmd_length, u32 offset, u32 length, Handle event, u32* ticket) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x1F, 6, event ? 2 : 0);
+	cmdbuf[1] = op;
+	cmdbuf[2] = deviceid;
+	cmdbuf[3] = cmd;
+	cmdbuf[4] = cmd_length;
+	cmdbuf[5] = offset;
+	cmdbuf[6] = length;
+	cmdbuf[7] = IPC_Desc_SharedHandles(1);
+	cmdbuf[8] = event;
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	*ticket = cmdbuf[2];
+	return cmdbuf[1];
+}
+
+static Result async_collect(Handle session, u32 ticket, bool wait, Result* result) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x20, 2, 0);
+	cmdbuf[1] = ticket;
+	cmdbuf[2] = wait;
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	*result = cmdbuf[2];
+	return cmdbuf[1];
+}
+
+// client/spi_client.c against the CS2 register file
+static bool client_check(void) {
+	Service* svc = &services[2];
+	u8 dev = svc->deviceid;
+	u8* big = HostKernel_Alloc32(0x100);
+	u8* back = HostKernel_Alloc32(0x100);
+	u8 regs[16], batched[16];
+	SPIClient client;
+	bool ok = true;
+
+	SPIClient_Attach(&client, svc->session);
+
+	ok &= R_SUCCEEDED(SPIClient_InitDevice(&client, dev, 0)) && R_SUCCEEDED(SPIClient_InitDevice(&client, dev, 0));
+	ok &= client.requests == 1;
+
+	// past the inline limit, so cmds 0x7 and 0x6, wrapping around the register file
+	for (u32 i = 0; i < 100; ++i)
+		big[i] = (u8)(i * 13 + 1);
+	ok &= R_SUCCEEDED(SPIClient_Write(&client, dev, 0x10 << 1, 1, big, 100));
+	ok &= R_SUCCEEDED(SPIClient_Read(&client, dev, (0x10 << 1) | 1, 1, back, 100));
+	ok &= !memcmp(big, back, 100);
+
+	// 16 register writes and reads back, one by one
+	u32 requests = client.requests;
+	u64 t0 = HostKernel_Now();
+	for (u32 i = 0; i < 16; ++i) {
+		u8 value = 0x30 + i;
+		ok &= R_SUCCEEDED(SPIClient_Write(&client, dev, (0x20 + i) << 1, 1, &value, 1));
+	}
+	for (u32 i = 0; i < 16; ++i)
+		ok &= R_SUCCEEDED(SPIClient_Read(&client, dev, ((0x20 + i) << 1) | 1, 1, &regs[i], 1));
+	u64 one_ns = HostKernel_Now() - t0;
+	u32 one_requests = client.requests - requests;
+
+	// the same, batched, over a ring if the module takes one
+	void* block = HostKernel_AllocShared(0x2000);
+	Result ring = SPIClient_EnableBatching(&client, block, 0x2000);
+	requests = client.requests;
+	t0 = HostKernel_Now();
+	SPIClient_BatchBegin(&client);
+	for (u32 i = 0; i < 16; ++i) {
+		u8 value = 0x50 + i;
+		SPIClient_Write(&client, dev, (0x20 + i) << 1, 1, &value, 1);
+	}
+	for (u32 i = 0; i < 16; ++i)
+		SPIClient_Read(&client, dev, ((0x20 + i) << 1) | 1, 1, &batched[i], 1);
+	ok &= R_SUCCEEDED(SPIClient_BatchEnd(&client));
+	u64 batch_ns = HostKernel_Now() - t0;
+	u32 batch_requests = client.requests - requests;
+
+	for (u32 i = 0; i < 16; ++i)
+		ok &= regs[i] == 0x30 + i && batched[i] == 0x50 + i;
+
+	// failures in a batch come back at the end
+	SPIClient_BatchBegin(&client);
+	SPIClient_Read(&client, dev, 0x01, 1, regs, 1);
+	SPIClient_Cmd(&client, dev, 0x01, 5);
+	ok &= SPIClient_BatchEnd(&client) == SPI_OUT_OF_RANGE;
+
+	// a device that doesn't exist fails just that entry when it went over the ring, the module stays up
+	if (R_SUCCEEDED(ring)) {
+		SPIClient_BatchBegin(&client);
+		SPIClient_Read(&client, 9, 0x01, 1, regs, 1);
+		ok &= SPIClient_BatchEnd(&client) == SPI_INVALID_SELECTION;
+		ok &= R_SUCCEEDED(SPIClient_Read(&client, dev, (0x20 << 1) | 1, 1, regs, 1)) && regs[0] == 0x50;
+	}
+
+	// reads that end right at the end of the data area, an NSPI word at a time would land past the block
+	if (R_SUCCEEDED(ring)) {
+		u32 end = client.ring_data_size, ticket;
+		Result result;
+		ok &= R_SUCCEEDED(async_submit(svc->session, dev, SPI_RING_OP_READ, (0x20 << 1) | 1, 1, end - 1, 1, 0, &ticket));
+		ok &= R_SUCCEEDED(async_collect(svc->session, ticket, true, &result)) && result == 0 && client.ring->data[end - 1] == 0x50;
+		ok &= R_SUCCEEDED(async_submit(svc->session, dev, SPI_RING_OP_READ, (0x21 << 1) | 1, 1, end - 3, 3, 0, &ticket));
+		ok &= R_SUCCEEDED(async_collect(svc->session, ticket, true, &result)) && result == 0
+			&& client.ring->data[end - 3] == 0x51 && client.ring->data[end - 1] == 0x53;
+	}
+
+	// a ring block smaller than the size it's set up with
+	Handle handles[3];
+	void* small = HostKernel_AllocShared(0x1000);
+	ok &= R_SUCCEEDED(svcCreateMemoryBlock(&handles[0], (u32)(uptr)small, 0x1000, MEMPERM_READWRITE, MEMPERM_READWRITE));
+	ok &= R_SUCCEEDED(svcCreateEvent(&handles[1], RESET_ONESHOT)) && R_SUCCEEDED(svcCreateEvent(&handles[2], RESET_ONESHOT));
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0xA, 1, 4);
+	cmdbuf[1] = 0x2000;
+	cmdbuf[2] = IPC_Desc_SharedHandles(3);
+	memcpy(&cmdbuf[3], handles, sizeof(handles));
+	ok &= R_SUCCEEDED(svcSendSyncRequest(services[3].session)) && (Result)cmdbuf[1] == SPI_RING_INVALID_SIZE;
+	for (u32 i = 0; i < 3; ++i)
+		svcCloseHandle(handles[i]);
+
+	SPIClient_Close(&client);
+
+	printf("== client library, %s\n", ok ? "ok" : "FAILED");
+	printf("16 register writes and 16 reads: one by one %.1f us in %lu requests, batched %.1f us in %lu requests%s\n",
+		one_ns / 1e3, (unsigned long)one_requests, batch_ns / 1e3, (unsigned long)batch_requests,
+		R_FAILED(ring) ? " (no ring)" : "");
+	printf("\n");
+
+	return ok;
+}
+
+// cmd 0x1A against the CS2 register file, a header and a payload in pieces, written and read back in one transaction each
+static Result vector_raw(Handle session, u8 deviceid, const u32* descs, u32 count) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x1A, 1, count * 2);
+	cmdbuf[1] = deviceid;
+	memcpy(&cmdbuf[2], descs, count * 8);
+	Result res = svcSendSyncRequest(session);
+	return R_FAILED(res) ? res : (Result)cmdbuf[1];
+}
+
+// turned away as a malformed request, reply header 0
+static bool vector_rejected(Handle session, u8 deviceid, const u32* descs, u32 count) {
+	return R_FAILED(vector_raw(session, deviceid, descs, count)) && (getThreadCommandBuffer()[0] >> 16) == 0;
+}
+
+static bool vector_check(void) {
+	Service* svc = &services[2];
+	u8 dev = svc->deviceid;
+	u8* header = HostKernel_Alloc32(4);
+	u8* piece_a = HostKernel_Alloc32(32);
+	u8* piece_b = HostKernel_Alloc32(32);
+	u8* joined = HostKernel_Alloc32(68);
+	u8* back = HostKernel_Alloc32(68);
+	SPIClient client;
+	bool ok = true;
+
+	SPIClient_Attach(&client, svc->session);
+
+	// register 0x40 on, the header's last 3 bytes land in 0x40 to 0x42 already
+	header[0] = 0x40 << 1;
+	header[1] = 0xA0;
+	header[2] = 0xA1;
+	header[3] = 0xA2;
+	for (u32 i = 0; i < 32; ++i) {
+		piece_a[i] = (u8)(i * 7 + 3);
+		piece_b[i] = (u8)(i * 11 + 5);
+	}
+	SPIClient_Buffer gather[3] = { { header, 4, false }, { piece_a, 32, false }, { piece_b, 32, false } };
+	ok &= R_SUCCEEDED(SPIClient_Transfer(&client, dev, gather, 3));
+
+	ok &= R_SUCCEEDED(SPIClient_Read(&client, dev, (0x40 << 1) | 1, 1, back, 67));
+	ok &= !memcmp(back, header + 1, 3) && !memcmp(back + 3, piece_a, 32) && !memcmp(back + 35, piece_b, 32);
+
+	// and back out in pieces, the 1 byte command on its own
+	u8* read_cmd = HostKernel_Alloc32(4);
+	*read_cmd = (0x43 << 1) | 1;
+	memset(back, 0, 68);
+	SPIClient_Buffer scatter[3] = { { read_cmd, 1, false }, { back, 32, true }, { back + 32, 32, true } };
+	ok &= R_SUCCEEDED(SPIClient_Transfer(&client, dev, scatter, 3));
+	ok &= !memcmp(back, piece_a, 32) && !memcmp(back + 32, piece_b, 32);
+
+	// a read buffer before a write one, too many and an empty one
+	u32 descs[10];
+	descs[0] = IPC_Desc_Buffer(4, IPC_BUFFER_W);
+	descs[1] = (u32)(uptr)back;
+	descs[2] = IPC_Desc_Buffer(4, IPC_BUFFER_R);
+	descs[3] = (u32)(uptr)header;
+	ok &= vector_rejected(svc->session, dev, descs, 2);
+	for (u32 i = 0; i < 5; ++i) {
+		descs[i * 2] = IPC_Desc_Buffer(4, IPC_BUFFER_R);
+		descs[i * 2 + 1] = (u32)(uptr)header;
+	}
+	ok &= vector_rejected(svc->session, dev, descs, SPI_VECTOR_MAX + 1);
+	descs[2] = IPC_Desc_Buffer(0, IPC_BUFFER_R);
+	ok &= vector_raw(svc->session, dev, descs, 2) == SPI_OUT_OF_RANGE;
+
+	printf("== vectored transfers, %s\n", ok ? "ok" : "FAILED");
+
+	// what a client without cmd 0x1A does, put it all together first, against the pieces as they are
+	u64 copy_ns = 0, vector_ns = 0;
+	for (u32 round = 0; round < 200; ++round) {
+		u64 t0 = HostKernel_Now();
+		memcpy(joined, header + 1, 3);
+		memcpy(joined + 3, piece_a, 32);
+		memcpy(joined + 35, piece_b, 32);
+		SPIClient_Write(&client, dev, header[0], 1, joined, 67);
+		u64 t1 = HostKernel_Now();
+		SPIClient_Transfer(&client, dev, gather, 3);
+		vector_ns += HostKernel_Now() - t1;
+		copy_ns += t1 - t0;
+	}
+	printf("4 byte header and 2 32 byte pieces, 200 times: joined then cmd 0x7 %.1f us each, cmd 0x1A %.1f us each\n",
+		copy_ns / 1e3 / 200, vector_ns / 1e3 / 200);
+	printf("\n");
+
+	SPIClient_Close(&client);
+	return ok;
+}
+
+// read conversion, cmd 0x1E, against the same bytes read raw and converted here
+static void convert_ref(u8 convert, const u8* wire, u8* out, u32 length) {
+	u16 samples[64];
+	u32 count = length / 2;
+
+	for (u32 i = 0; i < count; ++i) {
+		if (convert & SPI_CONVERT_SWAP16)
+			samples[i] = (wire[i * 2] << 8) | wire[i * 2 + 1];
+		else if (convert & SPI_CONVERT_UNPACK12)
+			samples[i] = i & 1 ? ((wire[i / 2 * 3 + 1] & 0xF) << 8) | wire[i / 2 * 3 + 2]
+				: (wire[i / 2 * 3] << 4) | (wire[i / 2 * 3 + 1] >> 4);
+		else
+			samples[i] = wire[i * 2] | (wire[i * 2 + 1] << 8);
+	}
+
+	if (convert & SPI_CONVERT_SWAP32) {
+		for (u32 i = 0; i < length; ++i)
+			out[i] = wire[(i & ~3) + 3 - (i & 3)];
+		return;
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		u32 at = convert & SPI_CONVERT_DEINTERLEAVE ? (i & 1) * (count / 2) + i / 2 : i;
+		out[at * 2] = samples[i] & 0xFF;
+		out[at * 2 + 1] = samples[i] >> 8;
+	}
+}
+
+static bool convert_check(void) {
+	Service* svc = &services[2];
+	u8 dev = svc->deviceid;
+	u8* regs = HostKernel_Alloc32(128);
+	u8* raw = HostKernel_Alloc32(128);
+	u8* back = HostKernel_Alloc32(132);
+	u8 expect[128];
+	SPIClient client;
+	u32 state = 0x5A5A1234;
+	bool ok = true;
+
+	SPIClient_Attach(&client, svc->session);
+
+	for (u32 i = 0; i < 128; ++i)
+		regs[i] = xorshift(&state);
+	ok &= R_SUCCEEDED(SPIClient_Write(&client, dev, 0, 1, regs, 64));
+	ok &= R_SUCCEEDED(SPIClient_Write(&client, dev, 0x40 << 1, 1, regs + 64, 64));
+
+	// inline cmd 0x3 up to 64 bytes, cmd 0x6 past that, 11 and 31 pairs to deinterleave too
+	static const u8 formats[] = {
+		SPI_CONVERT_SWAP16, SPI_CONVERT_SWAP32, SPI_CONVERT_UNPACK12, SPI_CONVERT_DEINTERLEAVE,
+		SPI_CONVERT_SWAP16 | SPI_CONVERT_DEINTERLEAVE, SPI_CONVERT_UNPACK12 | SPI_CONVERT_DEINTERLEAVE,
+	};
+	static const u32 lengths[] = { 4, 8, 12, 44, 64, 100, 124, 128 };
+	for (u32 f = 0; f < sizeof(formats); ++f) {
+		bool format_ok = true;
+		for (u32 l = 0; l < sizeof(lengths) / 4; ++l) {
+			u32 length = lengths[l];
+			u32 wire = formats[f] & SPI_CONVERT_UNPACK12 ? length / 4 * 3 : length;
+
+			simple_cmd(svc->session, 0x1E, dev, 0, 0);
+			format_ok &= R_SUCCEEDED(SPIClient_Read(&client, dev, 1, 1, raw, wire));
+			convert_ref(formats[f], raw, expect, length);
+
+			memset(back, 0xEE, 132);
+			format_ok &= R_SUCCEEDED(simple_cmd(svc->session, 0x1E, dev, formats[f], 0));
+			format_ok &= R_SUCCEEDED(SPIClient_Read(&client, dev, 1, 1, back, length));
+			format_ok &= !memcmp(back, expect, length) && back[length] == 0xEE;
+		}
+		if (!format_ok)
+			printf("conversion 0x%X FAILED\n", formats[f]);
+		ok &= format_ok;
+	}
+
+	// lengths and buffers it can't do, flags that don't go together
+	ok &= SPIClient_Read(&client, dev, 1, 1, back, 6) == SPI_OUT_OF_RANGE;
+	ok &= SPIClient_Read(&client, dev, 1, 1, back + 2, 100) == SPI_OUT_OF_RANGE;
+	ok &= simple_cmd(svc->session, 0x1E, dev, SPI_CONVERT_SWAP16 | SPI_CONVERT_UNPACK12, 0) == SPI_OUT_OF_RANGE;
+	ok &= simple_cmd(svc->session, 0x1E, dev, SPI_CONVERT_SWAP32 | SPI_CONVERT_DEINTERLEAVE, 0) == SPI_OUT_OF_RANGE;
+	ok &= simple_cmd(svc->session, 0x1E, dev, BIT(7), 0) == SPI_OUT_OF_RANGE;
+
+	printf("== read conversion, %s\n", ok ? "ok" : "FAILED");
+
+	// a client unpacking 12 bit stereo itself, against it being done on the way out
+	u64 client_ns = 0, module_ns = 0;
+	for (u32 round = 0; round < 200; ++round) {
+		u64 t0 = HostKernel_Now();
+		simple_cmd(svc->session, 0x1E, dev, 0, 0);
+		SPIClient_Read(&client, dev, 1, 1, raw, 96);
+		convert_ref(SPI_CONVERT_UNPACK12 | SPI_CONVERT_DEINTERLEAVE, raw, expect, 128);
+		u64 t1 = HostKernel_Now();
+		simple_cmd(svc->session, 0x1E, dev, SPI_CONVERT_UNPACK12 | SPI_CONVERT_DEINTERLEAVE, 0);
+		SPIClient_Read(&client, dev, 1, 1, back, 128);
+		module_ns += HostKernel_Now() - t1;
+		client_ns += t1 - t0;
+	}
+	printf("128 bytes of unpacked 12 bit stereo, 200 times: converted by the client %.1f us each, by the module %.1f us each\n",
+		client_ns / 1e3 / 200, module_ns / 1e3 / 200);
+	printf("\n");
+
+	simple_cmd(svc->session, 0x1E, dev, 0, 0);
+	SPIClient_Close(&client);
+	return ok;
+}
+
+// microprograms, cmds 0x1B to 0x1D, against the NOR model on SPI::NOR
+#define PROG_OP(op, flags, reg, length, arg) ((SPI_ProgOp){ SPI_PROG_##op, flags, reg, length, arg })
+#define PROG_ADDR(addr) ((((addr) >> 16) & 0xFF) | ((addr) & 0xFF00) | (((addr) & 0xFF) << 16)) // on the wire MSB first
+
+static Result prog_load(Handle session, SPI_ProgOp* ops, u32 count, u32* handle) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x1B, 1, 2);
+	cmdbuf[1] = count;
+	cmdbuf[2] = IPC_Desc_Buffer(count * sizeof(*ops), IPC_BUFFER_R);
+	cmdbuf[3] = (u32)(uptr)ops;
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	*handle = cmdbuf[2];
+	return cmdbuf[1];
+}
+
+// reply is exit value, output bytes and ops run, regs come back as they ended
+static Result prog_run(Handle session, u32 handle, u8 deviceid, u32* regs, void* out, u32 size, u32* reply) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0x1C, 2 + SPI_PROG_REGS, 2);
+	cmdbuf[1] = handle;
+	cmdbuf[2] = deviceid;
+	memcpy(&cmdbuf[3], regs, SPI_PROG_REGS * 4);
+	cmdbuf[3 + SPI_PROG_REGS] = IPC_Desc_Buffer(size, IPC_BUFFER_W);
+	cmdbuf[4 + SPI_PROG_REGS] = (u32)(uptr)out;
+	Result res = svcSendSyncRequest(session);
+	if (R_FAILED(res))
+		return res;
+	memcpy(reply, &cmdbuf[2], 3 * 4);
+	memcpy(regs, &cmdbuf[5], SPI_PROG_REGS * 4);
+	return cmdbuf[1];
+}
+
+static bool prog_check(void) {
+	Handle nor = services[0].session;
+	u8 dev = services[0].deviceid;
+	SPI_ProgOp* ops = HostKernel_Alloc32(SPI_PROG_MAX_OPS * sizeof(SPI_ProgOp));
+	u8* out = HostKernel_Alloc32(256);
+	u32 addr = 0x8000, data = 0x5AA51234;
+	u32 regs[SPI_PROG_REGS], reply[3];
+	u32 handle, loop, spin, extra[SPI_PROG_SLOTS];
+	bool ok = true;
+
+	ok &= nor_expect("erase", nor_cmd(0x14, addr, NULL, 0x1000));
+
+	// write enable, program a word, wait out write in progress with the status read held, read it back
+	ops[0] = PROG_OP(WRITE_IMM, SPI_PROG_FLAG_END, 0, 1, 0x06);
+	ops[1] = PROG_OP(WRITE_IMM, 0, 0, 1, 0x02);
+	ops[2] = PROG_OP(WRITE_REG, 0, 0, 3, 0);
+	ops[3] = PROG_OP(WRITE_REG, SPI_PROG_FLAG_END, 1, 4, 0);
+	ops[4] = PROG_OP(WRITE_IMM, 0, 0, 1, 0x05);
+	ops[5] = PROG_OP(POLL, SPI_PROG_FLAG_END, 2, 1, SPI_PROG_MATCH(0x01, 0));
+	ops[6] = PROG_OP(WRITE_IMM, 0, 0, 1, 0x03);
+	ops[7] = PROG_OP(WRITE_REG, 0, 0, 3, 0);
+	ops[8] = PROG_OP(READ_OUT, SPI_PROG_FLAG_END | SPI_PROG_FLAG_REG, 3, 0, 0);
+	ops[9] = PROG_OP(EXIT, 0, 0, 0, 0x600D);
+	ok &= R_SUCCEEDED(prog_load(nor, ops, 10, &handle));
+
+	u32 init[SPI_PROG_REGS] = { PROG_ADDR(addr), data, 0, 8 };
+	memcpy(regs, init, sizeof(regs));
+	memset(out, 0, 256);
+	ok &= R_SUCCEEDED(prog_run(nor, handle, dev, regs, out, 256, reply));
+	ok &= reply[0] == 0x600D && reply[1] == 8 && reply[2] == 10 && !memcmp(out, &data, 4) && out[4] == 0xFF;
+	ok &= (regs[2] & 1) == 0;
+
+	// counted loop, r0 up to 5 then out
+	ops[0] = PROG_OP(ADD, 0, 0, 0, 1);
+	ops[1] = PROG_OP(JUMP, SPI_PROG_FLAG_NOT, 0, 0, SPI_PROG_MATCH(0xFF, 5));
+	ops[2] = PROG_OP(OUT_REG, 0, 0, 1, 0);
+	ok &= R_SUCCEEDED(prog_load(nor, ops, 3, &loop));
+	memset(regs, 0, sizeof(regs));
+	ok &= R_SUCCEEDED(prog_run(nor, loop, dev, regs, out, 256, reply)) && reply[1] == 1 && out[0] == 5 && reply[2] == 11;
+
+	// never ends, with a window open
+	ops[0] = PROG_OP(WRITE_IMM, 0, 0, 1, 0x05);
+	ops[1] = PROG_OP(READ_REG, 0, 0, 1, 0);
+	ops[2] = PROG_OP(JUMP, 0, 0, 1, 0);
+	ok &= R_SUCCEEDED(prog_load(nor, ops, 3, &spin));
+	ok &= prog_run(nor, spin, dev, regs, out, 256, reply) == SPI_PROG_LIMIT;
+
+	// one read out longer than the whole time limit on the wire, refused before it starts rather than holding the bus past it
+	u8* big = HostKernel_Alloc32(0x10000);
+	ops[0] = PROG_OP(WRITE_IMM, 0, 0, 4, 0x03);
+	ops[1] = PROG_OP(READ_OUT, SPI_PROG_FLAG_END, 0, 0, 0x10000);
+	ok &= R_SUCCEEDED(prog_load(nor, ops, 2, &extra[0]));
+	u64 t_big = HostKernel_Now();
+	ok &= prog_run(nor, extra[0], dev, regs, big, 0x10000, reply) == SPI_PROG_LIMIT && reply[1] == 0 && reply[2] == 2;
+	ok &= HostKernel_Now() - t_big < (u64)SPI_PROG_MAX_US * 1000;
+	ok &= R_SUCCEEDED(simple_cmd(nor, 0x1D, extra[0], 0, 0));
+
+	// refused programs, someone else's handle, running out of slots
+	ops[0] = PROG_OP(JUMP, 0, 0, 3, 0);
+	ok &= prog_load(nor, ops, 3, &extra[0]) == SPI_PROG_INVALID;
+	ops[0].op = 0x42;
+	ok &= prog_load(nor, ops, 1, &extra[0]) == SPI_PROG_INVALID;
+	ok &= prog_run(services[2].session, handle, services[2].deviceid, regs, out, 256, reply) == SPI_PROG_NOT_FOUND;
+	ops[0] = PROG_OP(EXIT, 0, 0, 0, 0);
+	ok &= R_SUCCEEDED(prog_load(nor, ops, 1, &extra[0]));
+	ok &= prog_load(nor, ops, 1, &extra[1]) == SPI_PROG_NO_SLOT;
+	ok &= R_SUCCEEDED(simple_cmd(nor, 0x1D, extra[0], 0, 0)) && R_SUCCEEDED(simple_cmd(nor, 0x1D, loop, 0, 0))
+		&& R_SUCCEEDED(simple_cmd(nor, 0x1D, spin, 0, 0));
+	ok &= simple_cmd(nor, 0x1D, spin, 0, 0) == SPI_PROG_NOT_FOUND;
+
+	printf("== microprograms, %s\n", ok ? "ok" : "FAILED");
+
+	// the same program, write and read back, as separate requests, status polled over IPC
+	u32* cmdbuf = getThreadCommandBuffer();
+	u32 polls = 0;
+	u64 t0 = HostKernel_Now();
+	simple_cmd(nor, 0x5, dev, 0x06, 1);
+	cmdbuf[0] = IPC_MakeHeader(0x4, 20, 0);
+	cmdbuf[1] = dev;
+	cmdbuf[2] = 0x02 | PROG_ADDR(addr) << 8;
+	cmdbuf[3] = 4;
+	memcpy(&cmdbuf[4], &data, 4);
+	cmdbuf[20] = 4;
+	svcSendSyncRequest(nor);
+	do {
+		cmdbuf[0] = IPC_MakeHeader(0x3, 4, 0);
+		cmdbuf[1] = dev;
+		cmdbuf[2] = 0x05;
+		cmdbuf[3] = 1;
+		cmdbuf[4] = 1;
+		svcSendSyncRequest(nor);
+		++polls;
+	} while (R_SUCCEEDED((Result)cmdbuf[1]) && (cmdbuf[2] & 1));
+	cmdbuf[0] = IPC_MakeHeader(0x3, 4, 0);
+	cmdbuf[1] = dev;
+	cmdbuf[2] = 0x03 | PROG_ADDR(addr) << 8;
+	cmdbuf[3] = 4;
+	cmdbuf[4] = 8;
+	svcSendSyncRequest(nor);
+	u64 ipc_ns = HostKernel_Now() - t0;
+
+	memcpy(regs, init, sizeof(regs));
+	t0 = HostKernel_Now();
+	prog_run(nor, handle, dev, regs, out, 256, reply);
+	u64 prog_ns = HostKernel_Now() - t0;
+	simple_cmd(nor, 0x1D, handle, 0, 0);
+
+	printf("write enable, program, wait, read back: %lu requests %.1f us, 1 cmd 0x1C %.1f us\n",
+		(unsigned long)(polls + 3), ipc_ns / 1e3, prog_ns / 1e3);
+	printf("\n");
+
+	return ok;
+}
+
+// NOR reads into SPI::NOR's ring data area against cmd 0x12
+#define ASYNC_CHUNK     0x1000
+#define ASYNC_CHUNKS    16
+#define ASYNC_IN_FLIGHT 4
+
+static u32 async_read_cmd(u32 addr) {
+	return 0x03 | ((addr >> 16) & 0xFF) << 8 | ((addr >> 8) & 0xFF) << 16 | (addr & 0xFF) << 24;
+}
+
+// what the client gets on with while its reads run, a polled decode say
+static void async_work(u64 ns) {
+	u64 end = HostKernel_Now() + ns;
+	while (HostKernel_Now() < end)
+		;
+}
+
+// ASYNC_CHUNKS reads, ASYNC_IN_FLIGHT at a time each in its own part of the data area, each checked and worked on
+// once its event says it's done, false if anything came back wrong
+static bool async_pipeline(Handle nor, SPI_Ring* ring, const u8* ref, Handle* events, u64 work_ns, u32* pending) {
+	u32 tickets[ASYNC_IN_FLIGHT];
+	bool ok = true;
+
+	for (u32 i = 0; i < ASYNC_CHUNKS + ASYNC_IN_FLIGHT; ++i) {
+		u32 slot = i % ASYNC_IN_FLIGHT;
+		if (i >= ASYNC_IN_FLIGHT) {
+			Result result;
+			u32 chunk = i - ASYNC_IN_FLIGHT;
+			// a poll first, it only gets to run the ticket behind the ones before it
+			Result res = async_collect(nor, tickets[slot], false, &result);
+			if (res == SPI_ASYNC_PENDING) {
+				++*pending;
+				ok &= svcWaitSynchronization(events[slot], 1000000000LL) == 0;
+				res = async_collect(nor, tickets[slot], false, &result);
+			}
+			ok &= R_SUCCEEDED(res) && R_SUCCEEDED(result);
+			ok &= !memcmp(&ring->data[slot * ASYNC_CHUNK], ref + chunk * ASYNC_CHUNK, ASYNC_CHUNK);
+			async_work(work_ns);
+		}
+		if (i < ASYNC_CHUNKS)
+			ok &= R_SUCCEEDED(async_submit(nor, services[0].deviceid, SPI_RING_OP_READ, async_read_cmd(i * ASYNC_CHUNK), 4, slot * ASYNC_CHUNK,
+				ASYNC_CHUNK, events[slot], &tickets[slot]));
+	}
+	return ok;
+}
+
+static bool async_check(void) {
+	Handle nor = services[0].session;
+	u8 dev = services[0].deviceid;
+	u8* ref = HostKernel_Alloc32(ASYNC_CHUNKS * ASYNC_CHUNK);
+	u8* buf = HostKernel_Alloc32(ASYNC_CHUNK);
+	u32* cmdbuf = getThreadCommandBuffer();
+	Handle events[ASYNC_IN_FLIGHT];
+	u32 tickets[SPI_ASYNC_TICKETS + 1];
+	Result result;
+	SPIClient client;
+	bool ok = true;
+
+	ok &= nor_expect("read", nor_cmd(0x12, 0, ref, ASYNC_CHUNKS * ASYNC_CHUNK));
+	for (u32 i = 0; i < ASYNC_IN_FLIGHT; ++i)
+		ok &= R_SUCCEEDED(svcCreateEvent(&events[i], RESET_ONESHOT));
+
+	// no data area yet, a command alone is fine
+	ok &= async_submit(nor, services[0].deviceid, SPI_RING_OP_READ, async_read_cmd(0), 4, 0, 16, 0, &tickets[0]) == SPI_NOT_INITIALIZED;
+	ok &= R_SUCCEEDED(async_submit(nor, services[0].deviceid, SPI_RING_OP_CMD_ONLY, 0x04, 1, 0, 0, 0, &tickets[0]));
+	ok &= R_SUCCEEDED(async_collect(nor, tickets[0], true, &result)) && result == 0;
+	ok &= async_collect(nor, tickets[0], true, &result) == SPI_ASYNC_NOT_FOUND;
+
+	SPIClient_Attach(&client, nor);
+	void* block = HostKernel_AllocShared(0x8000);
+	ok &= R_SUCCEEDED(SPIClient_EnableBatching(&client, block, 0x8000));
+	SPI_Ring* ring = block;
+
+	// what can't run fails the submit itself, not the collect
+	u32 bad;
+	ok &= R_FAILED(async_submit(nor, dev, 0x9, async_read_cmd(0), 4, 0, 16, 0, &bad));
+	ok &= async_submit(nor, 9, SPI_RING_OP_READ, async_read_cmd(0), 4, 0, 16, 0, &bad) == SPI_INVALID_SELECTION;
+	ok &= async_submit(nor, 0x100 | dev, SPI_RING_OP_CMD_ONLY, 0x04, 1, 0, 0, 0, &bad) == SPI_INVALID_SELECTION;
+	ok &= async_submit(nor, dev, SPI_RING_OP_CMD_ONLY, 0x04, 5, 0, 0, 0, &bad) == SPI_OUT_OF_RANGE;
+	ok &= async_submit(nor, dev, SPI_RING_OP_READ, 0, 4, 0x7FF0, 16, 0, &bad) == SPI_OUT_OF_RANGE;
+	ok &= async_submit(nor, dev, SPI_RING_OP_WRITE, 0, 4, 0, 0, 0, &bad) == SPI_OUT_OF_RANGE;
+
+	// full past SPI_ASYNC_TICKETS, one collected makes room
+	for (u32 i = 0; i < SPI_ASYNC_TICKETS; ++i)
+		ok &= R_SUCCEEDED(async_submit(nor, services[0].deviceid, SPI_RING_OP_READ, async_read_cmd(i * 16), 4, i * 16, 16, 0, &tickets[i]));
+	ok &= async_submit(nor, services[0].deviceid, SPI_RING_OP_CMD_ONLY, 0x04, 1, 0, 0, 0, &tickets[SPI_ASYNC_TICKETS]) == SPI_ASYNC_FULL;
+	ok &= R_SUCCEEDED(async_collect(nor, tickets[0], true, &result)) && result == 0;
+	ok &= R_SUCCEEDED(async_submit(nor, services[0].deviceid, SPI_RING_OP_CMD_ONLY, 0x04, 1, 0, 0, 0, &tickets[0]));
+	ok &= R_SUCCEEDED(async_collect(nor, tickets[SPI_ASYNC_TICKETS - 1], true, &result)) && result == 0; // everything before it too
+	for (u32 i = 1; i < SPI_ASYNC_TICKETS; ++i) {
+		if (i < SPI_ASYNC_TICKETS - 1)
+			ok &= R_SUCCEEDED(async_collect(nor, tickets[i], false, &result)) && result == 0;
+		ok &= !memcmp(&ring->data[i * 16], ref + i * 16, 16);
+	}
+	ok &= R_SUCCEEDED(async_collect(nor, tickets[0], true, &result)) && result == 0;
+	ok &= async_collect(nor, tickets[0] + SPI_ASYNC_TICKETS, true, &result) == SPI_ASYNC_NOT_FOUND;
+
+	// an event that isn't a handle descriptor
+	cmdbuf[0] = IPC_MakeHeader(0x1F, 6, 2);
+	cmdbuf[7] = IPC_Desc_Buffer(4, IPC_BUFFER_R);
+	ok &= R_SUCCEEDED(svcSendSyncRequest(nor)) && (cmdbuf[0] >> 16) == 0 && R_FAILED((Result)cmdbuf[1]);
+
+	u32 pending = 0;
+	ok &= async_pipeline(nor, ring, ref, events, 0, &pending);
+
+	printf("== asynchronous transfers, %s\n", ok ? "ok" : "FAILED");
+
+	// a client reading chunks and working on each one as long as it took to read, waiting on every read, then with reads in flight
+	u64 t0 = HostKernel_Now();
+	for (u32 i = 0; i < ASYNC_CHUNKS; ++i) {
+		cmdbuf[0] = IPC_MakeHeader(0x6, 4, 2);
+		cmdbuf[1] = dev;
+		cmdbuf[2] = async_read_cmd(i * ASYNC_CHUNK);
+		cmdbuf[3] = 4;
+		cmdbuf[4] = ASYNC_CHUNK;
+		cmdbuf[5] = IPC_Desc_Buffer(ASYNC_CHUNK, IPC_BUFFER_W);
+		cmdbuf[6] = (u32)(uptr)buf;
+		svcSendSyncRequest(nor);
+	}
+	u64 work_ns = (HostKernel_Now() - t0) / ASYNC_CHUNKS;
+
+	t0 = HostKernel_Now();
+	for (u32 i = 0; i < ASYNC_CHUNKS; ++i) {
+		cmdbuf[0] = IPC_MakeHeader(0x6, 4, 2);
+		cmdbuf[1] = dev;
+		cmdbuf[2] = async_read_cmd(i * ASYNC_CHUNK);
+		cmdbuf[3] = 4;
+		cmdbuf[4] = ASYNC_CHUNK;
+		cmdbuf[5] = IPC_Desc_Buffer(ASYNC_CHUNK, IPC_BUFFER_W);
+		cmdbuf[6] = (u32)(uptr)buf;
+		svcSendSyncRequest(nor);
+		async_work(work_ns);
+	}
+	u64 sync_ns = HostKernel_Now() - t0;
+
+	pending = 0;
+	t0 = HostKernel_Now();
+	ok &= async_pipeline(nor, ring, ref, events, work_ns, &pending);
+	u64 async_ns = HostKernel_Now() - t0;
+
+	printf("%u 4KiB reads, %.1f us of work after each: cmd 0x6 %.1f ms, %u in flight with cmds 0x1F and 0x20 %.1f ms, %lu waited on\n",
+		ASYNC_CHUNKS, work_ns / 1e3, sync_ns / 1e6, ASYNC_IN_FLIGHT, async_ns / 1e6, (unsigned long)pending);
+	printf("\n");
+
+	SPIClient_Close(&client);
+	for (u32 i = 0; i < ASYNC_IN_FLIGHT; ++i)
+		svcCloseHandle(events[i]);
+	return ok;
+}
+
+// boot timeline through cmd 0x19, then CD2 gets a second session, on N3DS the same worker takes it
+static bool boot_check(Handle sessions[5]) {
+	static const char* const names[SPI_BOOT_COUNT] = { "start", "sync init", "srv init", "CD2 registered",
+		"all registered", "notification", "first accept", "first request" };
+	u32* cmdbuf = getThreadCommandBuffer();
+	u64 ticks[SPI_BOOT_COUNT];
+	bool ok = true;
+
+	cmdbuf[0] = IPC_MakeHeader(0x19, 0, 0);
+	ok &= R_SUCCEEDED(svcSendSyncRequest(sessions[1])) && cmdbuf[1] == 0;
+	for (int i = 0; i < SPI_BOOT_COUNT; ++i) {
+		ticks[i] = cmdbuf[2 + i * 2] | (u64)cmdbuf[3 + i * 2] << 32;
+		ok &= ticks[i] != 0 && (i == 0 || ticks[i] >= ticks[i - 1]);
+	}
+
+	svcCloseHandle(sessions[1]);
+	u64 t0 = HostKernel_Now();
+	ok &= R_SUCCEEDED(HostSrv_GetServiceHandle(&sessions[1], "SPI::CD2"));
+	ok &= R_SUCCEEDED(simple_cmd(sessions[1], 0x1, services[1].deviceid, services[1].rate, 0));
+	u64 reopen_ns = HostKernel_Now() - t0;
+	services[1].session = sessions[1];
+
+	printf("== boot timeline, %s\n", ok ? "ok" : "FAILED");
+	for (int i = 0; i < SPI_BOOT_COUNT; ++i)
+		printf("%-16s %9.1f us\n", names[i], (ticks[i] - ticks[0]) * 1e6 / HOSTSIM_TICKS_PER_SEC);
+	printf("CD2 reopened and served in %.1f us\n", reopen_ns / 1e3);
+	printf("\n");
+
+	return ok;
+}
+
+// capture everything the run sends, through cmd 0xF on SPI::DEF, for spireplay
+static void capture_start(void) {
+	capture = HostKernel_AllocShared(SPI_TRACE_MAX_SIZE);
+	Handle block;
+	if (R_FAILED(svcCreateMemoryBlock(&block, (u32)(uptr)capture, SPI_TRACE_MAX_SIZE, MEMPERM_READWRITE, MEMPERM_READWRITE)))
+		abort();
+
+	u32* cmdbuf = getThreadCommandBuffer();
+	cmdbuf[0] = IPC_MakeHeader(0xF, 1, 2);
+	cmdbuf[1] = SPI_TRACE_MAX_SIZE;
+	cmdbuf[2] = IPC_Desc_SharedHandles(1);
+	cmdbuf[3] = block;
+	if (R_FAILED(svcSendSyncRequest(services[4].session)) || R_FAILED((Result)cmdbuf[1])) {
+		fprintf(stderr, "spibench: capture setup failed\n");
+		exit(1);
+	}
+	svcCloseHandle(block);
+}
+
+static void capture_stop(void) {
+	simple_cmd(services[4].session, 0x10, 0, 0, 0);
+
+	FILE* f = fopen(capture_path, "wb");
+	if (!f) {
+		perror(capture_path);
+		exit(1);
+	}
+	fwrite(capture, sizeof(SPI_Trace) + capture->count * sizeof(SPI_TraceRecord), 1, f);
+	fclose(f);
+	printf("captured %lu requests to %s, %lu dropped\n", (unsigned long)capture->count, capture_path,
+		(unsigned long)capture->dropped);
+}
+
+int main(int argc, char** argv) {
+	const char* mode = "mix";
+	bool failed = false;
+	const char* value;
+	Service* svc;
+	int opt;
+
+	for (int i = 0; i < 5; ++i)
+		pthread_mutex_init(&services[i].lock, NULL);
+
+	while ((opt = getopt(argc, argv, "d:c:r:x:D:b:n:C:a:R:S:p:t:s:w:k:NM:h")) != -1) {
+		switch (opt) {
+		case 'd': duration_ns = strtoull(optarg, NULL, 0) * 1000000ULL; break;
+		case 's': starve_ns = strtoull(optarg, NULL, 0) * 1000000ULL; break;
+		case 'c':
+			svc = find_service(optarg, &value);
+			svc->clients = atoi(value);
+			if (svc->clients < 0 || svc->clients > MAX_CLIENTS)
+				usage();
+			break;
+		case 'r': svc = find_service(optarg, &value); svc->hz = strtoul(value, NULL, 0); break;
+		case 'x': svc = find_service(optarg, &value); parse_mix(svc, value); break;
+		case 'D': svc = find_service(optarg, &value); svc->deviceid = strtoul(value, NULL, 0) % 7; break;
+		case 'b': svc = find_service(optarg, &value); svc->rate = strtoul(value, NULL, 0); break;
+		case 'n': nspi_bus[strtoul(optarg, NULL, 0) % 3] = true; break;
+		case 'C': coalesce_devices |= BIT(strtoul(optarg, NULL, 0) % 7); break;
+		case 'a': nspi_capable_devices |= BIT(strtoul(optarg, NULL, 0) % 7); break;
+		case 'R': readahead_devices |= BIT(strtoul(optarg, NULL, 0) % 7); break;
+		case 'S': svc = find_service(optarg, &value); svc->sequential = true; break;
+		case 'p': svc = find_service(optarg, &value); parse_class(svc, value); break;
+		case 't': svc = find_service(optarg, &value); svc->deadline_us = strtoul(value, NULL, 0); break;
+		case 'w': capture_path = optarg; break;
+		case 'k': {
+				unsigned bus, ms;
+				if (sscanf(optarg, "%u:%u", &bus, &ms) != 2 || bus > 2)
+					usage();
+				wedge_bus = bus;
+				wedge_ns = ms * 1000000ULL;
+			}
+			break;
+		case 'N': HostHW_SetN3DS(true); break;
+		case 'M': mode = optarg; break;
+		default: usage();
+		}
+	}
+
+	Handle sessions[5];
+	if (!HostBoard_Start(sessions))
+		return 1;
+	for (int i = 0; i < 5; ++i)
+		services[i].session = sessions[i];
+
+	// before the device setup, so a replay of the capture starts from the same state
+	if (capture_path)
+		capture_start();
+
+	for (int i = 0; i < 5; ++i) {
+		Service* s = &services[i];
+		u8 bus = s->deviceid <= 2 ? 0 : s->deviceid <= 5 ? 1 : 2;
+		simple_cmd(s->session, 0x1, s->deviceid, s->rate, 0);
+		if (nspi_bus[bus])
+			simple_cmd(s->session, 0x8, s->deviceid, 1, s->rate);
+		if (coalesce_devices & BIT(s->deviceid))
+			simple_cmd(s->session, 0xC, s->deviceid, SPI_DEVICE_FLAG_COALESCE_READS, SPI_DEVICE_FLAG_COALESCE_READS);
+		if (nspi_capable_devices & BIT(s->deviceid))
+			simple_cmd(s->session, 0xC, s->deviceid, SPI_DEVICE_FLAG_NSPI_CAPABLE, SPI_DEVICE_FLAG_NSPI_CAPABLE);
+		if (readahead_devices & BIT(s->deviceid))
+			simple_cmd(s->session, 0xC, s->deviceid, SPI_DEVICE_FLAG_READ_AHEAD, SPI_DEVICE_FLAG_READ_AHEAD);
+		if (s->sched_class >= 0)
+			simple_cmd(s->session, 0xE, s->sched_class, s->weight, 0);
+	}
+
+	if (!strcmp(mode, "cd2tail")) {
+		for (int i = 0; i < 5; ++i)
+			if (i != 1)
+				services[i].clients = 0;
+		run_phase("CD2 alone");
+
+		Service* nor = &services[0];
+		nor->clients = nor->clients ? nor->clients : 2;
+		nor->hz = 0;
+		nor->mix[0] = (MixEntry){ 0x6, 4096, 1 };
+		nor->nmix = 1;
+		run_phase("CD2 with back to back 4KiB NOR reads");
+	} else if (!strcmp(mode, "nor")) {
+		if (!nor_check())
+			failed = true;
+	} else if (!strcmp(mode, "regs")) {
+		if (!reg_check())
+			failed = true;
+	} else if (!strcmp(mode, "regcache")) {
+		if (!regcache_check())
+			failed = true;
+	} else if (!strcmp(mode, "client")) {
+		if (!client_check())
+			failed = true;
+	} else if (!strcmp(mode, "contention")) {
+		// both buses busy from every side at once, each transfer short, so what's left is locks and shared state
+		for (int i = 0; i < 5; ++i) {
+			services[i].clients = services[i].clients > 1 ? services[i].clients : 2;
+			services[i].hz = 0;
+			services[i].mix[0] = (MixEntry){ 0x3, 1, 1 };
+			services[i].nmix = 1;
+		}
+		run_phase("contention, 1 byte reads back to back");
+	} else if (!strcmp(mode, "prog")) {
+		if (!prog_check())
+			failed = true;
+	} else if (!strcmp(mode, "vector")) {
+		if (!vector_check())
+			failed = true;
+	} else if (!strcmp(mode, "convert")) {
+		if (!convert_check())
+			failed = true;
+	} else if (!strcmp(mode, "async")) {
+		if (!async_check())
+			failed = true;
+	} else if (!strcmp(mode, "boot")) {
+		if (!boot_check(sessions))
+			failed = true;
+	} else if (!strcmp(mode, "stream")) {
+		// a client streaming the flash at a steady pace, say decoding as it goes, with everything else still running
+		Service* nor = &services[0];
+		nor->hz = nor->hz ? nor->hz : 80;
+		nor->mix[0] = (MixEntry){ 0x6, 4096, 1 };
+		nor->nmix = 1;
+		nor->sequential = true;
+		simple_cmd(nor->session, 0xC, nor->deviceid, SPI_DEVICE_FLAG_READ_AHEAD, 0);
+		run_phase("NOR stream, no read ahead");
+		simple_cmd(nor->session, 0xC, nor->deviceid, SPI_DEVICE_FLAG_READ_AHEAD, SPI_DEVICE_FLAG_READ_AHEAD);
+		run_phase("NOR stream, read ahead");
+		if (nor->rate != 3) {
+			// the slowest rate, the only one where a byte outlasts a wakeup, so the only one sleeping gives anything back
+			u8 bus = nor->deviceid <= 2 ? 0 : nor->deviceid <= 5 ? 1 : 2;
+			simple_cmd(nor->session, 0x1, nor->deviceid, 3, 0);
+			if (nspi_bus[bus])
+				simple_cmd(nor->session, 0x8, nor->deviceid, 1, 3);
+			run_phase("NOR stream, read ahead, 512KHz");
+			simple_cmd(nor->session, 0x1, nor->deviceid, nor->rate, 0);
+			if (nspi_bus[bus])
+				simple_cmd(nor->session, 0x8, nor->deviceid, 1, nor->rate);
+		}
+	} else if (!strcmp(mode, "mix")) {
+		run_phase("mix");
+	} else {
+		usage();
+	}
+
+	print_module_stats();
+
+	if (capture_path)
+		capture_stop();
+
+	return HostBoard_Stop(sessions) && !failed ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+// The simulated console the host tools run against, devices on the buses and the module running
+#include <pthread.h>
+#include <stdio.h>
+
+#include <3ds/types.h>
+#include <3ds/result.h>
+#include <3ds/svc.h>
+#include "hostsim.h"
+
+const char* const HostBoard_ServiceNames[5] = { "SPI::NOR", "SPI::CD2", "SPI::CS2", "SPI::CS3", "SPI::DEF" };
+
+static pthread_t module;
+
+static void* module_thread(void* arg) {
+	(void)arg;
+	_start_tick = svcGetSystemTick();
+	SPIMain();
+	return NULL;
+}
+
+bool HostBoard_Start(Handle sessions[5]) {
+	// NOR flash where the wifi flash sits, register files standing in for everything else
+	HostHW_Attach(0, HostDev_NewRegisterFile(false));
+	HostHW_Attach(1, HostDev_NewNORFlash(0x20000));
+	HostHW_Attach(2, HostDev_NewRegisterFile(false));
+	HostHW_Attach(3, HostDev_NewRegisterFile(true));
+	HostHW_Attach(4, HostDev_NewRegisterFile(false));
+	HostHW_Attach(5, HostDev_NewRegisterFile(false));
+	HostHW_Attach(6, HostDev_NewRegisterFile(false));
+
+	pthread_create(&module, NULL, module_thread, NULL);
+
+	for (int i = 0; i < 5; ++i) {
+		if (R_FAILED(HostSrv_GetServiceHandle(&sessions[i], HostBoard_ServiceNames[i]))) {
+			fprintf(stderr, "hostsim: could not open %s\n", HostBoard_ServiceNames[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool HostBoard_Stop(Handle sessions[5]) {
+	for (int i = 0; i < 5; ++i)
+		svcCloseHandle(sessions[i]);
+	HostSrv_Notify(0x100);
+	pthread_join(module, NULL);
+
+	bool clean = true;
+	for (int b = 0; b < 3; ++b) {
+		HostBusStats stats;
+		HostHW_GetBusStats(b, &stats);
+		if (stats.collisions || stats.violations) {
+			fprintf(stderr, "hostsim: BUS%d saw %llu collisions and %llu violations\n", b,
+				(unsigned long long)stats.collisions, (unsigned long long)stats.violations);
+			clean = false;
+		}
+	}
+	return clean;
+}
@@ -0,0 +1,232 @@
+// Device models hanging off the simulated buses
+#include <stdlib.h>
+#include <string.h>
+
+#include <3ds/types.h>
+#include "hostsim.h"
+
+static void* zalloc(size_t size) {
+	void* p = calloc(1, size);
+	if (!p)
+		abort();
+	return p;
+}
+
+// NOR flash, close enough to the wifi flash on SPI::NOR
+// Programs and erases only happen at deselect and keep WIP up for a while, like the real part
+
+#define NOR_WREN        0x06
+#define NOR_WRDI        0x04
+#define NOR_RDID        0x9F
+#define NOR_RDSR        0x05
+#define NOR_READ        0x03
+#define NOR_FAST_READ   0x0B
+#define NOR_PP          0x02
+#define NOR_PE          0xDB // page erase, 256 bytes
+#define NOR_SSE         0x20 // subsector erase, 4KiB
+#define NOR_SE          0xD8 // sector erase, 64KiB
+
+#define NOR_SR_WIP      BIT(0)
+#define NOR_SR_WEL      BIT(1)
+
+#define NOR_PAGE        256
+
+typedef struct {
+	HostDevice dev;
+	u8* mem;
+	u32 size;
+
+	u8 opcode;
+	u32 count;     // bytes seen since select
+	u32 addr;
+	u8 page[NOR_PAGE];
+	bool page_dirty[NOR_PAGE];
+	bool pending_wren;
+	u8 status;
+	u64 busy_until;
+} NORFlash;
+
+static bool nor_busy(NORFlash* nor) {
+	if (nor->busy_until && HostKernel_Now() >= nor->busy_until) {
+		nor->busy_until = 0;
+		nor->status &= ~(NOR_SR_WIP | NOR_SR_WEL);
+	}
+	return nor->busy_until != 0;
+}
+
+static void nor_select(HostDevice* dev) {
+	NORFlash* nor = (NORFlash*)dev;
+	nor->count = 0;
+	nor->opcode = 0;
+	nor->addr = 0;
+	memset(nor->page_dirty, 0, sizeof(nor->page_dirty));
+}
+
+static u32 nor_addr_bytes(u8 opcode) {
+	switch (opcode) {
+	case NOR_READ:
+	case NOR_FAST_READ:
+	case NOR_PP:
+	case NOR_PE:
+	case NOR_SSE:
+	case NOR_SE:
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+static u8 nor_xfer(HostDevice* dev, u8 in) {
+	NORFlash* nor = (NORFlash*)dev;
+	u32 n = nor->count++;
+
+	if (n == 0) {
+		nor->opcode = in;
+		return 0xFF;
+	}
+
+	bool busy = nor_busy(nor);
+	if (nor->opcode == NOR_RDSR)
+		return nor->status;
+	if (busy)
+		return 0xFF; // everything else is ignored while writing
+
+	u32 addr_bytes = nor_addr_bytes(nor->opcode);
+	if (n <= addr_bytes) {
+		nor->addr = (nor->addr << 8) | in;
+		return 0xFF;
+	}
+
+	u32 i = n - addr_bytes - 1;
+	switch (nor->opcode) {
+	case NOR_RDID: {
+			static const u8 id[3] = { 0x20, 0x40, 0x11 }; // 128KiB part
+			return i < 3 ? id[i] : 0xFF;
+		}
+	case NOR_READ:
+		return nor->mem[(nor->addr + i) % nor->size];
+	case NOR_FAST_READ:
+		if (i == 0)
+			return 0xFF; // dummy byte
+		return nor->mem[(nor->addr + i - 1) % nor->size];
+	case NOR_PP: {
+			u32 off = (nor->addr + i) % NOR_PAGE; // wraps inside the page
+			nor->page[off] = in;
+			nor->page_dirty[off] = true;
+			return 0xFF;
+		}
+	default:
+		return 0xFF;
+	}
+}
+
+static void nor_deselect(HostDevice* dev) {
+	NORFlash* nor = (NORFlash*)dev;
+	u64 busy_ns = 0;
+
+	if (nor->count == 0 || nor_busy(nor))
+		return;
+
+	switch (nor->opcode) {
+	case NOR_WREN:
+		nor->status |= NOR_SR_WEL;
+		return;
+	case NOR_WRDI:
+		nor->status &= ~NOR_SR_WEL;
+		return;
+	case NOR_PP:
+		if (!(nor->status & NOR_SR_WEL) || nor->count < 5)
+			return;
+		for (u32 i = 0; i < NOR_PAGE; ++i) {
+			if (nor->page_dirty[i])
+				nor->mem[((nor->addr & ~(NOR_PAGE - 1)) + i) % nor->size] &= nor->page[i];
+		}
+		busy_ns = 800000;
+		break;
+	case NOR_PE:
+	case NOR_SSE:
+	case NOR_SE: {
+			if (!(nor->status & NOR_SR_WEL) || nor->count != 4)
+				return;
+			u32 len = nor->opcode == NOR_PE ? NOR_PAGE : nor->opcode == NOR_SSE ? 0x1000 : 0x10000;
+			u32 base = (nor->addr & ~(len - 1)) % nor->size;
+			memset(&nor->mem[base], 0xFF, len > nor->size - base ? nor->size - base : len);
+			busy_ns = nor->opcode == NOR_PE ? 10000000 : nor->opcode == NOR_SSE ? 50000000 : 150000000;
+		}
+		break;
+	default:
+		return;
+	}
+
+	nor->status |= NOR_SR_WIP;
+	nor->busy_until = HostKernel_Now() + busy_ns;
+}
+
+HostDevice* HostDev_NewNORFlash(u32 size) {
+	NORFlash* nor = zalloc(sizeof(NORFlash));
+	nor->dev.select = nor_select;
+	nor->dev.xfer = nor_xfer;
+	nor->dev.deselect = nor_deselect;
+	nor->mem = malloc(size);
+	if (!nor->mem)
+		abort();
+	for (u32 i = 0; i < size; ++i) // recognizable, address dependent content
+		nor->mem[i] = (u8)(i ^ (i >> 8));
+	nor->size = size;
+	return &nor->dev;
+}
+
+// Register file, the codec style protocol: first byte is (reg << 1) | read, then data with auto increment
+// Paged variant uses register 0 of every page as the page select, like the CDC,
+// and page 0 register 0x7F as a status register that reads different every time
+
+typedef struct {
+	HostDevice dev;
+	bool paged;
+	u8 page;
+	u8 reg;
+	bool read;
+	u32 count;
+	u8 regs[256][128];
+	u8 status;
+} RegisterFile;
+
+static void regfile_select(HostDevice* dev) {
+	((RegisterFile*)dev)->count = 0;
+}
+
+static u8 regfile_xfer(HostDevice* dev, u8 in) {
+	RegisterFile* rf = (RegisterFile*)dev;
+
+	if (rf->count++ == 0) {
+		rf->reg = in >> 1;
+		rf->read = in & 1;
+		return 0xFF;
+	}
+
+	u8 reg = rf->reg;
+	rf->reg = (rf->reg + 1) & 0x7F;
+
+	u8 page = rf->paged ? rf->page : 0;
+	if (rf->read) {
+		if (rf->paged && reg == 0)
+			return rf->page;
+		if (rf->paged && page == 0 && reg == 0x7F)
+			return ++rf->status;
+		return rf->regs[page][reg];
+	}
+
+	if (reg == 0 && rf->paged)
+		rf->page = in;
+	else
+		rf->regs[page][reg] = in;
+	return 0xFF;
+}
+
+HostDevice* HostDev_NewRegisterFile(bool paged) {
+	RegisterFile* rf = zalloc(sizeof(RegisterFile));
+	rf->dev.select = regfile_select;
+	rf->dev.xfer = regfile_xfer;
+	rf->paged = paged;
+	return &rf->dev;
+}
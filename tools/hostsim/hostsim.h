@@ -0,0 +1,65 @@
+// Host simulation of the spi module, see the Host benchmark section of README.md
+#pragma once
+#include <3ds/types.h>
+
+#define HOSTSIM_TICKS_PER_SEC 268111856ULL // ARM11 system tick
+
+void SPIMain(void);
+extern u64 _start_tick; // start.s stamps it on hardware, board.c right before SPIMain
+
+// kernel.c, the bits of Horizon the module and its clients need
+
+/// Monotonic host time in nanoseconds.
+u64 HostKernel_Now(void);
+
+/// Total time threads created through svcCreateThread spent in svcSleepThread.
+u64 HostKernel_ModuleSleptNs(void);
+
+/// Memory that stays addressable through a u32 IPC word, for client buffers.
+void* HostKernel_Alloc32(size_t size);
+
+/// Memory that can be handed to svcCreateMemoryBlock and mapped by the module.
+void* HostKernel_AllocShared(size_t size);
+
+/// Client side of srv:GetServiceHandle, blocks until the service is registered.
+Result HostSrv_GetServiceHandle(Handle* out, const char* name);
+
+/// Queues a srv notification for the module, 0x100 asks it to terminate.
+void HostSrv_Notify(u32 id);
+
+// hw.c, the SPI controllers and CFG11
+
+typedef struct HostDevice {
+	void (*select)(struct HostDevice* dev);
+	u8 (*xfer)(struct HostDevice* dev, u8 in);
+	void (*deselect)(struct HostDevice* dev);
+} HostDevice;
+
+typedef struct {
+	u64 busy_ns;       // time the wire was clocking
+	u64 transactions;  // chip select windows
+	u64 mmio_reads;
+	u64 mmio_writes;
+	u64 collisions;    // a second thread touched the bus inside someone else's chip select window
+	u64 violations;    // register use that would misbehave on hardware (wrong mode, writes while busy, FIFO underrun)
+	u64 resets;        // wedged controllers brought back by disabling them through CNT
+} HostBusStats;
+
+void HostHW_Attach(u8 deviceid, HostDevice* dev);
+void HostHW_SetN3DS(bool n3ds);
+void HostHW_GetBusStats(int bus, HostBusStats* out);
+// controller stops finishing anything, reports busy until the module resets it
+void HostHW_Wedge(int bus);
+
+// devices.c, device models
+
+HostDevice* HostDev_NewNORFlash(u32 size);
+HostDevice* HostDev_NewRegisterFile(bool paged);
+
+// board.c, devices attached and the module running, sessions in SPI::NOR, CD2, CS2, CS3, DEF order
+
+extern const char* const HostBoard_ServiceNames[5];
+
+bool HostBoard_Start(Handle sessions[5]);
+/// Closes the sessions, stops the module, false if the buses saw collisions or violations.
+bool HostBoard_Stop(Handle sessions[5]);
@@ -0,0 +1,370 @@
+// Simulated SPI controllers and the CFG11 registers spi touches
+// Register addresses are only used as keys, timing follows the host clock
+// so busy waits in the module spin for as long as they would on the console
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <3ds/types.h>
+#include "hostsim.h"
+
+#define CFG11_SPI_CNT_ADDR      0x1EC401C0
+#define CFG11_SOCINFO_ADDR      0x1EC40FFC
+
+#define SPI_CNT_RATE_MASK       0x3
+#define SPI_CNT_BUSY            BIT(7)
+#define SPI_CNT_SELECTHOLD      BIT(11)
+#define SPI_CNT_ENABLE          BIT(15)
+
+#define NSPI_CNT_RATE_MASK      0x7
+#define NSPI_CNT_WRITE          BIT(13)
+#define NSPI_CNT_BUSY           BIT(15)
+#define NSPI_STATUS_FIFO_BUSY   BIT(0)
+#define NSPI_FIFO_WORDS         8
+
+static const uptr bus_base[3] = { 0x1EC60000, 0x1EC42000, 0x1EC43000 };
+
+typedef struct {
+	pthread_mutex_t lock;
+	HostDevice* devices[3];
+
+	HostDevice* selected;
+	pthread_t owner;
+	bool wedged; // stuck busy until the controller gets reset through CNT
+
+	// legacy
+	u16 cnt;
+	u8 data;
+	u64 busy_until;
+
+	// nspi
+	u32 ncnt;
+	u32 blklen;
+	u32 phase_len;              // BLKLEN as latched when the phase started
+	u32 moved;                  // bytes through the FIFO this phase
+	u64 wire_time;              // when the wire catches up with everything pushed
+	u64 word_ready[NSPI_FIFO_WORDS]; // read phase, per FIFO slot arrival times
+	u64 word_read[NSPI_FIFO_WORDS];  // read phase, per FIFO slot drain times
+
+	HostBusStats stats;
+} SimBus;
+
+static SimBus buses[3] = {
+	{ .lock = PTHREAD_MUTEX_INITIALIZER },
+	{ .lock = PTHREAD_MUTEX_INITIALIZER },
+	{ .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static pthread_mutex_t cfg_lock = PTHREAD_MUTEX_INITIALIZER;
+static u16 cfg11_spi_cnt;
+static u16 cfg11_socinfo;
+
+void HostHW_Attach(u8 deviceid, HostDevice* dev) {
+	if (deviceid > 6)
+		return;
+	int bus = deviceid <= 2 ? 0 : deviceid <= 5 ? 1 : 2;
+	buses[bus].devices[deviceid % 3] = dev;
+}
+
+void HostHW_SetN3DS(bool n3ds) {
+	cfg11_socinfo = n3ds ? BIT(2) : 0;
+}
+
+void HostHW_Wedge(int bus) {
+	pthread_mutex_lock(&buses[bus].lock);
+	buses[bus].wedged = true;
+	pthread_mutex_unlock(&buses[bus].lock);
+}
+
+void HostHW_GetBusStats(int bus, HostBusStats* out) {
+	pthread_mutex_lock(&buses[bus].lock);
+	*out = buses[bus].stats;
+	pthread_mutex_unlock(&buses[bus].lock);
+}
+
+static u64 legacy_byte_ns(u16 cnt) {
+	static const u64 ns[4] = { 2000, 4000, 8000, 15625 }; // 4MHz, 2MHz, 1MHz, 512KHz
+	return ns[cnt & SPI_CNT_RATE_MASK];
+}
+
+static u64 nspi_byte_ns(u32 cnt) {
+	static const u64 ns[8] = { 15625, 8000, 4000, 2000, 1000, 500, 500, 500 }; // 512KHz up to 16MHz
+	return ns[cnt & NSPI_CNT_RATE_MASK];
+}
+
+static bool bus_is_nspi(int bus) {
+	return (cfg11_spi_cnt & BIT(bus)) != 0;
+}
+
+static void bus_select(SimBus* b, u32 cs) {
+	HostDevice* dev = b->devices[cs % 3];
+	if (b->selected == dev)
+		return;
+	if (b->selected && b->selected->deselect)
+		b->selected->deselect(b->selected);
+	b->selected = dev;
+	b->owner = pthread_self();
+	++b->stats.transactions;
+	if (dev && dev->select)
+		dev->select(dev);
+}
+
+static void bus_deselect(SimBus* b) {
+	if (b->selected && b->selected->deselect)
+		b->selected->deselect(b->selected);
+	b->selected = NULL;
+}
+
+static u8 bus_xfer(SimBus* b, u8 out) {
+	if (!b->selected)
+		return 0xFF; // nothing driving MISO
+	return b->selected->xfer(b->selected, out);
+}
+
+static void bus_touch(SimBus* b) {
+	if (b->selected && !pthread_equal(b->owner, pthread_self()))
+		++b->stats.collisions;
+}
+
+static u32 legacy_read(int bus, SimBus* b, u32 off, u64 now) {
+	if (bus_is_nspi(bus))
+		++b->stats.violations;
+
+	if (off == 0)
+		return b->cnt | (b->wedged || now < b->busy_until ? SPI_CNT_BUSY : 0);
+	if (off == 2) {
+		if (now < b->busy_until)
+			++b->stats.violations;
+		return b->data;
+	}
+	return 0;
+}
+
+static void legacy_write(int bus, SimBus* b, u32 off, u32 val, u64 now) {
+	if (bus_is_nspi(bus))
+		++b->stats.violations;
+
+	if (off == 0) {
+		b->cnt = val & ~SPI_CNT_BUSY;
+		if (!(val & SPI_CNT_ENABLE)) {
+			// disabled, chip select drops and whatever was stuck is dropped with it
+			if (b->wedged)
+				++b->stats.resets;
+			b->wedged = false;
+			bus_deselect(b);
+		}
+		return;
+	}
+	if (off != 2)
+		return;
+
+	if (!(b->cnt & SPI_CNT_ENABLE) || now < b->busy_until) {
+		++b->stats.violations;
+		return;
+	}
+
+	bus_select(b, (b->cnt >> 8) & 3);
+	b->data = bus_xfer(b, val);
+
+	u64 byte_ns = legacy_byte_ns(b->cnt);
+	b->busy_until = now + byte_ns;
+	b->stats.busy_ns += byte_ns;
+
+	if (!(b->cnt & SPI_CNT_SELECTHOLD))
+		bus_deselect(b);
+}
+
+// word w of a read phase arrives once the wire clocked it, right after word w - 1, and the FIFO had room for it
+static u64 nspi_word_arrival(SimBus* b, u32 w, u64 prev) {
+	u64 byte_ns = nspi_byte_ns(b->ncnt);
+	u64 room = w >= NSPI_FIFO_WORDS ? b->word_read[w % NSPI_FIFO_WORDS] : 0;
+	u64 start = prev > room ? prev : room;
+	return start + 4 * byte_ns;
+}
+
+static u32 nspi_blk_end(SimBus* b) {
+	// readiness is reported for the 32 byte block the cursor is in
+	u32 end = (b->moved & ~(NSPI_FIFO_WORDS * 4 - 1)) + NSPI_FIFO_WORDS * 4;
+	return end < b->phase_len ? end : b->phase_len;
+}
+
+static u32 nspi_read(int bus, SimBus* b, u32 off, u64 now) {
+	if (!bus_is_nspi(bus))
+		++b->stats.violations;
+
+	bool writing = (b->ncnt & NSPI_CNT_WRITE) != 0;
+	bool active = (b->ncnt & NSPI_CNT_BUSY) != 0;
+
+	switch (off) {
+	case 0x0: {
+			bool busy = b->wedged;
+			if (active) {
+				if (writing)
+					busy = b->moved < b->phase_len || now < b->wire_time;
+				else
+					busy = b->moved < b->phase_len;
+			}
+			return (b->ncnt & ~NSPI_CNT_BUSY) | (busy ? NSPI_CNT_BUSY : 0);
+		}
+	case 0x8:
+		return b->blklen;
+	case 0xC: {
+			if (!active || writing || b->moved >= b->phase_len) {
+				++b->stats.violations;
+				return 0;
+			}
+			u32 w = b->moved / 4;
+			u64 ready = nspi_word_arrival(b, w, w ? b->word_ready[(w - 1) % NSPI_FIFO_WORDS] : b->wire_time);
+			b->word_ready[w % NSPI_FIFO_WORDS] = ready;
+			if (now < ready)
+				++b->stats.violations; // popped before it arrived
+			b->word_read[w % NSPI_FIFO_WORDS] = now > ready ? now : ready;
+
+			u32 word = 0;
+			u32 n = b->phase_len - b->moved < 4 ? b->phase_len - b->moved : 4;
+			for (u32 i = 0; i < n; ++i)
+				word |= (u32)bus_xfer(b, 0) << (i * 8);
+			b->moved += n;
+			b->stats.busy_ns += n * nspi_byte_ns(b->ncnt);
+			return word;
+		}
+	case 0x10: {
+			if (b->wedged)
+				return NSPI_STATUS_FIFO_BUSY;
+			if (!active)
+				return 0;
+			if (writing)
+				return now < b->wire_time ? NSPI_STATUS_FIFO_BUSY : 0;
+			// block is ready once its last word arrived
+			// only popped words get their arrival stored, the ring slots of the rest are still in use
+			u32 first = b->moved / 4;
+			u32 last = (nspi_blk_end(b) - 1) / 4;
+			u64 ready = first ? b->word_ready[(first - 1) % NSPI_FIFO_WORDS] : b->wire_time;
+			for (u32 w = first; w <= last; ++w)
+				ready = nspi_word_arrival(b, w, ready);
+			return now < ready ? NSPI_STATUS_FIFO_BUSY : 0;
+		}
+	default:
+		return 0;
+	}
+}
+
+static void nspi_write(int bus, SimBus* b, u32 off, u32 val, u64 now) {
+	if (!bus_is_nspi(bus))
+		++b->stats.violations;
+
+	switch (off) {
+	case 0x0:
+		if ((val & NSPI_CNT_BUSY) && (b->ncnt & NSPI_CNT_BUSY) && b->moved < b->phase_len)
+			++b->stats.violations; // restarted with a phase still going
+		b->ncnt = val;
+		if (!(val & NSPI_CNT_BUSY)) {
+			// disabled, same as the legacy side
+			if (b->wedged)
+				++b->stats.resets;
+			b->wedged = false;
+			b->phase_len = b->moved;
+			bus_deselect(b);
+		} else {
+			bus_select(b, (val >> 6) & 3);
+			b->phase_len = b->blklen;
+			b->moved = 0;
+			if (b->wire_time < now)
+				b->wire_time = now;
+		}
+		break;
+	case 0x4: // DONE, ends the chip select window
+		b->ncnt &= ~NSPI_CNT_BUSY;
+		bus_deselect(b);
+		break;
+	case 0x8:
+		b->blklen = val;
+		break;
+	case 0xC: {
+			if (!(b->ncnt & NSPI_CNT_BUSY) || !(b->ncnt & NSPI_CNT_WRITE) || b->moved >= b->phase_len) {
+				++b->stats.violations;
+				break;
+			}
+			u32 n = b->phase_len - b->moved < 4 ? b->phase_len - b->moved : 4;
+			for (u32 i = 0; i < n; ++i)
+				bus_xfer(b, val >> (i * 8));
+			b->moved += n;
+
+			u64 byte_ns = nspi_byte_ns(b->ncnt);
+			b->wire_time = (b->wire_time > now ? b->wire_time : now) + n * byte_ns;
+			b->stats.busy_ns += n * byte_ns;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+u32 HostHW_Read(uptr addr, u32 size) {
+	(void)size;
+
+	if (addr == CFG11_SPI_CNT_ADDR) {
+		pthread_mutex_lock(&cfg_lock);
+		u16 v = cfg11_spi_cnt;
+		pthread_mutex_unlock(&cfg_lock);
+		return v;
+	}
+	if (addr == CFG11_SOCINFO_ADDR)
+		return cfg11_socinfo;
+
+	for (int i = 0; i < 3; ++i) {
+		if (addr < bus_base[i] || addr >= bus_base[i] + 0x1000)
+			continue;
+
+		SimBus* b = &buses[i];
+		u64 now = HostKernel_Now();
+		u32 off = addr - bus_base[i];
+		u32 v;
+
+		pthread_mutex_lock(&b->lock);
+		++b->stats.mmio_reads;
+		bus_touch(b);
+		if (off < 0x800)
+			v = legacy_read(i, b, off, now);
+		else
+			v = nspi_read(i, b, off - 0x800, now);
+		pthread_mutex_unlock(&b->lock);
+		return v;
+	}
+
+	fprintf(stderr, "hostsim: read from unmapped register %08lX\n", (unsigned long)addr);
+	abort();
+}
+
+void HostHW_Write(uptr addr, u32 size, u32 val) {
+	(void)size;
+
+	if (addr == CFG11_SPI_CNT_ADDR) {
+		pthread_mutex_lock(&cfg_lock);
+		cfg11_spi_cnt = val & 0x7;
+		pthread_mutex_unlock(&cfg_lock);
+		return;
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		if (addr < bus_base[i] || addr >= bus_base[i] + 0x1000)
+			continue;
+
+		SimBus* b = &buses[i];
+		u64 now = HostKernel_Now();
+		u32 off = addr - bus_base[i];
+
+		pthread_mutex_lock(&b->lock);
+		++b->stats.mmio_writes;
+		bus_touch(b);
+		if (off < 0x800)
+			legacy_write(i, b, off, val, now);
+		else
+			nspi_write(i, b, off - 0x800, val, now);
+		pthread_mutex_unlock(&b->lock);
+		return;
+	}
+
+	fprintf(stderr, "hostsim: write to unmapped register %08lX\n", (unsigned long)addr);
+	abort();
+}
@@ -0,0 +1,18 @@
+/**
+ * @file 3ds.h
+ * @brief Host stand-in for libctru's umbrella header, what the client library takes from it
+ */
+#pragma once
+
+#include <3ds/types.h>
+#include <3ds/result.h>
+#include <3ds/svc.h>
+#include <3ds/srv.h>
+#include <3ds/ipc.h>
+
+/**
+ * @brief Retrieves a service handle, client side, backed by tools/hostsim/kernel.c
+ * @param out Pointer to write the handle to.
+ * @param name Name of the service.
+ */
+Result srvGetServiceHandle(Handle* out, const char* name);
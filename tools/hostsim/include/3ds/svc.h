@@ -0,0 +1,82 @@
+/**
+ * @file svc.h
+ * @brief Host stand-in for the syscall wrappers, backed by tools/hostsim/kernel.c
+ */
+#pragma once
+
+#include <3ds/types.h>
+
+/// Arbitration modes.
+typedef enum {
+	ARBITRATION_SIGNAL                                  = 0, ///< Signal #value threads for wake-up.
+	ARBITRATION_WAIT_IF_LESS_THAN                       = 1, ///< If the memory at the address is strictly lower than #value, then wait for signal.
+	ARBITRATION_DECREMENT_AND_WAIT_IF_LESS_THAN         = 2, ///< If the memory at the address is strictly lower than #value, then decrement it and wait for signal.
+	ARBITRATION_WAIT_IF_LESS_THAN_TIMEOUT               = 3, ///< If the memory at the address is strictly lower than #value, then wait for signal or timeout.
+	ARBITRATION_DECREMENT_AND_WAIT_IF_LESS_THAN_TIMEOUT = 4, ///< If the memory at the address is strictly lower than #value, then decrement it and wait for signal or timeout.
+} ArbitrationType;
+
+/// Memory permission flags
+typedef enum {
+	MEMPERM_READ      = BIT(0),                        ///< Readable
+	MEMPERM_WRITE     = BIT(1),                        ///< Writable
+	MEMPERM_EXECUTE   = BIT(2),                        ///< Executable
+	MEMPERM_READWRITE = MEMPERM_READ | MEMPERM_WRITE,  ///< Readable and writable
+	MEMPERM_DONTCARE  = 0x10000000,                    ///< Don't care
+} MemPerm;
+
+/// Reset types (for use with events and timers)
+typedef enum {
+	RESET_ONESHOT = 0, ///< When the primitive is signaled, it will wake up exactly one thread and will clear itself automatically.
+	RESET_STICKY  = 1, ///< When the primitive is signaled, it will wake up all threads and it won't clear itself automatically.
+	RESET_PULSE   = 2, ///< Only meaningful for timers: same as ONESHOT but it will periodically signal the timer instead of just once.
+} ResetType;
+
+/// Memory information.
+typedef struct {
+	u32 base_addr; ///< Base address.
+	u32 size;      ///< Size.
+	u32 perm;      ///< Memory permissions. See @ref MemPerm
+	u32 state;     ///< Memory state.
+} MemInfo;
+
+/// Memory page information.
+typedef struct {
+	u32 flags; ///< Page flags.
+} PageInfo;
+
+/// Reasons for a user break.
+typedef enum {
+	USERBREAK_PANIC         = 0, ///< Panic.
+	USERBREAK_ASSERT        = 1, ///< Assertion failed.
+	USERBREAK_USER          = 2, ///< User related.
+	USERBREAK_LOAD_RO       = 3, ///< Load RO.
+	USERBREAK_UNLOAD_RO     = 4, ///< Unload RO.
+} UserBreakType;
+
+void* getThreadLocalStorage(void);
+u32* getThreadCommandBuffer(void);
+u32* getThreadStaticBuffers(void);
+
+Result svcGetProcessId(u32 *out, Handle handle);
+Result svcCreateThread(Handle* thread, ThreadFunc entrypoint, u32 arg, u32* stack_top, s32 thread_priority, s32 processor_id);
+void svcSleepThread(s64 ns);
+Result svcWaitSynchronization(Handle handle, s64 nanoseconds);
+Result svcWaitSynchronizationN(s32* out, const Handle* handles, s32 handles_num, bool wait_all, s64 nanoseconds);
+Result svcCreateEvent(Handle* event, ResetType reset_type);
+Result svcSignalEvent(Handle handle);
+Result svcClearEvent(Handle handle);
+Result svcCreateMemoryBlock(Handle* memblock, u32 addr, u32 size, MemPerm my_perm, MemPerm other_perm);
+Result svcMapMemoryBlock(Handle memblock, u32 addr, MemPerm my_perm, MemPerm other_perm);
+Result svcUnmapMemoryBlock(Handle memblock, u32 addr);
+Result svcQueryMemory(MemInfo* info, PageInfo* out, u32 addr);
+Result svcCreateAddressArbiter(Handle *arbiter);
+Result svcArbitrateAddress(Handle arbiter, u32 addr, ArbitrationType type, s32 value, s64 timeout_ns);
+Result svcSendSyncRequest(Handle session);
+Result svcAcceptSession(Handle* session, Handle port);
+Result svcReplyAndReceive(s32* index, const Handle* handles, s32 handleCount, Handle replyTarget);
+Result svcCloseHandle(Handle handle);
+u64 svcGetSystemTick(void);
+void svcBreak(UserBreakType breakReason) __attribute__((noreturn));
+
+/// Stop point, does nothing if the process is not attached (as opposed to 'bkpt' instructions)
+#define SVC_STOP_POINT
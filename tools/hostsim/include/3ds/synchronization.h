@@ -0,0 +1,71 @@
+/**
+ * @file synchronization.h
+ * @brief Host stand-in for the synchronization primitives.
+ *
+ * ldrex/strex are emulated with a per thread reservation and a compare and swap,
+ * so source/3ds/synchronization.c builds and behaves unmodified on the host.
+ */
+#pragma once
+#include <3ds/svc.h>
+
+/// A light lock.
+typedef s32 LightLock;
+
+extern __thread s32* __hostsim_excl_addr;
+extern __thread s32 __hostsim_excl_val;
+
+/// Performs a Data Synchronization Barrier operation.
+static inline void __dsb(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/// Performs a Data Memory Barrier operation.
+static inline void __dmb(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/// Performs a clrex operation.
+static inline void __clrex(void)
+{
+	__hostsim_excl_addr = NULL;
+}
+
+/**
+ * @brief Performs a ldrex operation.
+ * @param addr Address to perform the operation on.
+ * @return The resulting value.
+ */
+static inline s32 __ldrex(s32* addr)
+{
+	s32 val = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+	__hostsim_excl_addr = addr;
+	__hostsim_excl_val = val;
+	return val;
+}
+
+/**
+ * @brief Performs a strex operation.
+ * @param addr Address to perform the operation on.
+ * @param val Value to store.
+ * @return Whether the operation was successful.
+ */
+static inline bool __strex(s32* addr, s32 val)
+{
+	s32 expected = __hostsim_excl_val;
+	if (__hostsim_excl_addr != addr)
+		return true;
+	__hostsim_excl_addr = NULL;
+	return !__atomic_compare_exchange_n(addr, &expected, val, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+Result syncArbitrateAddress(s32* addr, ArbitrationType type, s32 value);
+
+void LightLock_Init(LightLock* lock);
+
+void LightLock_Lock(LightLock* lock);
+
+void LightLock_Unlock(LightLock* lock);
+
+#define LIGHTLOCK_STATICINIT ((LightLock)1)
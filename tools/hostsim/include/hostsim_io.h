@@ -0,0 +1,15 @@
+// Force included into every host build of source/spi.c
+// Register accesses become calls into the simulated controllers, the address is only used as a key
+#pragma once
+#include <3ds/types.h>
+
+u32 HostHW_Read(uptr addr, u32 size);
+void HostHW_Write(uptr addr, u32 size, u32 val);
+
+#define MMIO_READ(reg)       ((__typeof__(reg))HostHW_Read((uptr)&(reg), sizeof(reg)))
+#define MMIO_WRITE(reg, val) HostHW_Write((uptr)&(reg), sizeof(reg), (val))
+
+// host lines, so the per bus blocks keep apart the way they would on the console
+#ifndef SPI_CACHE_LINE
+#define SPI_CACHE_LINE 64
+#endif
@@ -0,0 +1,896 @@
+// Just enough of Horizon to run the spi module as a host process
+// One global lock and condition guard every kernel object, this is a simulator not a kernel
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <3ds/types.h>
+#include <3ds/result.h>
+#include <3ds/svc.h>
+#include <3ds/srv.h>
+#include <3ds/errf.h>
+#include "hostsim.h"
+
+#define OS_REMOTE_SESSION_CLOSED MAKERESULT(RL_STATUS,    RS_CANCELED,   RM_OS,     26)
+#define KERNEL_INVALID_HANDLE    MAKERESULT(RL_PERMANENT, RS_WRONGARG,   RM_KERNEL, RD_INVALID_HANDLE)
+#define KERNEL_OUT_OF_HANDLES    MAKERESULT(RL_PERMANENT, RS_OUTOFRESOURCE, RM_KERNEL, RD_OUT_OF_MEMORY)
+#define KERNEL_INVALID_ADDRESS   MAKERESULT(RL_PERMANENT, RS_INVALIDARG, RM_KERNEL, RD_INVALID_ADDRESS)
+#define KERNEL_TIMEOUT           ((Result)0x09401BFE)
+#define SRV_NOT_FOUND            MAKERESULT(RL_PERMANENT, RS_NOTFOUND,   RM_SRV,    RD_NOT_FOUND)
+
+#define HOSTSIM_THREAD_STACK     0x40000
+
+typedef enum {
+	KOBJ_EVENT,
+	KOBJ_SEMAPHORE,
+	KOBJ_PORT,
+	KOBJ_SERVER_SESSION,
+	KOBJ_CLIENT_SESSION,
+	KOBJ_THREAD,
+	KOBJ_MEMBLOCK,
+	KOBJ_ARBITER,
+} KObjectType;
+
+typedef struct Request {
+	u32 cmdbuf[64];
+	bool done;
+	struct Request* next;
+} Request;
+
+typedef struct {
+	int refs;
+	Request* head;
+	Request* tail;
+	Request* current; // received, reply pending
+	bool client_closed;
+	bool server_closed;
+} KSession;
+
+typedef struct KObject {
+	KObjectType type;
+	int refs;
+	union {
+		struct { bool signaled; ResetType reset; } event;
+		struct { s32 count; } sem;
+		struct { char name[9]; struct KObject* pending[8]; int npending; bool registered; } port;
+		KSession* session;
+		struct { ThreadFunc fn; void* arg; bool exited; } thread;
+		struct { int fd; u32 size; void* view; } block;
+	};
+} KObject;
+
+static pthread_mutex_t klock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kcond;
+
+#define MAX_HANDLES 1024
+#define HANDLE_BASE 0x100
+static KObject* handles[MAX_HANDLES];
+
+__thread s32* __hostsim_excl_addr;
+__thread s32 __hostsim_excl_val;
+
+static __thread u32 tls_area[0x200 / 4] __attribute__((aligned(8)));
+
+__attribute__((constructor)) static void kernel_init(void) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&kcond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+u64 HostKernel_Now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+}
+
+void* HostKernel_Alloc32(size_t size) {
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("hostsim: mmap");
+		abort();
+	}
+	return p;
+}
+
+// shared allocations are remembered so svcCreateMemoryBlock can find their backing fd
+static struct { void* addr; int fd; u32 size; } shared_allocs[32];
+
+void* HostKernel_AllocShared(size_t size) {
+	int fd = memfd_create("hostsim-block", 0);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		perror("hostsim: memfd");
+		abort();
+	}
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_32BIT, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("hostsim: mmap");
+		abort();
+	}
+	pthread_mutex_lock(&klock);
+	for (size_t i = 0; i < sizeof(shared_allocs) / sizeof(shared_allocs[0]); ++i) {
+		if (!shared_allocs[i].addr) {
+			shared_allocs[i].addr = p;
+			shared_allocs[i].fd = fd;
+			shared_allocs[i].size = size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&klock);
+	return p;
+}
+
+static void kfail(const char* what) {
+	fprintf(stderr, "hostsim: %s\n", what);
+	abort();
+}
+
+static KObject* kobj_new(KObjectType type) {
+	KObject* obj = calloc(1, sizeof(KObject));
+	if (!obj)
+		kfail("out of memory");
+	obj->type = type;
+	return obj;
+}
+
+// klock held for the handle table helpers
+
+static Result handle_alloc(Handle* out, KObject* obj) {
+	for (int i = 0; i < MAX_HANDLES; ++i) {
+		if (!handles[i]) {
+			handles[i] = obj;
+			++obj->refs;
+			*out = HANDLE_BASE + i;
+			return 0;
+		}
+	}
+	return KERNEL_OUT_OF_HANDLES;
+}
+
+static KObject* handle_get(Handle handle) {
+	if (handle < HANDLE_BASE || handle >= HANDLE_BASE + MAX_HANDLES)
+		return NULL;
+	return handles[handle - HANDLE_BASE];
+}
+
+static void session_put(KSession* session) {
+	if (--session->refs == 0)
+		free(session);
+}
+
+static void kobj_put(KObject* obj) {
+	if (--obj->refs)
+		return;
+
+	switch (obj->type) {
+	case KOBJ_SERVER_SESSION:
+		obj->session->server_closed = true;
+		session_put(obj->session);
+		break;
+	case KOBJ_CLIENT_SESSION:
+		obj->session->client_closed = true;
+		session_put(obj->session);
+		break;
+	case KOBJ_PORT:
+		for (int i = 0; i < obj->port.npending; ++i)
+			kobj_put(obj->port.pending[i]);
+		break;
+	case KOBJ_MEMBLOCK:
+		break; // backing memory belongs to whoever allocated it
+	default:
+		break;
+	}
+	pthread_cond_broadcast(&kcond);
+	free(obj);
+}
+
+static void deadline_from_ns(struct timespec* ts, s64 ns) {
+	u64 when = HostKernel_Now() + (u64)ns;
+	ts->tv_sec = when / 1000000000ULL;
+	ts->tv_nsec = when % 1000000000ULL;
+}
+
+// false on timeout
+static bool kwait(const struct timespec* deadline) {
+	if (!deadline) {
+		pthread_cond_wait(&kcond, &klock);
+		return true;
+	}
+	return pthread_cond_timedwait(&kcond, &klock, deadline) != ETIMEDOUT;
+}
+
+// also consumes the signal for objects that auto clear
+static bool kobj_try_acquire(KObject* obj) {
+	switch (obj->type) {
+	case KOBJ_EVENT:
+		if (!obj->event.signaled)
+			return false;
+		if (obj->event.reset == RESET_ONESHOT)
+			obj->event.signaled = false;
+		return true;
+	case KOBJ_SEMAPHORE:
+		if (obj->sem.count <= 0)
+			return false;
+		--obj->sem.count;
+		return true;
+	case KOBJ_PORT:
+		return obj->port.npending > 0;
+	case KOBJ_SERVER_SESSION:
+		return obj->session->head || obj->session->client_closed;
+	case KOBJ_THREAD:
+		return obj->thread.exited;
+	default:
+		return false;
+	}
+}
+
+void* getThreadLocalStorage(void) {
+	return tls_area;
+}
+
+u32* getThreadCommandBuffer(void) {
+	return &tls_area[0x80 / 4];
+}
+
+u32* getThreadStaticBuffers(void) {
+	return &tls_area[0x180 / 4];
+}
+
+Result svcGetProcessId(u32 *out, Handle handle) {
+	(void)handle;
+	*out = 1;
+	return 0;
+}
+
+void _thread_start(void* arg) {
+	(void)arg; // never runs, svcCreateThread unpacks the stack the way the asm one would
+}
+
+uptr _thread_stack_sp_top_offset;
+static u8 main_stack[0x1000] __attribute__((aligned(8)));
+
+__attribute__((constructor)) static void stack_init(void) {
+	// SPIMain carves the service thread stacks right below this
+	_thread_stack_sp_top_offset = (uptr)&main_stack[sizeof(main_stack)];
+}
+
+u64 _start_tick;
+
+void* __bss_start__;
+void* __bss_end__;
+
+// time module threads spent asleep, core time a real console would have had for other threads
+static __thread bool module_thread;
+static u64 module_slept_ns;
+
+u64 HostKernel_ModuleSleptNs(void) {
+	return __atomic_load_n(&module_slept_ns, __ATOMIC_RELAXED);
+}
+
+static void* thread_trampoline(void* _obj) {
+	KObject* obj = _obj;
+
+	module_thread = true;
+	prctl(PR_SET_TIMERSLACK, 1UL); // Horizon doesn't batch timers, the default 50us slack would swamp short sleeps
+
+	obj->thread.fn(obj->thread.arg);
+
+	pthread_mutex_lock(&klock);
+	obj->thread.exited = true;
+	pthread_cond_broadcast(&kcond);
+	kobj_put(obj);
+	pthread_mutex_unlock(&klock);
+	return NULL;
+}
+
+Result svcCreateThread(Handle* thread, ThreadFunc entrypoint, u32 arg, u32* stack_top, s32 thread_priority, s32 processor_id) {
+	(void)thread_priority;
+	(void)processor_id;
+
+	KObject* obj = kobj_new(KOBJ_THREAD);
+	if (entrypoint == _thread_start) {
+		// only 32 bits were stored, fine for a non PIE build
+		obj->thread.fn = (ThreadFunc)(uptr)stack_top[-1];
+		obj->thread.arg = (void*)(uptr)stack_top[-2];
+	} else {
+		obj->thread.fn = entrypoint;
+		obj->thread.arg = (void*)(uptr)arg;
+	}
+
+	pthread_mutex_lock(&klock);
+	Result res = handle_alloc(thread, obj);
+	if (R_SUCCEEDED(res))
+		++obj->refs; // the thread's own reference
+	pthread_mutex_unlock(&klock);
+
+	if (R_FAILED(res)) {
+		free(obj);
+		return res;
+	}
+
+	// the module arbitrates on stack variables, and addresses go through the arbiter as 32 bits
+	// only a handful of threads ever get created, so their stacks are never given back
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, HostKernel_Alloc32(HOSTSIM_THREAD_STACK), HOSTSIM_THREAD_STACK);
+
+	pthread_t pt;
+	if (pthread_create(&pt, &attr, thread_trampoline, obj))
+		kfail("pthread_create failed");
+	pthread_attr_destroy(&attr);
+	pthread_detach(pt);
+	return 0;
+}
+
+void svcSleepThread(s64 ns) {
+	if (ns <= 0) {
+		sched_yield();
+		return;
+	}
+	u64 start = HostKernel_Now();
+	struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+	while (nanosleep(&ts, &ts) && errno == EINTR);
+	if (module_thread)
+		__atomic_add_fetch(&module_slept_ns, HostKernel_Now() - start, __ATOMIC_RELAXED);
+}
+
+Result svcWaitSynchronizationN(s32* out, const Handle* handles_in, s32 handles_num, bool wait_all, s64 nanoseconds) {
+	struct timespec deadline;
+	struct timespec* pdeadline = NULL;
+	if (nanoseconds >= 0 && (u64)nanoseconds != U64_MAX) {
+		deadline_from_ns(&deadline, nanoseconds);
+		pdeadline = &deadline;
+	}
+
+	if (wait_all)
+		kfail("wait_all is not simulated");
+
+	pthread_mutex_lock(&klock);
+	for (;;) {
+		for (s32 i = 0; i < handles_num; ++i) {
+			KObject* obj = handle_get(handles_in[i]);
+			if (!obj) {
+				pthread_mutex_unlock(&klock);
+				return KERNEL_INVALID_HANDLE;
+			}
+			if (kobj_try_acquire(obj)) {
+				*out = i;
+				pthread_mutex_unlock(&klock);
+				return 0;
+			}
+		}
+		if (!kwait(pdeadline)) {
+			pthread_mutex_unlock(&klock);
+			return KERNEL_TIMEOUT;
+		}
+	}
+}
+
+Result svcWaitSynchronization(Handle handle, s64 nanoseconds) {
+	s32 index;
+	return svcWaitSynchronizationN(&index, &handle, 1, false, nanoseconds);
+}
+
+Result svcCreateEvent(Handle* event, ResetType reset_type) {
+	KObject* obj = kobj_new(KOBJ_EVENT);
+	obj->event.reset = reset_type;
+
+	pthread_mutex_lock(&klock);
+	Result res = handle_alloc(event, obj);
+	pthread_mutex_unlock(&klock);
+
+	if (R_FAILED(res))
+		free(obj);
+	return res;
+}
+
+static Result event_set(Handle handle, bool signaled) {
+	pthread_mutex_lock(&klock);
+	KObject* obj = handle_get(handle);
+	if (!obj || obj->type != KOBJ_EVENT) {
+		pthread_mutex_unlock(&klock);
+		return KERNEL_INVALID_HANDLE;
+	}
+	obj->event.signaled = signaled;
+	pthread_cond_broadcast(&kcond);
+	pthread_mutex_unlock(&klock);
+	return 0;
+}
+
+Result svcSignalEvent(Handle handle) {
+	return event_set(handle, true);
+}
+
+Result svcClearEvent(Handle handle) {
+	return event_set(handle, false);
+}
+
+Result svcCreateMemoryBlock(Handle* memblock, u32 addr, u32 size, MemPerm my_perm, MemPerm other_perm) {
+	(void)my_perm;
+	(void)other_perm;
+
+	pthread_mutex_lock(&klock);
+	int fd = -1;
+	for (size_t i = 0; i < sizeof(shared_allocs) / sizeof(shared_allocs[0]); ++i) {
+		if ((uptr)shared_allocs[i].addr == addr && shared_allocs[i].size >= size)
+			fd = shared_allocs[i].fd;
+	}
+	if (fd < 0) {
+		pthread_mutex_unlock(&klock);
+		return KERNEL_INVALID_ADDRESS; // has to come from HostKernel_AllocShared
+	}
+
+	KObject* obj = kobj_new(KOBJ_MEMBLOCK);
+	obj->block.fd = fd;
+	obj->block.size = size;
+	Result res = handle_alloc(memblock, obj);
+	pthread_mutex_unlock(&klock);
+
+	if (R_FAILED(res))
+		free(obj);
+	return res;
+}
+
+// what svcQueryMemory reports, only block mappings are tracked
+static struct { u32 addr; u32 size; } mappings[16];
+
+Result svcMapMemoryBlock(Handle memblock, u32 addr, MemPerm my_perm, MemPerm other_perm) {
+	(void)my_perm;
+	(void)other_perm;
+
+	pthread_mutex_lock(&klock);
+	KObject* obj = handle_get(memblock);
+	if (!obj || obj->type != KOBJ_MEMBLOCK) {
+		pthread_mutex_unlock(&klock);
+		return KERNEL_INVALID_HANDLE;
+	}
+	void* p = mmap((void*)(uptr)addr, obj->block.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, obj->block.fd, 0);
+	if (p != MAP_FAILED && p == (void*)(uptr)addr) {
+		for (size_t i = 0; i < sizeof(mappings) / sizeof(mappings[0]); ++i) {
+			if (!mappings[i].size) {
+				mappings[i].addr = addr;
+				mappings[i].size = obj->block.size;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&klock);
+
+	if (p == MAP_FAILED || p != (void*)(uptr)addr)
+		return KERNEL_INVALID_ADDRESS;
+	return 0;
+}
+
+Result svcUnmapMemoryBlock(Handle memblock, u32 addr) {
+	pthread_mutex_lock(&klock);
+	KObject* obj = handle_get(memblock);
+	if (!obj || obj->type != KOBJ_MEMBLOCK) {
+		pthread_mutex_unlock(&klock);
+		return KERNEL_INVALID_HANDLE;
+	}
+	munmap((void*)(uptr)addr, obj->block.size);
+	for (size_t i = 0; i < sizeof(mappings) / sizeof(mappings[0]); ++i)
+		if (mappings[i].addr == addr)
+			mappings[i].size = 0;
+	pthread_mutex_unlock(&klock);
+	return 0;
+}
+
+Result svcQueryMemory(MemInfo* info, PageInfo* out, u32 addr) {
+	pthread_mutex_lock(&klock);
+	info->base_addr = addr & ~0xFFF;
+	info->size = 0x1000;
+	info->perm = 0;
+	info->state = 0; // free
+	for (size_t i = 0; i < sizeof(mappings) / sizeof(mappings[0]); ++i) {
+		if (mappings[i].size && addr - mappings[i].addr < mappings[i].size) {
+			info->base_addr = mappings[i].addr;
+			info->size = (mappings[i].size + 0xFFF) & ~0xFFF;
+			info->perm = MEMPERM_READWRITE;
+			info->state = 6; // shared
+		}
+	}
+	out->flags = 0;
+	pthread_mutex_unlock(&klock);
+	return 0;
+}
+
+Result svcCreateAddressArbiter(Handle *arbiter) {
+	KObject* obj = kobj_new(KOBJ_ARBITER);
+
+	pthread_mutex_lock(&klock);
+	Result res = handle_alloc(arbiter, obj);
+	pthread_mutex_unlock(&klock);
+
+	if (R_FAILED(res))
+		free(obj);
+	return res;
+}
+
+// The arbiter maps onto futexes, a wait can return early when the value moved under it
+// which every caller in the module already tolerates by rechecking
+Result svcArbitrateAddress(Handle arbiter, u32 addr, ArbitrationType type, s32 value, s64 timeout_ns) {
+	(void)arbiter;
+	s32* p = (s32*)(uptr)addr; // arbitrated words live in static data, below 4GiB in a non PIE build
+	struct timespec ts;
+	struct timespec* pts = NULL;
+
+	switch (type) {
+	case ARBITRATION_SIGNAL:
+		syscall(SYS_futex, p, FUTEX_WAKE_PRIVATE, value < 0 ? INT_MAX : value, NULL, NULL, 0);
+		return 0;
+	case ARBITRATION_WAIT_IF_LESS_THAN_TIMEOUT:
+	case ARBITRATION_DECREMENT_AND_WAIT_IF_LESS_THAN_TIMEOUT:
+		ts.tv_sec = timeout_ns / 1000000000LL;
+		ts.tv_nsec = timeout_ns % 1000000000LL;
+		pts = &ts;
+		break;
+	default:
+		break;
+	}
+
+	s32 cur = __atomic_load_n(p, __ATOMIC_SEQ_CST);
+	if (cur >= value)
+		return 0;
+
+	if (type == ARBITRATION_DECREMENT_AND_WAIT_IF_LESS_THAN || type == ARBITRATION_DECREMENT_AND_WAIT_IF_LESS_THAN_TIMEOUT) {
+		if (!__atomic_compare_exchange_n(p, &cur, cur - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return 0;
+		--cur;
+	}
+
+	if (syscall(SYS_futex, p, FUTEX_WAIT_PRIVATE, cur, pts, NULL, 0) < 0 && errno == ETIMEDOUT)
+		return KERNEL_TIMEOUT;
+	return 0;
+}
+
+// client -> server copy, duplicating shared handles the way the kernel would
+static void translate_request(u32* dst, const u32* src) {
+	u32 header = src[0];
+	u32 normal = (header >> 6) & 0x3F;
+	u32 translate = header & 0x3F;
+	u32 i;
+
+	for (i = 0; i <= normal; ++i)
+		dst[i] = src[i];
+
+	u32 end = normal + 1 + translate;
+	while (i < end && i < 64) {
+		u32 desc = src[i];
+		dst[i++] = desc;
+
+		if ((desc & 0xF) != 0) { // buffers, static buffers, pxi, one pointer word each
+			dst[i] = src[i];
+			++i;
+			continue;
+		}
+
+		u32 count = (desc >> 26) + 1;
+		for (u32 j = 0; j < count && i < 64; ++j, ++i) {
+			if (desc & 0x20) {
+				dst[i] = 1; // process id
+			} else if (desc & 0x10) {
+				dst[i] = src[i]; // moved, same table anyway
+			} else {
+				KObject* obj = handle_get(src[i]);
+				Handle dup = 0;
+				if (obj)
+					handle_alloc(&dup, obj);
+				dst[i] = dup;
+			}
+		}
+	}
+}
+
+Result svcSendSyncRequest(Handle session) {
+	Request req;
+	u32* cmdbuf = getThreadCommandBuffer();
+
+	memcpy(req.cmdbuf, cmdbuf, sizeof(req.cmdbuf));
+	req.done = false;
+	req.next = NULL;
+
+	pthread_mutex_lock(&klock);
+	KObject* obj = handle_get(session);
+	if (!obj || obj->type != KOBJ_CLIENT_SESSION) {
+		pthread_mutex_unlock(&klock);
+		return KERNEL_INVALID_HANDLE;
+	}
+
+	KSession* s = obj->session;
+	if (s->server_closed) {
+		pthread_mutex_unlock(&klock);
+		return OS_REMOTE_SESSION_CLOSED;
+	}
+
+	++s->refs;
+	if (s->tail)
+		s->tail->next = &req;
+	else
+		s->head = &req;
+	s->tail = &req;
+	pthread_cond_broadcast(&kcond);
+
+	while (!req.done && !s->server_closed)
+		kwait(NULL);
+
+	Result res = req.done ? 0 : OS_REMOTE_SESSION_CLOSED;
+	if (!req.done) { // unlink if it never got picked up
+		Request** pp = &s->head;
+		s->tail = NULL;
+		while (*pp) {
+			if (*pp == &req)
+				*pp = req.next;
+			else {
+				s->tail = *pp;
+				pp = &(*pp)->next;
+			}
+		}
+		if (s->current == &req)
+			s->current = NULL;
+	}
+	session_put(s);
+	pthread_mutex_unlock(&klock);
+
+	if (req.done)
+		memcpy(cmdbuf, req.cmdbuf, sizeof(req.cmdbuf));
+	return res;
+}
+
+Result svcAcceptSession(Handle* session, Handle port) {
+	pthread_mutex_lock(&klock);
+	KObject* obj = handle_get(port);
+	if (!obj || obj->type != KOBJ_PORT || !obj->port.npending) {
+		pthread_mutex_unlock(&klock);
+		return KERNEL_INVALID_HANDLE;
+	}
+
+	KObject* server = obj->port.pending[0];
+	for (int i = 1; i < obj->port.npending; ++i)
+		obj->port.pending[i - 1] = obj->port.pending[i];
+	--obj->port.npending;
+
+	Result res = handle_alloc(session, server);
+	kobj_put(server); // the port's reference
+	pthread_mutex_unlock(&klock);
+	return res;
+}
+
+Result svcReplyAndReceive(s32* index, const Handle* handles_in, s32 handleCount, Handle replyTarget) {
+	u32* cmdbuf = getThreadCommandBuffer();
+
+	pthread_mutex_lock(&klock);
+
+	if (replyTarget && cmdbuf[0] != 0xFFFF0000) {
+		KObject* obj = handle_get(replyTarget);
+		if (obj && obj->type == KOBJ_SERVER_SESSION && obj->session->current) {
+			Request* req = obj->session->current;
+			memcpy(req->cmdbuf, cmdbuf, sizeof(req->cmdbuf));
+			req->done = true;
+			obj->session->current = NULL;
+			pthread_cond_broadcast(&kcond);
+		}
+	}
+
+	// reply only, like the real kernel with nothing to wait on
+	if (!handleCount) {
+		pthread_mutex_unlock(&klock);
+		return 0;
+	}
+
+	for (;;) {
+		for (s32 i = 0; i < handleCount; ++i) {
+			KObject* obj = handle_get(handles_in[i]);
+			if (!obj) {
+				pthread_mutex_unlock(&klock);
+				return KERNEL_INVALID_HANDLE;
+			}
+
+			if (obj->type != KOBJ_SERVER_SESSION) {
+				if (kobj_try_acquire(obj)) {
+					*index = i;
+					pthread_mutex_unlock(&klock);
+					return 0;
+				}
+				continue;
+			}
+
+			KSession* s = obj->session;
+			if (s->head) {
+				Request* req = s->head;
+				s->head = req->next;
+				if (!s->head)
+					s->tail = NULL;
+				s->current = req;
+				translate_request(cmdbuf, req->cmdbuf);
+				*index = i;
+				pthread_mutex_unlock(&klock);
+				return 0;
+			}
+			if (s->client_closed) {
+				*index = i;
+				pthread_mutex_unlock(&klock);
+				return OS_REMOTE_SESSION_CLOSED;
+			}
+		}
+		kwait(NULL);
+	}
+}
+
+Result svcCloseHandle(Handle handle) {
+	pthread_mutex_lock(&klock);
+	KObject* obj = handle_get(handle);
+	if (!obj) {
+		pthread_mutex_unlock(&klock);
+		return KERNEL_INVALID_HANDLE;
+	}
+	handles[handle - HANDLE_BASE] = NULL;
+	kobj_put(obj);
+	pthread_mutex_unlock(&klock);
+	return 0;
+}
+
+u64 svcGetSystemTick(void) {
+	return (u64)((unsigned __int128)HostKernel_Now() * HOSTSIM_TICKS_PER_SEC / 1000000000ULL);
+}
+
+void svcBreak(UserBreakType breakReason) {
+	fprintf(stderr, "hostsim: svcBreak(%d)\n", breakReason);
+	abort();
+}
+
+// srv:
+
+static KObject* ports[16];
+static KObject* notification_sem;
+static u32 notifications[16];
+static int nnotifications;
+
+Result srvInit(void) {
+	return 0;
+}
+
+void srvExit(void) {
+}
+
+Result srvRegisterClient(void) {
+	return 0;
+}
+
+Result srvEnableNotification(Handle* semaphoreOut) {
+	pthread_mutex_lock(&klock);
+	if (!notification_sem) {
+		notification_sem = kobj_new(KOBJ_SEMAPHORE);
+		++notification_sem->refs;
+	}
+	Result res = handle_alloc(semaphoreOut, notification_sem);
+	pthread_mutex_unlock(&klock);
+	return res;
+}
+
+Result srvRegisterService(Handle* out, const char* name, int maxSessions) {
+	(void)maxSessions;
+
+	KObject* obj = kobj_new(KOBJ_PORT);
+	strncpy(obj->port.name, name, 8);
+	obj->port.registered = true;
+
+	pthread_mutex_lock(&klock);
+	Result res = handle_alloc(out, obj);
+	if (R_SUCCEEDED(res)) {
+		for (size_t i = 0; i < sizeof(ports) / sizeof(ports[0]); ++i) {
+			if (!ports[i]) {
+				ports[i] = obj;
+				++obj->refs;
+				break;
+			}
+		}
+		pthread_cond_broadcast(&kcond);
+	}
+	pthread_mutex_unlock(&klock);
+	return res;
+}
+
+Result srvUnregisterService(const char* name) {
+	pthread_mutex_lock(&klock);
+	for (size_t i = 0; i < sizeof(ports) / sizeof(ports[0]); ++i) {
+		if (ports[i] && !strncmp(ports[i]->port.name, name, 8)) {
+			ports[i]->port.registered = false;
+			kobj_put(ports[i]);
+			ports[i] = NULL;
+			pthread_mutex_unlock(&klock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&klock);
+	return SRV_NOT_FOUND;
+}
+
+Result srvReceiveNotification(u32* notificationIdOut) {
+	pthread_mutex_lock(&klock);
+	u32 id = 0;
+	if (nnotifications) {
+		id = notifications[0];
+		for (int i = 1; i < nnotifications; ++i)
+			notifications[i - 1] = notifications[i];
+		--nnotifications;
+	}
+	pthread_mutex_unlock(&klock);
+	if (notificationIdOut)
+		*notificationIdOut = id;
+	return 0;
+}
+
+void HostSrv_Notify(u32 id) {
+	pthread_mutex_lock(&klock);
+	while (!notification_sem)
+		kwait(NULL);
+	if (nnotifications < 16)
+		notifications[nnotifications++] = id;
+	++notification_sem->sem.count;
+	pthread_cond_broadcast(&kcond);
+	pthread_mutex_unlock(&klock);
+}
+
+Result HostSrv_GetServiceHandle(Handle* out, const char* name) {
+	pthread_mutex_lock(&klock);
+	for (;;) {
+		for (size_t i = 0; i < sizeof(ports) / sizeof(ports[0]); ++i) {
+			KObject* port = ports[i];
+			if (!port || strncmp(port->port.name, name, 8))
+				continue;
+			if (port->port.npending >= 8) {
+				pthread_mutex_unlock(&klock);
+				return KERNEL_OUT_OF_HANDLES;
+			}
+
+			KSession* s = calloc(1, sizeof(KSession));
+			KObject* server = kobj_new(KOBJ_SERVER_SESSION);
+			KObject* client = kobj_new(KOBJ_CLIENT_SESSION);
+			if (!s)
+				kfail("out of memory");
+			s->refs = 2;
+			server->session = s;
+			client->session = s;
+
+			server->refs = 1; // held by the port until accepted
+			port->port.pending[port->port.npending++] = server;
+
+			Result res = handle_alloc(out, client);
+			pthread_cond_broadcast(&kcond);
+			pthread_mutex_unlock(&klock);
+			return res;
+		}
+		kwait(NULL);
+	}
+}
+
+// what the client library, client/spi_client.c, gets sessions through
+Result srvGetServiceHandle(Handle* out, const char* name) {
+	return HostSrv_GetServiceHandle(out, name);
+}
+
+// err:f
+
+Result errfInit(void) {
+	return 0;
+}
+
+void errfExit(void) {
+}
+
+void ERRF_ThrowResultNoRet(Result failure) {
+	fprintf(stderr, "hostsim: module threw result %08lX\n", (unsigned long)(u32)failure);
+	abort();
+}
@@ -0,0 +1,94 @@
+// LightLock on C11 atomics and futex, in place of source/3ds/synchronization.c (make LIGHTLOCK=c11)
+// Same states as ctrulib's: 1 free, n > 1 free with n - 1 threads woken or about to wait, -n held with n - 1 waiting,
+// 0 treated as 1. A compare and swap loop stands in for each ldrex/strex one and a futex for the arbiter,
+// so the lock can be watched under real multi core contention, by the module or by lockbench.
+#include <limits.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <3ds/types.h>
+#include <3ds/svc.h>
+#include <3ds/result.h>
+#include <3ds/synchronization.h>
+
+static void futex_wait(s32* addr, s32 val) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(s32* addr, s32 count) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+Result __sync_init(void)
+{
+	return 0;
+}
+
+void __sync_fini(void)
+{
+}
+
+// only the two the module uses, a wait can return early and every caller rechecks
+Result syncArbitrateAddress(s32* addr, ArbitrationType type, s32 value)
+{
+	if (type == ARBITRATION_SIGNAL) {
+		futex_wake(addr, value < 0 ? INT_MAX : value);
+		return 0;
+	}
+
+	s32 cur = atomic_load((_Atomic s32*)addr);
+	if (cur < value)
+		futex_wait(addr, cur);
+	return 0;
+}
+
+void LightLock_Init(LightLock* lock)
+{
+	atomic_store((_Atomic s32*)lock, 1);
+}
+
+void LightLock_Lock(LightLock* lock)
+{
+	_Atomic s32* state = (_Atomic s32*)lock;
+	s32 val = atomic_load_explicit(state, memory_order_relaxed);
+	s32 next;
+	bool locked;
+
+	// take it, or count ourselves in as a waiter
+	do {
+		s32 cur = val == 0 ? 1 : val;
+		locked = cur < 0;
+		next = locked ? cur - 1 : -cur;
+	} while (!atomic_compare_exchange_weak_explicit(state, &val, next, memory_order_acquire, memory_order_relaxed));
+
+	while (locked) {
+		// ARBITRATION_WAIT_IF_LESS_THAN 0, the futex only sleeps if nothing moved since the load
+		val = atomic_load_explicit(state, memory_order_relaxed);
+		if (val < 0)
+			futex_wait(lock, val);
+
+		// take it and stop counting as a waiter, or go back to sleep
+		val = atomic_load_explicit(state, memory_order_relaxed);
+		for (;;) {
+			locked = val < 0;
+			if (locked)
+				break;
+			if (atomic_compare_exchange_weak_explicit(state, &val, -(val - 1), memory_order_acquire, memory_order_relaxed))
+				break;
+		}
+	}
+}
+
+void LightLock_Unlock(LightLock* lock)
+{
+	_Atomic s32* state = (_Atomic s32*)lock;
+	s32 val = atomic_load_explicit(state, memory_order_relaxed);
+
+	while (!atomic_compare_exchange_weak_explicit(state, &val, -val, memory_order_release, memory_order_relaxed))
+		;
+
+	if (-val > 1)
+		futex_wake(lock, 1); // exactly one, like ARBITRATION_SIGNAL 1
+}
@@ -0,0 +1,332 @@
+// lockbench, lock algorithms under many threads with critical sections as long as SPI transfers
+// LightLock as the module uses it (lightlock.c, the same state machine on C11 atomics and futex),
+// a ticket lock, an MCS queue lock and a pthread mutex for reference, each thread taking the lock,
+// spinning for what N bytes at the legacy 4MHz would take, letting go and doing some work of its own.
+// Reports acquisitions per second, how evenly they went around and how long waits got.
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <3ds/types.h>
+#include <3ds/svc.h>
+#include <3ds/synchronization.h>
+
+#define MAX_THREADS 64
+#define MAX_SIZES   8
+#define WAIT_BUCKETS 40 // log2 of nanoseconds
+#define SPIN_TRIES  100 // polls before a waiter sleeps on the futex
+
+typedef struct McsNode {
+	_Atomic(struct McsNode*) next;
+	_Atomic s32 locked;
+} McsNode;
+
+typedef struct {
+	int index;
+	McsNode node;
+	u64 acquisitions;
+	u64 again; // took it right after letting it go, someone waiting or not
+	u64 waits[WAIT_BUCKETS];
+	u64 max_wait_ns;
+} Worker;
+
+typedef struct {
+	const char* name;
+	void (*lock)(Worker* self);
+	void (*unlock)(Worker* self);
+} LockAlgo;
+
+static int nthreads = 8;
+static u64 duration_ns = 500000000ULL;
+static u32 byte_ns = 2000; // legacy 4MHz, see __SPIGetRateByteTime
+static u32 outside_bytes = 4;
+static u32 sizes[MAX_SIZES] = { 0, 1, 4, 64 };
+static int nsizes = 4;
+static u32 hold_ns;
+static atomic_bool stop;
+static atomic_int last_owner = -1;
+static pthread_barrier_t start_barrier;
+
+static u64 now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// a polled transfer keeps the core busy, so does this
+static void spin_for(u32 ns) {
+	if (!ns)
+		return;
+	u64 end = now_ns() + ns;
+	while (now_ns() < end)
+		;
+}
+
+static void futex_wait(_Atomic s32* addr, s32 val) {
+	syscall(SYS_futex, (s32*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic s32* addr, s32 count) {
+	syscall(SYS_futex, (s32*)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// LightLock, what SPI_Bus.lock and the rest are
+
+static LightLock light = LIGHTLOCK_STATICINIT;
+
+static void light_lock(Worker* self) {
+	(void)self;
+	LightLock_Lock(&light);
+}
+
+static void light_unlock(Worker* self) {
+	(void)self;
+	LightLock_Unlock(&light);
+}
+
+// ticket lock, strict arrival order, every waiter woken on each hand off
+
+static _Atomic s32 ticket_next, ticket_serving;
+
+static void ticket_lock(Worker* self) {
+	(void)self;
+	s32 mine = atomic_fetch_add(&ticket_next, 1);
+	for (int i = 0; i < SPIN_TRIES; ++i)
+		if (atomic_load_explicit(&ticket_serving, memory_order_acquire) == mine)
+			return;
+
+	s32 serving;
+	while ((serving = atomic_load_explicit(&ticket_serving, memory_order_acquire)) != mine)
+		futex_wait(&ticket_serving, serving);
+}
+
+static void ticket_unlock(Worker* self) {
+	(void)self;
+	s32 serving = atomic_fetch_add_explicit(&ticket_serving, 1, memory_order_release) + 1;
+	if (atomic_load(&ticket_next) != serving)
+		futex_wake(&ticket_serving, INT_MAX); // can't pick the one whose turn it is
+}
+
+// MCS queue lock, arrival order too, each waiter sleeps on its own node and only the next one gets woken
+
+static _Atomic(McsNode*) mcs_tail;
+
+static void mcs_lock(Worker* self) {
+	McsNode* node = &self->node;
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&node->locked, 1, memory_order_relaxed);
+
+	McsNode* prev = atomic_exchange_explicit(&mcs_tail, node, memory_order_acq_rel);
+	if (!prev)
+		return;
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+
+	for (int i = 0; i < SPIN_TRIES; ++i)
+		if (!atomic_load_explicit(&node->locked, memory_order_acquire))
+			return;
+	while (atomic_load_explicit(&node->locked, memory_order_acquire))
+		futex_wait(&node->locked, 1);
+}
+
+static void mcs_unlock(Worker* self) {
+	McsNode* node = &self->node;
+	McsNode* next = atomic_load_explicit(&node->next, memory_order_acquire);
+
+	if (!next) {
+		McsNode* expected = node;
+		if (atomic_compare_exchange_strong_explicit(&mcs_tail, &expected, NULL, memory_order_acq_rel, memory_order_acquire))
+			return;
+		// someone swapped in behind us and hasn't linked up yet
+		while (!(next = atomic_load_explicit(&node->next, memory_order_acquire)))
+			sched_yield();
+	}
+
+	atomic_store_explicit(&next->locked, 0, memory_order_release);
+	futex_wake(&next->locked, 1);
+}
+
+// pthread mutex, for reference
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void mutex_lock(Worker* self) {
+	(void)self;
+	pthread_mutex_lock(&mutex);
+}
+
+static void mutex_unlock(Worker* self) {
+	(void)self;
+	pthread_mutex_unlock(&mutex);
+}
+
+static const LockAlgo algos[] = {
+	{ "lightlock", light_lock, light_unlock },
+	{ "ticket", ticket_lock, ticket_unlock },
+	{ "mcs", mcs_lock, mcs_unlock },
+	{ "pthread", mutex_lock, mutex_unlock },
+};
+#define NALGOS (sizeof(algos) / sizeof(algos[0]))
+
+static bool algo_enabled[NALGOS] = { true, true, true, true };
+
+static const LockAlgo* current;
+
+static int log2_bucket(u64 ns) {
+	int b = 0;
+	while (ns > 1 && b < WAIT_BUCKETS - 1) {
+		ns >>= 1;
+		++b;
+	}
+	return b;
+}
+
+static void* worker_thread(void* arg) {
+	Worker* self = arg;
+	pthread_barrier_wait(&start_barrier);
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		u64 t0 = now_ns();
+		current->lock(self);
+		u64 waited = now_ns() - t0;
+
+		// only the holder touches these
+		if (atomic_load_explicit(&last_owner, memory_order_relaxed) == self->index)
+			++self->again;
+		atomic_store_explicit(&last_owner, self->index, memory_order_relaxed);
+		spin_for(hold_ns);
+
+		current->unlock(self);
+
+		++self->acquisitions;
+		++self->waits[log2_bucket(waited)];
+		if (waited > self->max_wait_ns)
+			self->max_wait_ns = waited;
+
+		spin_for(outside_bytes * byte_ns);
+	}
+	return NULL;
+}
+
+static void run(const LockAlgo* algo, u32 bytes) {
+	static Worker workers[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+
+	current = algo;
+	hold_ns = bytes * byte_ns;
+	atomic_store(&stop, false);
+	atomic_store(&last_owner, -1);
+	memset(workers, 0, sizeof(workers));
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+
+	for (int i = 0; i < nthreads; ++i) {
+		workers[i].index = i;
+		pthread_create(&threads[i], NULL, worker_thread, &workers[i]);
+	}
+	pthread_barrier_wait(&start_barrier);
+	u64 start = now_ns();
+	struct timespec ts = { (time_t)(duration_ns / 1000000000ULL), (long)(duration_ns % 1000000000ULL) };
+	nanosleep(&ts, NULL);
+	atomic_store(&stop, true);
+	for (int i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	u64 elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+
+	u64 total = 0, again = 0, min = ~0ULL, max = 0, max_wait = 0;
+	double sum_sq = 0;
+	u64 waits[WAIT_BUCKETS] = { 0 };
+	for (int i = 0; i < nthreads; ++i) {
+		Worker* w = &workers[i];
+		total += w->acquisitions;
+		again += w->again;
+		min = w->acquisitions < min ? w->acquisitions : min;
+		max = w->acquisitions > max ? w->acquisitions : max;
+		sum_sq += (double)w->acquisitions * w->acquisitions;
+		max_wait = w->max_wait_ns > max_wait ? w->max_wait_ns : max_wait;
+		for (int b = 0; b < WAIT_BUCKETS; ++b)
+			waits[b] += w->waits[b];
+	}
+
+	// Jain's index, 1 when every thread got the same share, 1 / threads when one got it all
+	double jain = sum_sq ? (double)total * total / (nthreads * sum_sq) : 0;
+	u64 p99 = 0, seen = 0;
+	for (int b = 0; b < WAIT_BUCKETS; ++b) {
+		seen += waits[b];
+		if (seen * 100 >= total * 99) {
+			p99 = 2ULL << b; // bucket's upper end
+			break;
+		}
+	}
+
+	printf("%-10s %6u %12.0f %8.3f %8llu %8llu %7.1f%% %10.1f %10.1f\n",
+		algo->name, bytes, total * 1e9 / elapsed, jain, (unsigned long long)min, (unsigned long long)max,
+		total ? again * 100.0 / total : 0, p99 / 1e3, max_wait / 1e3);
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: lockbench [options]\n"
+		"  -t N              threads (8)\n"
+		"  -d MS             run time per lock and size (500)\n"
+		"  -s N[,N...]       bytes transferred while holding the lock (0,1,4,64)\n"
+		"  -o N              bytes worth of work between acquisitions (4)\n"
+		"  -b NS             time a byte takes, 2000 is legacy 4MHz (2000)\n"
+		"  -l NAME[,NAME...] locks to run, lightlock, ticket, mcs, pthread (all)\n");
+	exit(2);
+}
+
+static void parse_locks(char* list) {
+	memset(algo_enabled, 0, sizeof(algo_enabled));
+	for (char* name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		size_t i = 0;
+		while (i < NALGOS && strcmp(algos[i].name, name))
+			++i;
+		if (i == NALGOS)
+			usage();
+		algo_enabled[i] = true;
+	}
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "t:d:s:o:b:l:h")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_THREADS)
+				usage();
+			break;
+		case 'd': duration_ns = strtoull(optarg, NULL, 0) * 1000000ULL; break;
+		case 's':
+			nsizes = 0;
+			for (char* n = strtok(optarg, ","); n && nsizes < MAX_SIZES; n = strtok(NULL, ","))
+				sizes[nsizes++] = strtoul(n, NULL, 0);
+			break;
+		case 'o': outside_bytes = strtoul(optarg, NULL, 0); break;
+		case 'b': byte_ns = strtoul(optarg, NULL, 0); break;
+		case 'l': parse_locks(optarg); break;
+		default: usage();
+		}
+	}
+
+	printf("%d threads on %ld cores, %u ns a byte, %u bytes of work between acquisitions\n",
+		nthreads, sysconf(_SC_NPROCESSORS_ONLN), byte_ns, outside_bytes);
+	printf("%-10s %6s %12s %8s %8s %8s %8s %10s %10s\n",
+		"lock", "bytes", "acq/s", "jain", "min", "max", "again", "p99 us", "max us");
+	for (int s = 0; s < nsizes; ++s) {
+		for (size_t i = 0; i < NALGOS; ++i)
+			if (algo_enabled[i])
+				run(&algos[i], sizes[s]);
+		printf("\n");
+	}
+	return 0;
+}
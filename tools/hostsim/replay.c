@@ -0,0 +1,268 @@
+// spireplay, feeds an IPC capture (cmd 0xF, or spibench -w) back into the host build of the module
+// Every service replays its own requests on its own thread, at the captured arrival times scaled by the speed,
+// so requests overlap across services the way they did when captured.
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <3ds/types.h>
+#include <3ds/result.h>
+#include <3ds/svc.h>
+#include <3ds/ipc.h>
+#include <spi.h>
+#include "hostsim.h"
+
+#define MAX_BUF 0x10000
+
+typedef struct {
+	const SPI_TraceRecord* rec;
+	u64 at_ns;      // scheduled, from replay start
+	u64 start_ns;   // actually sent
+	u64 service_ns;
+	Result result;
+	bool skipped;
+} Request;
+
+typedef struct {
+	int service;
+	Handle session;
+	u64 start;
+} ReplayArgs;
+
+static Request* requests;
+static u32 nrequests;
+static double speed = 1.0; // 0 is back to back
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: spireplay [options] TRACE\n"
+		"  -s SPEED          1 replays at captured timing, 4 four times faster, 0 back to back (1)\n"
+		"  -o FILE           per request results as csv\n");
+	exit(1);
+}
+
+// requests that hand over handles can't be rebuilt from a capture, nor register updates, a record doesn't hold them,
+// nor asynchronous submits, their data offset and ticket depend on a ring and tickets the replay doesn't have
+static bool replayable(u32 header) {
+	u16 id = header >> 16;
+	if (id == 0x15 || id == 0x1F || id == 0x20)
+		return false;
+	return (header & 0x3F) == 0 || id == 0x6 || id == 0x7 || id == 0x12 || id == 0x13;
+}
+
+static Result send(Handle session, const SPI_TraceRecord* rec, void* buf) {
+	u32* cmdbuf = getThreadCommandBuffer();
+	u32 header = rec->header;
+	u16 id = header >> 16;
+	u32 normal = (header >> 6) & 0x3F;
+
+	memset(cmdbuf, 0, 0x100);
+	cmdbuf[0] = header;
+	cmdbuf[1] = rec->args[0];
+	cmdbuf[2] = rec->args[1];
+	cmdbuf[3] = rec->args[2];
+
+	if (id >= 0x3 && id <= 0x7) {
+		u32 base = id == 0x4 ? 20 : id == 0x5 ? 3 : 4;
+		if (normal == base + 1)
+			cmdbuf[base + 1] = rec->deadline;
+	}
+
+	switch (id) {
+	case 0x3:
+		cmdbuf[4] = rec->length;
+		break;
+	case 0x4:
+		memset(&cmdbuf[4], 0x5A, 64); // payload isn't captured, only its length
+		cmdbuf[20] = rec->length;
+		break;
+	case 0x6:
+	case 0x7:
+		cmdbuf[4] = rec->length;
+		cmdbuf[normal + 1] = IPC_Desc_Buffer(rec->length, id == 0x6 ? IPC_BUFFER_W : IPC_BUFFER_R);
+		cmdbuf[normal + 2] = (u32)(uptr)buf;
+		break;
+	case 0x12:
+	case 0x13:
+		cmdbuf[4] = IPC_Desc_Buffer(rec->length, id == 0x12 ? IPC_BUFFER_W : IPC_BUFFER_R);
+		cmdbuf[5] = (u32)(uptr)buf;
+		break;
+	}
+
+	Result res = svcSendSyncRequest(session);
+	return R_FAILED(res) ? res : (Result)cmdbuf[1];
+}
+
+static void* replay_thread(void* _args) {
+	ReplayArgs* args = _args;
+	void* buf = HostKernel_Alloc32(MAX_BUF);
+
+	for (u32 i = 0; i < nrequests; ++i) {
+		Request* req = &requests[i];
+		if (req->rec->service != args->service)
+			continue;
+		if (!replayable(req->rec->header) || req->rec->length > MAX_BUF) {
+			req->skipped = true;
+			continue;
+		}
+
+		u64 due = args->start + req->at_ns;
+		u64 now = HostKernel_Now();
+		if (speed > 0 && now < due)
+			svcSleepThread(due - now);
+
+		req->start_ns = HostKernel_Now() - args->start;
+		req->result = send(args->session, req->rec, buf);
+		req->service_ns = HostKernel_Now() - args->start - req->start_ns;
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	u64 x = *(const u64*)a, y = *(const u64*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_row(const char* name, u64* lat, u32 n, u32 errors) {
+	if (!n)
+		return;
+	qsort(lat, n, sizeof(u64), cmp_u64);
+	u64 sum = 0;
+	for (u32 i = 0; i < n; ++i)
+		sum += lat[i];
+	printf("%-9s %8lu %9.1f %9.1f %9.1f %9.1f %6lu\n", name, (unsigned long)n, sum / 1e3 / n,
+		lat[(n - 1) / 2] / 1e3, lat[(u32)((n - 1) * 0.99)] / 1e3, lat[n - 1] / 1e3, (unsigned long)errors);
+}
+
+static void report(u64 wall) {
+	u64* lat = malloc(nrequests * sizeof(u64) + 1);
+	u32 skipped = 0;
+	u64 late = 0;
+
+	for (u32 i = 0; i < nrequests; ++i) {
+		if (requests[i].skipped) {
+			++skipped;
+			continue;
+		}
+		u64 behind = requests[i].start_ns > requests[i].at_ns ? requests[i].start_ns - requests[i].at_ns : 0;
+		if (behind > late)
+			late = behind;
+	}
+
+	printf("replayed %lu requests in %.1f ms, %lu skipped", (unsigned long)(nrequests - skipped), wall / 1e6, (unsigned long)skipped);
+	if (speed > 0)
+		printf(", sent up to %.1f us behind schedule", late / 1e3);
+	printf("\n");
+	printf("%-9s %8s %9s %9s %9s %9s %6s\n", "", "requests", "mean(us)", "p50(us)", "p99(us)", "max(us)", "errors");
+
+	for (int s = 0; s < 5; ++s) {
+		u32 n = 0, errors = 0;
+		for (u32 i = 0; i < nrequests; ++i) {
+			if (requests[i].skipped || requests[i].rec->service != s)
+				continue;
+			lat[n++] = requests[i].service_ns;
+			errors += R_FAILED(requests[i].result);
+		}
+		print_row(HostBoard_ServiceNames[s], lat, n, errors);
+	}
+
+	for (u16 id = 0x1; id <= 0x16; ++id) {
+		u32 n = 0, errors = 0;
+		for (u32 i = 0; i < nrequests; ++i) {
+			if (requests[i].skipped || requests[i].rec->header >> 16 != id)
+				continue;
+			lat[n++] = requests[i].service_ns;
+			errors += R_FAILED(requests[i].result);
+		}
+		char name[16];
+		snprintf(name, sizeof(name), "cmd 0x%X", id);
+		print_row(name, lat, n, errors);
+	}
+
+	free(lat);
+}
+
+static void write_csv(const char* path) {
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(f, "index,service,cmd,length,scheduled_us,sent_us,service_us,result\n");
+	for (u32 i = 0; i < nrequests; ++i) {
+		const Request* req = &requests[i];
+		if (req->skipped)
+			continue;
+		fprintf(f, "%lu,%u,0x%X,%lu,%.1f,%.1f,%.1f,0x%08lX\n", (unsigned long)i, req->rec->service,
+			req->rec->header >> 16, (unsigned long)req->rec->length, req->at_ns / 1e3, req->start_ns / 1e3,
+			req->service_ns / 1e3, (unsigned long)(u32)req->result);
+	}
+	fclose(f);
+}
+
+int main(int argc, char** argv) {
+	const char* csv_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:o:h")) != -1) {
+		switch (opt) {
+		case 's': speed = strtod(optarg, NULL); break;
+		case 'o': csv_path = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || speed < 0)
+		usage();
+
+	FILE* f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	SPI_Trace header;
+	if (fread(&header, sizeof(header), 1, f) != 1) {
+		fprintf(stderr, "spireplay: %s is not a capture\n", argv[optind]);
+		return 1;
+	}
+	SPI_TraceRecord* records = malloc(header.count * sizeof(SPI_TraceRecord) + 1);
+	nrequests = fread(records, sizeof(SPI_TraceRecord), header.count, f);
+	fclose(f);
+	if (nrequests != header.count)
+		fprintf(stderr, "spireplay: capture cut short, %lu of %lu records\n", (unsigned long)nrequests, (unsigned long)header.count);
+	if (header.dropped)
+		fprintf(stderr, "spireplay: capture dropped %lu requests\n", (unsigned long)header.dropped);
+
+	requests = calloc(nrequests + 1, sizeof(Request));
+	u64 ticks = 0;
+	for (u32 i = 0; i < nrequests; ++i) {
+		ticks += records[i].delta;
+		requests[i].rec = &records[i];
+		requests[i].at_ns = speed > 0 ? (u64)(ticks * 1e9 / HOSTSIM_TICKS_PER_SEC / speed) : 0;
+		if (records[i].service > 4)
+			requests[i].skipped = true;
+	}
+
+	Handle sessions[5];
+	if (!HostBoard_Start(sessions))
+		return 1;
+
+	pthread_t threads[5];
+	ReplayArgs args[5];
+	u64 start = HostKernel_Now();
+	for (int s = 0; s < 5; ++s) {
+		args[s] = (ReplayArgs){ s, sessions[s], start };
+		pthread_create(&threads[s], NULL, replay_thread, &args[s]);
+	}
+	for (int s = 0; s < 5; ++s)
+		pthread_join(threads[s], NULL);
+	u64 wall = HostKernel_Now() - start;
+
+	report(wall);
+	if (csv_path)
+		write_csv(csv_path);
+
+	return HostBoard_Stop(sessions) ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+// sizebudget, per function sizes of the module from the nm -CSn listing the build leaves next to the elf
+// Compared against a committed budget, and against a second build of the same sources (the hot paths profile)
+// so a speed change shows what it costs in code.bin.
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SYMS 1024
+
+typedef struct {
+	char name[96];
+	char type;
+	long size[2];  // size profile, hot profile, -1 if not in it
+	long budget;   // -1 if not in the budget
+} Sym;
+
+static Sym syms[MAX_SYMS];
+static int nsyms;
+static long budget_total = -1;
+
+static Sym* find(const char* name, char type) {
+	for (int i = 0; i < nsyms; ++i)
+		if (!strcmp(syms[i].name, name))
+			return &syms[i];
+	if (nsyms == MAX_SYMS) {
+		fprintf(stderr, "sizebudget: too many symbols\n");
+		exit(2);
+	}
+	Sym* s = &syms[nsyms++];
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	s->type = type;
+	s->size[0] = s->size[1] = s->budget = -1;
+	return s;
+}
+
+static bool is_code(char type) {
+	return type == 'T' || type == 't' || type == 'W' || type == 'w';
+}
+
+// text, rodata, data, bss, the first three are what ends up in code.bin
+static int section(char type) {
+	switch (type) {
+	case 'T': case 't': case 'W': case 'w': return 0;
+	case 'R': case 'r': return 1;
+	case 'D': case 'd': return 2;
+	case 'B': case 'b': return 3;
+	}
+	return -1;
+}
+
+static void load_listing(const char* path, int profile, long totals[4]) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+
+	char line[512], name[256];
+	unsigned long addr, size;
+	char type;
+	while (fgets(line, sizeof(line), f)) {
+		// symbols without a size, labels and such, only have the address
+		if (sscanf(line, "%lx %lx %c %255s", &addr, &size, &type, name) != 4)
+			continue;
+		int sec = section(type);
+		if (sec < 0)
+			continue;
+		totals[sec] += size;
+		if (is_code(type))
+			find(name, type)->size[profile] = size;
+	}
+	fclose(f);
+}
+
+// asked for a budget and none there is an error, not a pass, make size-budget writes one
+static void load_budget(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		fprintf(stderr, "sizebudget: make size-budget writes one\n");
+		exit(2);
+	}
+
+	char line[512], name[256];
+	long size;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%255s %ld", name, &size) != 2)
+			continue;
+		if (!strcmp(name, "total"))
+			budget_total = size;
+		else
+			find(name, 'T')->budget = size;
+	}
+	fclose(f);
+	if (budget_total < 0) {
+		fprintf(stderr, "sizebudget: no total in %s\n", path);
+		exit(2);
+	}
+}
+
+static void write_budget(const char* path, long total) {
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+	fprintf(f, "# code.bin budget, text + rodata + data, then bytes per function\n");
+	fprintf(f, "# written by make size-budget, compared by make size\n");
+	fprintf(f, "total %ld\n", total);
+	for (int i = 0; i < nsyms; ++i)
+		if (syms[i].size[0] >= 0)
+			fprintf(f, "%s %ld\n", syms[i].name, syms[i].size[0]);
+	fclose(f);
+}
+
+static int by_size(const void* a, const void* b) {
+	const Sym* x = a;
+	const Sym* y = b;
+	if (x->size[0] != y->size[0])
+		return x->size[0] < y->size[0] ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: sizebudget [options] SIZE.lst [HOT.lst]\n"
+		"  -b FILE           budget to compare against, fails if the total is over it or FILE isn't there\n"
+		"  -w FILE           write SIZE.lst out as the new budget\n");
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	const char* budget_path = NULL;
+	const char* write_path = NULL;
+	int arg = 1;
+
+	for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+		if (!strcmp(argv[arg], "-b"))
+			budget_path = argv[arg + 1];
+		else if (!strcmp(argv[arg], "-w"))
+			write_path = argv[arg + 1];
+		else
+			usage();
+	}
+	int nprofiles = argc - arg;
+	if (nprofiles < 1 || nprofiles > 2)
+		usage();
+
+	long totals[2][4] = { { 0 } };
+	bool have_budget = budget_path != NULL;
+	if (have_budget)
+		load_budget(budget_path);
+	for (int p = 0; p < nprofiles; ++p)
+		load_listing(argv[arg + p], p, totals[p]);
+
+	long total = totals[0][0] + totals[0][1] + totals[0][2];
+	if (write_path) {
+		write_budget(write_path, total);
+		printf("budget written to %s, %ld bytes\n", write_path, total);
+		return 0;
+	}
+
+	qsort(syms, nsyms, sizeof(Sym), by_size);
+
+	printf("%-40s %7s", "function", "size");
+	if (nprofiles == 2)
+		printf(" %7s %7s", "hot", "cost");
+	if (have_budget)
+		printf(" %7s %7s", "budget", "over");
+	printf("\n");
+
+	for (int i = 0; i < nsyms; ++i) {
+		const Sym* s = &syms[i];
+		if (s->size[0] < 0 && s->size[1] < 0)
+			continue; // only in the budget, gone since
+		printf("%-40s %7ld", s->name, s->size[0] < 0 ? 0 : s->size[0]);
+		if (nprofiles == 2)
+			printf(" %7ld %+7ld", s->size[1] < 0 ? 0 : s->size[1],
+				(s->size[1] < 0 ? 0 : s->size[1]) - (s->size[0] < 0 ? 0 : s->size[0]));
+		if (have_budget) {
+			if (s->budget < 0)
+				printf(" %7s %7s", "-", "new");
+			else if (s->size[0] > s->budget)
+				printf(" %7ld %+7ld", s->budget, s->size[0] - s->budget);
+			else
+				printf(" %7ld %7s", s->budget, "");
+		}
+		printf("\n");
+	}
+
+	static const char* const names[4] = { "text", "rodata", "data", "bss" };
+	printf("\n");
+	for (int sec = 0; sec < 4; ++sec) {
+		printf("%-40s %7ld", names[sec], totals[0][sec]);
+		if (nprofiles == 2)
+			printf(" %7ld %+7ld", totals[1][sec], totals[1][sec] - totals[0][sec]);
+		printf("\n");
+	}
+
+	long hot_total = totals[1][0] + totals[1][1] + totals[1][2];
+	printf("%-40s %7ld", "code.bin (text + rodata + data)", total);
+	if (nprofiles == 2)
+		printf(" %7ld %+7ld", hot_total, hot_total - total);
+	printf("\n");
+
+	if (!have_budget)
+		return 0;
+	if (total > budget_total) {
+		printf("OVER budget, %ld bytes against %ld\n", total, budget_total);
+		return 1;
+	}
+	printf("within budget, %ld bytes against %ld\n", total, budget_total);
+	return 0;
+}
@@ -0,0 +1,230 @@
+// stackdepth, worst case stack depth per thread entry, from gcc -fcallgraph-info=su output (.ci files)
+// Every frame size gcc reports is added up along the deepest call path from each entry.
+// Functions without a size (assembly, or not in any of the files) count as 0 and get listed,
+// recursion and unbounded dynamic frames make the depth unknown, indirect calls are only listed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NODES 1024
+#define MAX_EDGES 4096
+#define MAX_ENTRIES 16
+
+typedef struct {
+	char title[128];
+	char name[64];
+	long size;      // -1 if gcc had none for it
+	int unbounded;  // dynamic frame without a bound
+	int state;      // 0 not done, 1 on the current path, 2 done
+	long depth;     // worst from here down, -1 unknown
+	int next;       // callee on the worst path, -1 for none
+	int first_edge;
+} Node;
+
+typedef struct {
+	int from;
+	int to;
+	int next_edge;
+} Edge;
+
+static Node nodes[MAX_NODES];
+static int nnodes;
+static Edge edges[MAX_EDGES];
+static int nedges;
+
+// copies what follows key up to the closing quote
+static int field(const char* line, const char* key, char* out, size_t size) {
+	const char* p = strstr(line, key);
+	if (!p)
+		return 0;
+	p += strlen(key);
+	size_t n = 0;
+	while (*p && *p != '"' && n + 1 < size)
+		out[n++] = *p++;
+	out[n] = 0;
+	return 1;
+}
+
+static int find(const char* title) {
+	for (int i = 0; i < nnodes; ++i)
+		if (!strcmp(nodes[i].title, title))
+			return i;
+	return -1;
+}
+
+static int add_node(const char* title) {
+	int i = find(title);
+	if (i >= 0)
+		return i;
+	if (nnodes == MAX_NODES) {
+		fprintf(stderr, "stackdepth: too many functions\n");
+		exit(2);
+	}
+	Node* n = &nodes[nnodes];
+	snprintf(n->title, sizeof(n->title), "%s", title);
+	const char* colon = strrchr(title, ':');
+	snprintf(n->name, sizeof(n->name), "%s", colon ? colon + 1 : title);
+	n->size = -1;
+	n->first_edge = -1;
+	n->next = -1;
+	return nnodes++;
+}
+
+static void parse(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+
+	char line[1024], title[128], label[512], target[128];
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "node:", 5) && field(line, "title: \"", title, sizeof(title))) {
+			Node* n = &nodes[add_node(title)];
+			// label is name\nfile:line:col\nN bytes (static|dynamic|dynamic,bounded), the \n as written
+			if (field(line, "label: \"", label, sizeof(label))) {
+				char* bytes = strstr(label, " bytes (");
+				if (bytes) {
+					char* start = bytes;
+					while (start > label && start[-1] >= '0' && start[-1] <= '9')
+						--start;
+					n->size = strtol(start, NULL, 10);
+					n->unbounded = !strncmp(bytes, " bytes (dynamic)", 16);
+				}
+			}
+		} else if (!strncmp(line, "edge:", 5) && field(line, "sourcename: \"", title, sizeof(title))
+			&& field(line, "targetname: \"", target, sizeof(target))) {
+			if (nedges == MAX_EDGES) {
+				fprintf(stderr, "stackdepth: too many calls\n");
+				exit(2);
+			}
+			int from = add_node(title);
+			edges[nedges] = (Edge){ from, add_node(target), nodes[from].first_edge };
+			nodes[from].first_edge = nedges++;
+		}
+	}
+	fclose(f);
+}
+
+static int unknown_seen[MAX_NODES];
+
+static long depth(int i) {
+	Node* n = &nodes[i];
+	if (n->state == 2)
+		return n->depth;
+	if (n->state == 1) {
+		fprintf(stderr, "stackdepth: %s recurses\n", n->name);
+		return -1;
+	}
+
+	n->state = 1;
+	long worst = 0;
+	int known = !n->unbounded;
+	if (n->size < 0)
+		unknown_seen[i] = 1;
+
+	for (int e = n->first_edge; e >= 0; e = edges[e].next_edge) {
+		long d = depth(edges[e].to);
+		if (d < 0)
+			known = 0;
+		else if (d > worst) {
+			worst = d;
+			n->next = edges[e].to;
+		}
+	}
+
+	n->state = 2;
+	n->depth = known ? (n->size > 0 ? n->size : 0) + worst : -1;
+	return n->depth;
+}
+
+static int resolve(const char* name) {
+	int i = find(name);
+	if (i >= 0)
+		return i;
+	for (i = 0; i < nnodes; ++i)
+		if (!strcmp(nodes[i].name, name) && nodes[i].size >= 0)
+			return i;
+	return -1;
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: stackdepth -e FUNC[:LIMIT] [-e ...] FILE.ci...\n"
+		"  -e FUNC[:LIMIT]   thread entry, fails if its worst case goes over LIMIT bytes\n");
+	exit(2);
+}
+
+int main(int argc, char** argv) {
+	const char* entries[MAX_ENTRIES];
+	long limits[MAX_ENTRIES];
+	int nentries = 0;
+	int arg = 1;
+
+	for (; arg < argc && !strcmp(argv[arg], "-e"); arg += 2) {
+		if (arg + 1 >= argc || nentries == MAX_ENTRIES)
+			usage();
+		char* spec = argv[arg + 1];
+		char* colon = strchr(spec, ':');
+		limits[nentries] = colon ? strtol(colon + 1, NULL, 0) : 0;
+		if (colon)
+			*colon = 0;
+		entries[nentries++] = spec;
+	}
+	if (!nentries || arg >= argc)
+		usage();
+
+	for (; arg < argc; ++arg)
+		parse(argv[arg]);
+
+	// calls to functions defined in another file show up as sizeless nodes, point them at the definition
+	for (int e = 0; e < nedges; ++e) {
+		Node* to = &nodes[edges[e].to];
+		if (to->size < 0 && !strchr(to->title, ':')) {
+			int def = resolve(to->name);
+			if (def >= 0)
+				edges[e].to = def;
+		}
+	}
+
+	int failed = 0;
+	for (int k = 0; k < nentries; ++k) {
+		int i = resolve(entries[k]);
+		if (i < 0) {
+			fprintf(stderr, "stackdepth: no %s in the call graph\n", entries[k]);
+			failed = 1;
+			continue;
+		}
+
+		memset(unknown_seen, 0, sizeof(unknown_seen));
+		for (int j = 0; j < nnodes; ++j)
+			nodes[j].state = 0;
+
+		long d = depth(i);
+		int over = d < 0 || (limits[k] && d > limits[k]);
+		failed |= over && limits[k];
+
+		if (d < 0)
+			printf("%-16s unknown", entries[k]);
+		else
+			printf("%-16s %5ld bytes", entries[k], d);
+		if (limits[k])
+			printf(" of %ld, %s", limits[k], over ? "OVER" : "ok");
+		printf("\n ");
+		for (int j = i; j >= 0; j = nodes[j].next)
+			printf(" %s %ld%s", nodes[j].name, nodes[j].size > 0 ? nodes[j].size : 0, nodes[j].next >= 0 ? " >" : "");
+		printf("\n");
+
+		int any = 0;
+		for (int j = 0; j < nnodes; ++j) {
+			if (!unknown_seen[j])
+				continue;
+			printf("%s %s", any ? "," : "  counted as 0:", nodes[j].name);
+			any = 1;
+		}
+		if (any)
+			printf("\n");
+	}
+
+	return failed;
+}